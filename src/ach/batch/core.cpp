@@ -0,0 +1,472 @@
+#include <ach/batch/core.hpp>
+#include <ach/mirror/line_split.hpp>
+#include <ach/text/utils.hpp>
+#include <ach/web/html_builder.hpp>
+#include <ach/utility/visitor.hpp>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <numeric>
+#include <optional>
+#include <utility>
+
+namespace ach::batch {
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+const mirror::highlighter_options default_mirror_options = {};
+
+constexpr std::size_t whole_job = static_cast<std::size_t>(-1);
+
+struct task
+{
+	std::size_t job;
+	std::size_t piece; // index in pieces of the job or whole_job
+	std::size_t size; // code and color bytes
+};
+
+// same conditions as line-parallel mirror::run_highlighter
+bool can_split(const mirror_job& job, const mirror::highlighter_options& options, const batch_options& batch)
+{
+	if (batch.split_threshold == 0 || batch.piece_size == 0 || job.code.size() <= batch.split_threshold)
+		return false;
+
+	if (options.generation.coalesce_spans || options.generation.class_map != nullptr)
+		return false;
+
+	return std::count(job.code.begin(), job.code.end(), '\n') == std::count(job.color.begin(), job.color.end(), '\n');
+}
+
+// Errors of a mirror highlighter may refer to its owned copy of options which changes
+// with the next job - refer to options of the job instead.
+void rebase_error(mirror::highlighter_error& error, const mirror::color_options& owned, const mirror::color_options& original)
+{
+	const std::array<std::pair<std::string_view, std::string_view>, 5> names = {{
+		{owned.num_class, original.num_class},
+		{owned.str_class, original.str_class},
+		{owned.str_esc_class, original.str_esc_class},
+		{owned.chr_class, original.chr_class},
+		{owned.chr_esc_class, original.chr_esc_class}
+	}};
+
+	for (const auto& [from, to] : names) {
+		if (error.extra_reason.data() == from.data() && error.extra_reason.size() == from.size()) {
+			error.extra_reason = to;
+			return;
+		}
+	}
+}
+
+}
+
+double batch_stats::utilization(std::size_t worker) const noexcept
+{
+	if (worker >= workers.size() || wall_time.count() <= 0)
+		return 0.0;
+
+	return static_cast<double>(workers[worker].busy_time.count()) / static_cast<double>(wall_time.count());
+}
+
+job_result job_context::run(const job& j)
+{
+	return std::visit(utility::visitor{
+		[&](const mirror_job& job) {
+			return run_mirror(job.options != nullptr ? *job.options : default_mirror_options, job.code, job.color, 0, false);
+		},
+		[&](const clangd_job& job) -> job_result {
+			const std::variant<std::string_view, clangd::highlighter_error> output =
+				job.highlighter->run(m_clangd_context, job.code, job.semantic_tokens, job.options);
+			job_result result;
+			if (const auto error = std::get_if<clangd::highlighter_error>(&output); error != nullptr)
+				result = *error;
+			else
+				result = std::string(std::get<std::string_view>(output));
+
+			m_clangd_context.trim();
+			// tokens must not refer to the arena once it is reused
+			utility::release_memory(m_clangd_context.code_tokens);
+			m_clangd_arena.release();
+			return result;
+		}
+	}, j);
+}
+
+void job_context::reset() noexcept
+{
+	for (mirror_slot& slot : m_mirror_slots)
+		slot.options = nullptr;
+}
+
+void job_context::set_retention_policy(const utility::retention_policy& policy)
+{
+	for (mirror_slot& slot : m_mirror_slots)
+		slot.hl.set_retention_policy(policy);
+
+	m_clangd_context.retention = policy;
+}
+
+std::size_t job_context::retained_bytes() const noexcept
+{
+	std::size_t result = m_clangd_context.retained_bytes();
+	for (const mirror_slot& slot : m_mirror_slots)
+		result += slot.hl.retained_bytes();
+
+	return result;
+}
+
+job_result job_context::run_mirror(
+	const mirror::highlighter_options& options,
+	std::string_view code,
+	std::string_view color,
+	std::size_t first_line,
+	bool is_piece)
+{
+	mirror::highlighter& hl = mirror_highlighter(options, is_piece);
+	const std::variant<std::string_view, mirror::highlighter_error> output = hl.run(code, color);
+	job_result result;
+	if (const auto error = std::get_if<mirror::highlighter_error>(&output); error != nullptr) {
+		mirror::highlighter_error e = *error;
+		rebase_error(e, hl.options().color, options.color);
+		e.code_location = mirror::shift_lines(e.code_location, first_line);
+		e.color_location = mirror::shift_lines(e.color_location, first_line);
+		result = e;
+	}
+	else {
+		result = std::string(std::get<std::string_view>(output));
+	}
+
+	hl.trim();
+	return result;
+}
+
+mirror::highlighter& job_context::mirror_highlighter(const mirror::highlighter_options& options, bool is_piece)
+{
+	for (mirror_slot& slot : m_mirror_slots)
+		if (slot.options == &options && slot.is_piece == is_piece)
+			return slot.hl;
+
+	mirror_slot& slot = m_mirror_slots[m_next_mirror_slot];
+	m_next_mirror_slot = (m_next_mirror_slot + 1) % num_mirror_slots;
+
+	slot.options = &options;
+	slot.is_piece = is_piece;
+	if (is_piece) {
+		// pieces are wrapped after concatenation, their programs are used once
+		// (they would evict useful entries from the program cache)
+		mirror::highlighter_options piece_options = options;
+		piece_options.generation.table_wrap_css_class = {};
+		piece_options.generation.program_cache = nullptr;
+		slot.hl.set_options(piece_options);
+	}
+	else {
+		slot.hl.set_options(options);
+	}
+
+	return slot.hl;
+}
+
+struct scheduler::worker
+{
+	explicit worker(const utility::retention_policy& retention)
+	{
+		context.set_retention_policy(retention);
+	}
+
+	// before each run: options of previous runs may no longer exist
+	void reset()
+	{
+		tasks.clear();
+		queued_bytes = 0;
+		stats = {};
+		context.reset();
+	}
+
+	std::mutex mutex; // protects tasks
+	std::deque<std::size_t> tasks; // indexes of batch tasks, largest first
+	std::atomic<std::size_t> queued_bytes = 0; // +1 per task, so that empty tasks can be stolen
+
+	job_context context;
+	worker_stats stats;
+};
+
+struct scheduler::batch_state
+{
+	const std::vector<job>& jobs;
+	std::vector<task> tasks;
+	std::vector<std::size_t> first_task; // per job
+	std::vector<std::vector<mirror::line_split_part>> pieces; // per job, empty if not split
+	std::vector<job_result> task_results;
+	std::exception_ptr exception; // of the first task that threw, guarded by m_mutex
+};
+
+scheduler::scheduler(std::size_t num_threads, utility::retention_policy retention)
+{
+	if (num_threads == 0)
+		num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	m_workers.reserve(num_threads);
+	for (std::size_t i = 0; i < num_threads; ++i)
+		m_workers.push_back(std::make_unique<worker>(retention));
+
+	m_threads.reserve(num_threads);
+	for (std::size_t i = 0; i < num_threads; ++i)
+		m_threads.emplace_back([this, i]() { worker_loop(i); });
+}
+
+scheduler::~scheduler()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+
+	m_start_condition.notify_all();
+
+	for (std::thread& thread : m_threads)
+		thread.join();
+}
+
+std::vector<job_result> scheduler::run(const std::vector<job>& jobs, const batch_options& options)
+{
+	std::lock_guard<std::mutex> run_lock(m_run_mutex);
+	const clock_type::time_point start = clock_type::now();
+
+	batch_state batch{jobs, {}, {}, {}, {}, {}};
+	batch.first_task.reserve(jobs.size());
+	batch.pieces.resize(jobs.size());
+	std::size_t num_split_jobs = 0;
+
+	for (std::size_t i = 0; i < jobs.size(); ++i) {
+		batch.first_task.push_back(batch.tasks.size());
+
+		if (const mirror_job* const job = std::get_if<mirror_job>(&jobs[i]); job != nullptr) {
+			if (can_split(*job, job->options != nullptr ? *job->options : default_mirror_options, options)) {
+				batch.pieces[i] = mirror::split_into_parts(job->code, job->color, static_cast<std::size_t>(-1), options.piece_size);
+				for (std::size_t p = 0; p < batch.pieces[i].size(); ++p)
+					batch.tasks.push_back(task{i, p, batch.pieces[i][p].code.size() + batch.pieces[i][p].color.size()});
+
+				++num_split_jobs;
+				continue;
+			}
+
+			batch.tasks.push_back(task{i, whole_job, job->code.size() + job->color.size()});
+		}
+		else {
+			batch.tasks.push_back(task{i, whole_job, std::get<clangd_job>(jobs[i]).code.size()});
+		}
+	}
+
+	batch.task_results.resize(batch.tasks.size());
+
+	std::vector<std::size_t> order(batch.tasks.size());
+	std::iota(order.begin(), order.end(), std::size_t(0));
+	if (options.sort_by_size) {
+		std::stable_sort(order.begin(), order.end(), [&](std::size_t lhs, std::size_t rhs) {
+			return batch.tasks[lhs].size > batch.tasks[rhs].size;
+		});
+	}
+
+	// workers are idle: their state can be changed without locking
+	for (std::unique_ptr<worker>& w : m_workers)
+		w->reset();
+
+	for (std::size_t i = 0; i < order.size(); ++i) {
+		worker& w = *m_workers[i % m_workers.size()];
+		w.tasks.push_back(order[i]);
+		w.queued_bytes += batch.tasks[order[i]].size + 1;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_batch = &batch;
+		m_num_running = m_workers.size();
+		++m_generation;
+	}
+
+	m_start_condition.notify_all();
+
+	{
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done_condition.wait(lock, [this]() { return m_num_running == 0; });
+		m_batch = nullptr;
+	}
+
+	// other tasks have finished: workers are ready for the next run
+	if (batch.exception)
+		std::rethrow_exception(batch.exception);
+
+	std::vector<job_result> results;
+	results.reserve(jobs.size());
+	for (std::size_t i = 0; i < jobs.size(); ++i) {
+		const std::vector<mirror::line_split_part>& pieces = batch.pieces[i];
+		const std::size_t first_task = batch.first_task[i];
+
+		if (pieces.empty()) {
+			results.push_back(std::move(batch.task_results[first_task]));
+			continue;
+		}
+
+		// first error in text order, locations are already relative to the job
+		const auto first_error = std::find_if(
+			batch.task_results.begin() + first_task,
+			batch.task_results.begin() + first_task + pieces.size(),
+			[](const job_result& result) { return !std::holds_alternative<std::string>(result); });
+
+		if (first_error != batch.task_results.begin() + first_task + pieces.size()) {
+			results.push_back(std::move(*first_error));
+			continue;
+		}
+
+		const mirror_job& job = std::get<mirror_job>(jobs[i]);
+		const std::string_view table_wrap_css_class = (job.options != nullptr ? *job.options : default_mirror_options)
+			.generation.table_wrap_css_class;
+
+		std::size_t total_size = 0;
+		for (std::size_t p = 0; p < pieces.size(); ++p)
+			total_size += std::get<std::string>(batch.task_results[first_task + p]).size();
+
+		web::html_builder builder;
+		builder.reserve(total_size);
+		if (!table_wrap_css_class.empty())
+			builder.open_table(text::count_lines(job.code), table_wrap_css_class);
+
+		// already escaped - append directly
+		for (std::size_t p = 0; p < pieces.size(); ++p)
+			builder.str() += std::get<std::string>(batch.task_results[first_task + p]);
+
+		if (!table_wrap_css_class.empty())
+			builder.close_table();
+
+		results.push_back(std::move(builder.str()));
+	}
+
+	batch_stats stats;
+	stats.wall_time = clock_type::now() - start;
+	stats.num_tasks = batch.tasks.size();
+	stats.num_split_jobs = num_split_jobs;
+	stats.workers.reserve(m_workers.size());
+	for (const std::unique_ptr<worker>& w : m_workers)
+		stats.workers.push_back(w->stats);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stats = std::move(stats);
+	}
+
+	return results;
+}
+
+batch_stats scheduler::stats() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats;
+}
+
+void scheduler::worker_loop(std::size_t index)
+{
+	worker& w = *m_workers[index];
+	std::size_t generation = 0;
+
+	while (true) {
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_start_condition.wait(lock, [&]() { return m_stopping || m_generation != generation; });
+
+			if (m_stopping)
+				return;
+
+			generation = m_generation;
+		}
+
+		run_tasks(w);
+
+		bool is_last = false;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			is_last = --m_num_running == 0;
+		}
+
+		if (is_last)
+			m_done_condition.notify_one();
+	}
+}
+
+void scheduler::run_tasks(worker& w)
+{
+	batch_state& batch = *m_batch;
+
+	// own tasks first, then the largest task of the worker with the most queued bytes
+	const auto take_task = [&]() -> std::optional<std::size_t> {
+		{
+			std::lock_guard<std::mutex> lock(w.mutex);
+			if (!w.tasks.empty()) {
+				const std::size_t t = w.tasks.front();
+				w.tasks.pop_front();
+				w.queued_bytes -= batch.tasks[t].size + 1;
+				return t;
+			}
+		}
+
+		while (true) {
+			worker* victim = nullptr;
+			std::size_t max_queued_bytes = 0;
+			for (std::unique_ptr<worker>& other : m_workers) {
+				const std::size_t queued_bytes = other->queued_bytes.load(std::memory_order_relaxed);
+				if (other.get() != &w && queued_bytes > max_queued_bytes) {
+					victim = other.get();
+					max_queued_bytes = queued_bytes;
+				}
+			}
+
+			// tasks are never added during a run: nothing queued means nothing left
+			if (victim == nullptr)
+				return std::nullopt;
+
+			std::lock_guard<std::mutex> lock(victim->mutex);
+			if (!victim->tasks.empty()) {
+				const std::size_t t = victim->tasks.front();
+				victim->tasks.pop_front();
+				victim->queued_bytes -= batch.tasks[t].size + 1;
+				++w.stats.num_stolen;
+				return t;
+			}
+		}
+	};
+
+	for (std::optional<std::size_t> t = take_task(); t; t = take_task()) {
+		const task& tk = batch.tasks[*t];
+		job_result& result = batch.task_results[*t];
+		const clock_type::time_point start = clock_type::now();
+
+		const job& j = batch.jobs[tk.job];
+		try {
+			if (tk.piece != whole_job) {
+				const mirror_job& job = std::get<mirror_job>(j);
+				const mirror::line_split_part& p = batch.pieces[tk.job][tk.piece];
+				result = w.context.run_mirror(
+					job.options != nullptr ? *job.options : default_mirror_options, p.code, p.color, p.first_line, true);
+			}
+			else {
+				result = w.context.run(j);
+			}
+		}
+		catch (...) {
+			// rethrown by run, an escaping exception would terminate the program
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (!batch.exception)
+				batch.exception = std::current_exception();
+		}
+
+		++w.stats.num_tasks;
+		w.stats.num_bytes += tk.size;
+		w.stats.busy_time += clock_type::now() - start;
+	}
+
+	w.stats.retained_bytes = w.context.retained_bytes();
+}
+
+}
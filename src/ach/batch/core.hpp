@@ -0,0 +1,181 @@
+#pragma once
+
+#include <ach/clangd/core.hpp>
+#include <ach/clangd/semantic_token.hpp>
+#include <ach/mirror/core.hpp>
+#include <ach/utility/arena.hpp>
+#include <ach/utility/range.hpp>
+#include <ach/utility/retention.hpp>
+
+#include <array>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <variant>
+#include <vector>
+
+namespace ach::batch {
+
+// all referenced objects must outlive the run
+struct mirror_job
+{
+	std::string_view code;
+	std::string_view color;
+	const mirror::highlighter_options* options = nullptr; // default options if null
+};
+
+struct clangd_job
+{
+	const clangd::highlighter* highlighter = nullptr; // required
+	std::string_view code;
+	utility::range<const clangd::semantic_token*> semantic_tokens = {};
+	clangd::highlighter_options options = {};
+};
+
+using job = std::variant<mirror_job, clangd_job>;
+
+// output or error of the engine of the job
+using job_result = std::variant<std::string, mirror::highlighter_error, clangd::highlighter_error>;
+
+/*
+ * Scratch memory for running jobs on one thread (mirror highlighters prepared for
+ * options of recent jobs, clangd context), reused between jobs. Options are identified
+ * by address: call reset when options objects of previous jobs may have changed.
+ * Errors may refer to job inputs and options (see engines).
+ *
+ * Results do not refer to the scratch memory, so the retention policy is applied to
+ * each job right after it. Clangd tokens and tokenizer state are allocated from an arena
+ * released after every clangd job: small documents need no heap memory for them.
+ */
+class job_context
+{
+public:
+	[[nodiscard]] job_result run(const job& j);
+
+	// forgets prepared options, keeps memory
+	void reset() noexcept;
+
+	void set_retention_policy(const utility::retention_policy& policy);
+	// heap memory kept for next jobs
+	std::size_t retained_bytes() const noexcept;
+
+private:
+	friend class scheduler;
+
+	// mirror job or its piece (lines of code and color starting at first_line)
+	[[nodiscard]] job_result run_mirror(
+		const mirror::highlighter_options& options,
+		std::string_view code,
+		std::string_view color,
+		std::size_t first_line,
+		bool is_piece);
+
+	mirror::highlighter& mirror_highlighter(const mirror::highlighter_options& options, bool is_piece);
+
+	struct mirror_slot
+	{
+		const mirror::highlighter_options* options = nullptr;
+		bool is_piece = false;
+		mirror::highlighter hl;
+	};
+
+	// few slots: jobs typically share options
+	static constexpr std::size_t num_mirror_slots = 4;
+
+	std::array<mirror_slot, num_mirror_slots> m_mirror_slots;
+	std::size_t m_next_mirror_slot = 0;
+	utility::arena<> m_clangd_arena; // before the context: it allocates from the arena
+	clangd::highlighter_context m_clangd_context{m_clangd_arena.resource()};
+};
+
+struct batch_options
+{
+	// largest jobs first so that no big job starts last and delays the end of the batch
+	bool sort_by_size = true;
+	// mirror jobs with more code bytes are split into pieces of lines highlighted
+	// independently (same conditions as the line-parallel run_highlighter), 0 disables
+	std::size_t split_threshold = 1u << 20;
+	std::size_t piece_size = 1u << 18;
+};
+
+struct worker_stats
+{
+	std::size_t num_tasks = 0; // jobs and pieces
+	std::size_t num_stolen = 0; // tasks taken from other workers
+	std::size_t num_bytes = 0; // code and color
+	std::chrono::nanoseconds busy_time = {};
+	std::size_t retained_bytes = 0; // scratch memory kept after the run
+};
+
+struct batch_stats
+{
+	std::chrono::nanoseconds wall_time = {};
+	std::size_t num_tasks = 0;
+	std::size_t num_split_jobs = 0;
+	std::vector<worker_stats> workers;
+
+	// fraction of the wall time the worker spent highlighting, 0-1
+	double utilization(std::size_t worker) const noexcept;
+};
+
+/*
+ * Highlights many documents of both engines on a set of worker threads.
+ *
+ * Jobs (and pieces of split jobs) become tasks which are dealt to per-worker queues,
+ * largest first. A worker takes tasks from its own queue and when it is empty steals
+ * from the worker with the most queued bytes, so uneven jobs do not leave threads idle.
+ *
+ * Each worker keeps its job_context between tasks and between runs, so steady-state
+ * runs allocate only their results.
+ *
+ * One run at a time: concurrent calls of run are serialized. Errors may refer to job
+ * inputs and options (see engines) and are valid until the next run. If a task throws
+ * (e.g. std::bad_alloc), remaining tasks still run and run rethrows the first exception.
+ */
+class scheduler
+{
+public:
+	// 0 means std::thread::hardware_concurrency() (at least 1),
+	// retention applies to scratch memory of each worker
+	explicit scheduler(std::size_t num_threads = 0, utility::retention_policy retention = {});
+	~scheduler();
+
+	scheduler(const scheduler&) = delete;
+	scheduler& operator=(const scheduler&) = delete;
+
+	// results are in job order
+	[[nodiscard]] std::vector<job_result> run(const std::vector<job>& jobs, const batch_options& options = {});
+
+	// stats of the last run
+	batch_stats stats() const;
+
+	std::size_t num_threads() const noexcept { return m_threads.size(); }
+
+private:
+	struct worker;
+	struct batch_state;
+
+	void worker_loop(std::size_t index);
+	void run_tasks(worker& w);
+
+	std::mutex m_run_mutex;
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_start_condition;
+	std::condition_variable m_done_condition;
+	std::size_t m_generation = 0;
+	std::size_t m_num_running = 0;
+	bool m_stopping = false;
+	batch_state* m_batch = nullptr;
+	batch_stats m_stats;
+
+	std::vector<std::unique_ptr<worker>> m_workers;
+	std::vector<std::thread> m_threads;
+};
+
+}
@@ -0,0 +1,218 @@
+#include <ach/batch/queue.hpp>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <utility>
+
+namespace ach::batch {
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+constexpr std::size_t index_of(priority prio) noexcept
+{
+	return static_cast<std::size_t>(prio);
+}
+
+// heap order: jobs with a deadline (earliest first), then the rest in submission order
+template <typename Entry>
+bool is_less_urgent(const Entry& lhs, const Entry& rhs) noexcept
+{
+	if (lhs.deadline && rhs.deadline && *lhs.deadline != *rhs.deadline)
+		return *lhs.deadline > *rhs.deadline;
+
+	if (lhs.deadline.has_value() != rhs.deadline.has_value())
+		return !lhs.deadline.has_value();
+
+	return lhs.sequence > rhs.sequence;
+}
+
+queued_result to_queued_result(job_result&& result)
+{
+	return std::visit([](auto&& value) -> queued_result { return std::move(value); }, std::move(result));
+}
+
+}
+
+std::chrono::nanoseconds queue_stats::mean_delay() const noexcept
+{
+	if (num_dequeued == 0)
+		return {};
+
+	return total_delay / static_cast<std::chrono::nanoseconds::rep>(num_dequeued);
+}
+
+std::chrono::nanoseconds queue_stats::delay_percentile(double p) const
+{
+	if (recent_delays.empty())
+		return {};
+
+	std::vector<std::chrono::nanoseconds> delays = recent_delays;
+	const double position = std::clamp(p, 0.0, 1.0) * static_cast<double>(delays.size() - 1);
+	const auto nth = delays.begin() + static_cast<std::ptrdiff_t>(position + 0.5);
+	std::nth_element(delays.begin(), nth, delays.end());
+	return *nth;
+}
+
+submission_queue::submission_queue(
+	std::size_t num_threads,
+	std::size_t num_interactive_threads,
+	utility::retention_policy retention)
+{
+	if (num_threads == 0)
+		num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	num_interactive_threads = std::min(num_interactive_threads, num_threads - 1);
+
+	m_threads.reserve(num_threads);
+	for (std::size_t i = 0; i < num_threads; ++i)
+		m_threads.emplace_back([this, interactive_only = i < num_interactive_threads, retention]() {
+			worker_loop(interactive_only, retention);
+		});
+}
+
+submission_queue::~submission_queue()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+
+	m_condition.notify_all();
+
+	for (std::thread& thread : m_threads)
+		thread.join();
+}
+
+void submission_queue::submit(job j, const submit_options& options, callback on_done)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		std::vector<entry>& queue = m_queues[index_of(options.prio)];
+		queue.push_back(entry{std::move(j), std::move(on_done), clock_type::now(), options.deadline, m_next_sequence++});
+		std::push_heap(queue.begin(), queue.end(), is_less_urgent<entry>);
+		++m_stats[index_of(options.prio)].num_submitted;
+	}
+
+	// any thread can take an interactive job, a bulk job needs one that is not reserved
+	m_condition.notify_all();
+}
+
+std::future<queued_result> submission_queue::submit(job j, const submit_options& options)
+{
+	// std::function requires copyable callables
+	auto promise = std::make_shared<std::promise<queued_result>>();
+	std::future<queued_result> result = promise->get_future();
+	submit(std::move(j), options, [promise](queued_result r) {
+		if (const auto exception = std::get_if<std::exception_ptr>(&r); exception != nullptr)
+			promise->set_exception(*exception);
+		else
+			promise->set_value(std::move(r));
+	});
+	return result;
+}
+
+queue_stats submission_queue::stats(priority prio) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_stats[index_of(prio)];
+}
+
+std::size_t submission_queue::num_queued(priority prio) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_queues[index_of(prio)].size();
+}
+
+void submission_queue::record_delay(priority prio, std::chrono::nanoseconds delay)
+{
+	queue_stats& stats = m_stats[index_of(prio)];
+	++stats.num_dequeued;
+	stats.total_delay += delay;
+	stats.max_delay = std::max(stats.max_delay, delay);
+
+	if (stats.recent_delays.size() < queue_stats::max_recent_delays)
+		stats.recent_delays.push_back(delay);
+	else
+		stats.recent_delays[m_next_recent_delay[index_of(prio)]] = delay;
+
+	m_next_recent_delay[index_of(prio)] = (m_next_recent_delay[index_of(prio)] + 1) % queue_stats::max_recent_delays;
+}
+
+void submission_queue::worker_loop(bool interactive_only, const utility::retention_policy& retention)
+{
+	// jobs of different submitters: options of earlier jobs may not exist anymore,
+	// the context is reset before every job (memory is still reused)
+	job_context context;
+	context.set_retention_policy(retention);
+	std::size_t counted_bytes = 0;
+
+	const auto has_work = [&]() {
+		return !m_queues[index_of(priority::interactive)].empty()
+			|| (!interactive_only && !m_queues[index_of(priority::bulk)].empty());
+	};
+
+	while (true) {
+		std::optional<entry> e;
+		priority prio = priority::interactive;
+		bool is_expired = false;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [&]() { return m_stopping || has_work(); });
+
+			if (!has_work()) {
+				// stopping and nothing left to do, the context goes away
+				m_retained_bytes.fetch_sub(counted_bytes, std::memory_order_relaxed);
+				return;
+			}
+
+			if (m_queues[index_of(priority::interactive)].empty())
+				prio = priority::bulk;
+
+			std::vector<entry>& queue = m_queues[index_of(prio)];
+			std::pop_heap(queue.begin(), queue.end(), is_less_urgent<entry>);
+			e = std::move(queue.back());
+			queue.pop_back();
+
+			const clock_type::time_point now = clock_type::now();
+			is_expired = e->deadline && now > *e->deadline;
+			record_delay(prio, now - e->submitted);
+		}
+
+		queued_result result = deadline_exceeded{};
+		bool has_failed = false;
+		if (!is_expired) {
+			context.reset();
+			try {
+				result = to_queued_result(context.run(e->j));
+			}
+			catch (...) {
+				// reported to the submitter: an escaping exception would terminate the program
+				result = std::current_exception();
+				has_failed = true;
+			}
+
+			// modular arithmetic: also correct when memory is released
+			const std::size_t bytes = context.retained_bytes();
+			m_retained_bytes.fetch_add(bytes - counted_bytes, std::memory_order_relaxed);
+			counted_bytes = bytes;
+		}
+
+		// before the callback: a waiter may check stats right after
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			queue_stats& stats = m_stats[index_of(prio)];
+			++stats.num_completed;
+			if (is_expired)
+				++stats.num_expired;
+			if (has_failed)
+				++stats.num_failed;
+		}
+
+		e->on_done(std::move(result));
+	}
+}
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <ach/batch/core.hpp>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <variant>
+#include <vector>
+
+namespace ach::batch {
+
+enum class priority { interactive, bulk };
+
+constexpr std::size_t num_priorities = 2;
+
+// job was not started before its deadline
+struct deadline_exceeded {};
+
+// exception_ptr: the job threw (e.g. std::bad_alloc), the worker thread keeps running
+using queued_result = std::variant<
+	std::string,
+	mirror::highlighter_error,
+	clangd::highlighter_error,
+	deadline_exceeded,
+	std::exception_ptr>;
+
+struct submit_options
+{
+	priority prio = priority::bulk;
+	// if set and the job has not started before it, the job is dropped
+	std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt;
+};
+
+struct queue_stats
+{
+	std::size_t num_submitted = 0;
+	std::size_t num_dequeued = 0; // started or expired
+	std::size_t num_completed = 0; // including expired
+	std::size_t num_expired = 0;
+	std::size_t num_failed = 0; // threw an exception
+	// queueing delay: from submission to the start of the job (or its expiry)
+	std::chrono::nanoseconds total_delay = {};
+	std::chrono::nanoseconds max_delay = {};
+	std::vector<std::chrono::nanoseconds> recent_delays; // last max_recent_delays, unordered
+
+	static constexpr std::size_t max_recent_delays = 1024;
+
+	std::chrono::nanoseconds mean_delay() const noexcept;
+	// p in 0-1 (e.g. 0.99), over recent delays
+	std::chrono::nanoseconds delay_percentile(double p) const;
+};
+
+/*
+ * Long-lived asynchronous submission of highlighting jobs with 2 priority classes.
+ *
+ * Queued interactive jobs are always started before queued bulk jobs (started jobs run
+ * to completion). Within a class, jobs with the earliest deadline go first, then jobs
+ * without a deadline in submission order. Optionally some threads run interactive jobs
+ * only, so that a bulk backlog that occupies all other threads does not delay them.
+ *
+ * Job inputs and options must stay valid until the job is completed. Callbacks are called
+ * on worker threads and must not throw. Queueing delay is reported per class.
+ * The destructor completes all submitted jobs.
+ */
+class submission_queue
+{
+public:
+	using callback = std::function<void(queued_result)>;
+
+	// 0 threads means std::thread::hardware_concurrency() (at least 1),
+	// interactive threads are a part of all threads (at least 1 thread runs any job),
+	// retention applies to scratch memory of each thread
+	explicit submission_queue(
+		std::size_t num_threads = 0,
+		std::size_t num_interactive_threads = 0,
+		utility::retention_policy retention = {});
+	~submission_queue();
+
+	submission_queue(const submission_queue&) = delete;
+	submission_queue& operator=(const submission_queue&) = delete;
+
+	void submit(job j, const submit_options& options, callback on_done);
+	// an exception of the job is rethrown by the future instead of being its value
+	[[nodiscard]] std::future<queued_result> submit(job j, const submit_options& options = {});
+
+	queue_stats stats(priority prio) const;
+	// jobs waiting to be started
+	std::size_t num_queued(priority prio) const;
+
+	std::size_t num_threads() const noexcept { return m_threads.size(); }
+
+	// scratch memory kept by all threads, updated after each job
+	std::size_t retained_bytes() const noexcept { return m_retained_bytes.load(std::memory_order_relaxed); }
+
+private:
+	struct entry
+	{
+		job j;
+		callback on_done;
+		std::chrono::steady_clock::time_point submitted;
+		std::optional<std::chrono::steady_clock::time_point> deadline;
+		std::uint64_t sequence;
+	};
+
+	void worker_loop(bool interactive_only, const utility::retention_policy& retention);
+	void record_delay(priority prio, std::chrono::nanoseconds delay);
+
+	mutable std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::array<std::vector<entry>, num_priorities> m_queues; // heaps, most urgent on top
+	std::array<queue_stats, num_priorities> m_stats;
+	std::array<std::size_t, num_priorities> m_next_recent_delay = {};
+	std::uint64_t m_next_sequence = 0;
+	bool m_stopping = false;
+	std::atomic<std::size_t> m_retained_bytes = 0;
+
+	std::vector<std::thread> m_threads;
+};
+
+}
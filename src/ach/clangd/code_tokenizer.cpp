@@ -51,11 +51,18 @@ void code_tokenizer::on_parsed_newline()
 }
 
 [[nodiscard]] std::optional<highlighter_error>
-code_tokenizer::fill_with_tokens(bool highlight_printf_formatting, std::vector<code_token>& tokens)
+code_tokenizer::fill_with_tokens(
+	bool highlight_printf_formatting,
+	std::pmr::vector<code_token>& tokens,
+	const utility::cancellation& cancellation)
 {
 	tokens.clear();
+	utility::cancellation_checker is_cancelled(cancellation);
 
 	while (true) {
+		if (is_cancelled())
+			return make_error(error_reason::cancelled);
+
 		std::variant<code_token, highlighter_error> token_or_error = next_code_token(highlight_printf_formatting);
 
 		if (std::holds_alternative<highlighter_error>(token_or_error))
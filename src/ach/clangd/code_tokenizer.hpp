@@ -4,8 +4,10 @@
 #include <ach/clangd/code_token.hpp>
 #include <ach/clangd/highlighter_error.hpp>
 #include <ach/clangd/spliced_text_parser.hpp>
+#include <ach/utility/cancellation.hpp>
 #include <ach/utility/range.hpp>
 
+#include <memory_resource>
 #include <optional>
 #include <string_view>
 #include <variant>
@@ -16,9 +18,14 @@ namespace ach::clangd {
 class code_tokenizer
 {
 public:
-	code_tokenizer(std::string_view code, utility::range<const std::string*> keywords)
+	// resource: state allocations (macro parameters)
+	code_tokenizer(
+		std::string_view code,
+		utility::range<const std::string*> keywords,
+		std::pmr::memory_resource* resource = std::pmr::get_default_resource())
 	: m_keywords{keywords}
 	, m_parser(code)
+	, m_preprocessor_macro_params(resource)
 	{}
 
 	// note: this doesn't mean the parser is finished
@@ -47,9 +54,12 @@ public:
 	next_code_token(bool highlight_printf_formatting);
 
 	// Clear vector and fill it with all remaining tokens.
-	// If an error occurs, partial fill may happen.
+	// If an error occurs (or the run is cancelled), partial fill may happen.
 	[[nodiscard]] std::optional<highlighter_error>
-	fill_with_tokens(bool highlight_printf_formatting, std::vector<code_token>& tokens);
+	fill_with_tokens(
+		bool highlight_printf_formatting,
+		std::pmr::vector<code_token>& tokens,
+		const utility::cancellation& cancellation = {});
 
 private:
 	text::fragment empty_match() const noexcept
@@ -95,7 +105,7 @@ private:
 	// non-empty when parsing preprocessor object-like macro
 	// this will allow to highlight macro parameters inside macro body
 	// note: vector content strings may be spliced
-	std::vector<std::string_view> m_preprocessor_macro_params;
+	std::pmr::vector<std::string_view> m_preprocessor_macro_params;
 	// non-empty when parsing a raw string literal with non-zero length delimeter
 	// (the delimeter is outside parenthesis: e.g. foo in R"foo(str)foo")
 	text::fragment m_raw_string_literal_delimeter;
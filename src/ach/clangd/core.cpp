@@ -4,12 +4,18 @@
 #include <ach/clangd/core.hpp>
 #include <ach/clangd/code_token.hpp>
 #include <ach/clangd/code_tokenizer.hpp>
+#include <ach/mirror/color_program.hpp>
 #include <ach/web/types.hpp>
+#include <ach/utility/object_pool.hpp>
+#include <ach/utility/retention.hpp>
 #include <ach/utility/visitor.hpp>
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <memory_resource>
 #include <optional>
+#include <string>
 #include <string_view>
 #include <variant>
 
@@ -81,6 +87,34 @@ constexpr auto dependent_name = "dep-name";
 
 constexpr auto namespace_ = "namespace";
 
+// all classes above, in a fixed order to keep compact class identifiers stable
+constexpr const char* all[] = {
+	pp_hash, pp_directive, pp_header_file, pp_macro, pp_macro_param, pp_macro_body, pp_other,
+	comment_single, comment_single_doxygen, comment_multi, comment_multi_doxygen, comment_tag_todo, comment_tag_doxygen,
+	keyword,
+	literal_number, literal_character, literal_string, literal_string_raw_delimeter,
+	literal_prefix, literal_suffix, escape_sequence, format_sequence,
+	unknown,
+	disabled_code,
+	macro,
+	label,
+	parameter, out_parameter, template_parameter,
+	variable_local, variable_global, variable_member, enumerator,
+	function_free, function_member, function_virtual, overloaded_operator,
+	type_class, type_interface, type_enum, type_generic,
+	concept_, dependent_name,
+	namespace_
+};
+
+// classes which token_to_action can combine with disabled_code
+constexpr const char* disabled_code_combinable[] = {
+	pp_hash, pp_directive, pp_header_file, pp_macro, pp_macro_param, pp_macro_body, pp_other,
+	keyword,
+	literal_number, literal_character, literal_string, literal_string_raw_delimeter,
+	literal_prefix, literal_suffix, escape_sequence, format_sequence,
+	overloaded_operator
+};
+
 }
 
 struct basic_action
@@ -331,20 +365,25 @@ builder_action token_to_action(code_token token)
 	return action_error{error_reason::internal_error_token_to_action, token.syntax_element, token.semantic_info};
 }
 
-[[nodiscard]] std::variant<std::string, highlighter_error>
+[[nodiscard]] std::optional<highlighter_error>
 generate_html(
 	web::html_builder& builder,
-	const std::vector<code_token>& code_tokens,
+	const std::pmr::vector<code_token>& code_tokens,
 	std::size_t code_lines,
 	std::string_view table_wrap_css_class,
-	int /* color_variants */)
+	int /* color_variants */,
+	const utility::cancellation& cancellation)
 {
 	const bool wrap_in_table = !table_wrap_css_class.empty();
 	if (wrap_in_table)
 		builder.open_table(code_lines, table_wrap_css_class);
 
+	utility::cancellation_checker is_cancelled(cancellation);
 	for (const code_token& token : code_tokens) {
 		const text::position current_position = token.origin.r.first;
+		if (is_cancelled())
+			return highlighter_error::from_semantic(error_reason::cancelled, current_position, token.syntax_element, token.semantic_info);
+
 		std::optional<highlighter_error> maybe_error = std::visit(utility::visitor{
 			[&](basic_action action) -> std::optional<highlighter_error> {
 				if (action.open_span) {
@@ -386,10 +425,12 @@ generate_html(
 			return *maybe_error;
 	}
 
+	builder.flush();
+
 	if (wrap_in_table)
 		builder.close_table();
 
-	return std::move(builder.str());
+	return std::nullopt;
 }
 
 class semantic_token_processor
@@ -402,12 +443,17 @@ public:
 
 	[[nodiscard]] std::optional<highlighter_error>
 	improve_code_tokens(
-		std::vector<code_token>& code_tokens,
-		utility::range<const semantic_token*> sem_tokens)
+		std::pmr::vector<code_token>& code_tokens,
+		utility::range<const semantic_token*> sem_tokens,
+		const utility::cancellation& cancellation)
 	{
 		utility::range<const semantic_token*> current = {sem_tokens.first, sem_tokens.first};
+		utility::cancellation_checker is_cancelled(cancellation);
 
 		while (current.first != sem_tokens.last) {
+			if (is_cancelled())
+				return highlighter_error::from_semantic(error_reason::cancelled, current.first->pos_begin(), std::nullopt, current.first->info);
+
 			// Find a range of tokens that represent the same entity.
 			// The only case where the resulting range will contain multiple elements is for spliced entities.
 			auto it = current.first;
@@ -460,7 +506,7 @@ private:
 	// Otherwise (no splice) the current range should have size 1.
 	[[nodiscard]] std::optional<highlighter_error>
 	improve_code_tokens_internal(
-		std::vector<code_token>& code_tokens,
+		std::pmr::vector<code_token>& code_tokens,
 		text::position start,
 		text::position stop,
 		semantic_token_info info,
@@ -494,10 +540,13 @@ private:
 	std::string_view semantic_token_str(semantic_token sem_token)
 	{
 		assert(m_text_it.position() <= sem_token.pos_begin());
-		while (m_text_it.position() < sem_token.pos_begin())
+		const char* const last = m_code.data() + m_code.size();
+		while (m_text_it.position() < sem_token.pos_begin() && m_text_it.pointer() != last)
 			++m_text_it;
 
-		return {m_text_it.pointer(), sem_token.length};
+		// invalid tokens may point past the end of the code (reported later as not matching)
+		const auto remaining = static_cast<std::size_t>(last - m_text_it.pointer());
+		return {m_text_it.pointer(), std::min<std::size_t>(sem_token.length, remaining)};
 	}
 
 	std::string_view m_code;
@@ -547,10 +596,155 @@ utility::range<code_token*> find_matching_tokens(
 std::optional<highlighter_error>
 improve_code_tokens(
 	std::string_view code,
-	std::vector<code_token>& code_tokens,
-	utility::range<const semantic_token*> sem_tokens)
+	std::pmr::vector<code_token>& code_tokens,
+	utility::range<const semantic_token*> sem_tokens,
+	const utility::cancellation& cancellation)
+{
+	return semantic_token_processor(code).improve_code_tokens(code_tokens, sem_tokens, cancellation);
+}
+
+web::css_class_map make_css_class_map()
+{
+	web::css_class_map result;
+
+	for (const char* class_ : css::all)
+		(void) result.short_name(class_);
+
+	for (const char* class_ : css::disabled_code_combinable)
+		(void) result.short_name(std::string(class_) + " " + css::disabled_code);
+
+	return result;
+}
+
+mirror::highlighter_options to_replay_options(const highlighter_options& options)
+{
+	mirror::highlighter_options result;
+	result.generation.table_wrap_css_class = options.table_wrap_css_class;
+	result.generation.coalesce_spans = options.coalesce_spans;
+	result.generation.whitespace_insensitive_css_classes = options.whitespace_insensitive_css_classes;
+	result.generation.class_map = options.class_map;
+	return result;
+}
+
+std::size_t highlighter_context::retained_bytes() const noexcept
+{
+	return utility::heap_bytes(code_tokens) + builder.capacity_bytes();
+}
+
+void highlighter_context::trim()
+{
+	if (!m_has_untrimmed_run)
+		return;
+
+	m_has_untrimmed_run = false;
+	const std::size_t used = code_tokens.size() * sizeof(code_token) + builder.str().size();
+	if (m_retention_tracker.should_release(retention, used, retained_bytes()))
+		release_memory();
+}
+
+void highlighter_context::release_memory()
+{
+	utility::release_memory(code_tokens);
+	builder.release_memory();
+}
+
+void highlighter_context::begin_run()
+{
+	trim();
+	m_has_untrimmed_run = true;
+}
+
+namespace {
+
+// context of the highlighter's pool, its memory is counted in the highlighter's total
+struct pooled_context
+{
+	~pooled_context()
+	{
+		if (total_bytes != nullptr)
+			total_bytes->fetch_sub(counted_bytes, std::memory_order_relaxed);
+	}
+
+	highlighter_context context;
+	std::atomic<std::size_t>* total_bytes = nullptr;
+	std::size_t counted_bytes = 0;
+};
+
+// pooled context for 1 run, trimmed when the run is done with it (output is moved or streamed)
+class pooled_context_lease
 {
-	return semantic_token_processor(code).improve_code_tokens(code_tokens, sem_tokens);
+public:
+	pooled_context_lease(
+		utility::object_pool<pooled_context>& pool,
+		std::atomic<std::size_t>& total_bytes,
+		const utility::retention_policy& retention)
+	: m_lease(pool)
+	{
+		m_lease->total_bytes = &total_bytes;
+		m_lease->context.retention = retention;
+	}
+
+	~pooled_context_lease()
+	{
+		m_lease->context.trim();
+		// modular arithmetic: also correct when the context shrinks
+		const std::size_t bytes = m_lease->context.retained_bytes();
+		m_lease->total_bytes->fetch_add(bytes - m_lease->counted_bytes, std::memory_order_relaxed);
+		m_lease->counted_bytes = bytes;
+	}
+
+	pooled_context_lease(const pooled_context_lease&) = delete;
+	pooled_context_lease& operator=(const pooled_context_lease&) = delete;
+
+	highlighter_context& operator*() const noexcept { return m_lease->context; }
+	highlighter_context* operator->() const noexcept { return &m_lease->context; }
+
+private:
+	utility::object_pool<pooled_context>::lease m_lease;
+};
+
+}
+
+struct highlighter::shared_state
+{
+	explicit shared_state(utility::retention_policy retention)
+	: retention(retention) {}
+
+	utility::retention_policy retention;
+	// before the pool: pooled contexts subtract their memory when destroyed
+	std::atomic<std::size_t> retained_bytes = 0;
+	utility::object_pool<pooled_context> contexts;
+	std::atomic<std::size_t> num_code_tokens = 0;
+	std::atomic<std::size_t> num_coalesced_bytes = 0;
+
+	pooled_context_lease lease_context()
+	{
+		return pooled_context_lease(contexts, retained_bytes, retention);
+	}
+};
+
+highlighter::highlighter(std::vector<std::string> keywords, utility::retention_policy retention)
+: m_keywords(std::move(keywords))
+, m_state(std::make_unique<shared_state>(retention))
+{}
+
+highlighter::~highlighter() = default;
+highlighter::highlighter(highlighter&& other) noexcept = default;
+highlighter& highlighter::operator=(highlighter&& other) noexcept = default;
+
+std::size_t highlighter::num_code_tokens() const
+{
+	return m_state->num_code_tokens.load(std::memory_order_relaxed);
+}
+
+std::size_t highlighter::num_coalesced_bytes() const
+{
+	return m_state->num_coalesced_bytes.load(std::memory_order_relaxed);
+}
+
+std::size_t highlighter::retained_bytes() const
+{
+	return m_state->retained_bytes.load(std::memory_order_relaxed);
 }
 
 std::variant<std::string, highlighter_error> highlighter::run(
@@ -558,24 +752,160 @@ std::variant<std::string, highlighter_error> highlighter::run(
 	utility::range<const semantic_token*> sem_tokens,
 	highlighter_options options) const
 {
-	std::optional<highlighter_error> maybe_error =
-		code_tokenizer(code, {m_keywords.data(), m_keywords.data() + m_keywords.size()})
-		.fill_with_tokens(options.highlight_printf_formatting, m_code_tokens);
+	pooled_context_lease context = m_state->lease_context();
+	auto result = run(*context, code, sem_tokens, options);
+	if (auto error = std::get_if<highlighter_error>(&result); error != nullptr)
+		return *error;
 
-	if (maybe_error)
+	return std::move(context->builder.str());
+}
+
+std::optional<highlighter_error> highlighter::run(
+	std::string_view code,
+	utility::range<const semantic_token*> sem_tokens,
+	web::output_sink& output,
+	highlighter_options options) const
+{
+	pooled_context_lease context = m_state->lease_context();
+	return run(*context, code, sem_tokens, output, options);
+}
+
+std::variant<std::string_view, highlighter_error> highlighter::run(
+	highlighter_context& context,
+	std::string_view code,
+	utility::range<const semantic_token*> sem_tokens,
+	highlighter_options options) const
+{
+	context.begin_run();
+	context.builder.reset();
+	// based on measuring mirror highlight which has very similar output size
+	context.builder.reserve(code.size() * 5u);
+
+	if (auto maybe_error = run_internal(context, code, sem_tokens, options); maybe_error)
 		return *maybe_error;
 
-	maybe_error = improve_code_tokens(code, m_code_tokens, sem_tokens);
+	return std::string_view(context.builder.str());
+}
+
+std::optional<highlighter_error> highlighter::run(
+	highlighter_context& context,
+	std::string_view code,
+	utility::range<const semantic_token*> sem_tokens,
+	web::output_sink& output,
+	highlighter_options options) const
+{
+	context.begin_run();
+	context.builder.reset();
+	context.builder.set_sink(&output);
+	std::optional<highlighter_error> maybe_error = run_internal(context, code, sem_tokens, options);
+	context.builder.set_sink(nullptr);
+	output.flush();
+	return maybe_error;
+}
+
+std::optional<highlighter_error> highlighter::export_program(
+	std::string_view code,
+	utility::range<const semantic_token*> sem_tokens,
+	mirror::color_program& program,
+	highlighter_options options) const
+{
+	pooled_context_lease context = m_state->lease_context();
+	context->begin_run();
+	if (auto maybe_error = fill_code_tokens(context->code_tokens, code, sem_tokens, options); maybe_error)
+		return maybe_error;
+
+	// same actions as generate_html, recorded instead of executed
+	program.clear();
+	utility::cancellation_checker is_cancelled(options.cancellation);
+	for (const code_token& token : context->code_tokens) {
+		const text::position current_position = token.origin.r.first;
+		if (is_cancelled()) {
+			program.clear();
+			return highlighter_error::from_semantic(error_reason::cancelled, current_position, token.syntax_element, token.semantic_info);
+		}
+
+		std::optional<highlighter_error> maybe_error = std::visit(utility::visitor{
+			[&](basic_action action) -> std::optional<highlighter_error> {
+				if (action.open_span && action.close_span && !action.is_disabled_code) {
+					program.add_text(token.origin.str, web::css_class{action.css_class});
+					return std::nullopt;
+				}
+
+				if (action.open_span) {
+					if (action.is_disabled_code)
+						program.open_span(web::css_class{action.css_class}, web::css_class{css::disabled_code});
+					else
+						program.open_span(web::css_class{action.css_class});
+				}
+
+				program.add_text(token.origin.str);
+
+				if (action.close_span)
+					program.close_span();
+
+				return std::nullopt;
+			},
+			[&](semantic_token_action action) -> std::optional<highlighter_error> {
+				program.add_text(token.origin.str, web::css_class{action.css_class});
+				return std::nullopt;
+			},
+			[&](end_of_input /* action */) -> std::optional<highlighter_error> {
+				return std::nullopt;
+			},
+			[&](action_error error) -> std::optional<highlighter_error> {
+				return highlighter_error::from_semantic(
+					error.reason,
+					current_position,
+					error.syntax_element,
+					error.semantic_info
+				);
+			}
+		}, token_to_action(token));
+
+		if (maybe_error) {
+			program.clear();
+			return maybe_error;
+		}
+	}
+
+	program.finish();
+	return std::nullopt;
+}
+
+std::optional<highlighter_error> highlighter::fill_code_tokens(
+	std::pmr::vector<code_token>& code_tokens,
+	std::string_view code,
+	utility::range<const semantic_token*> sem_tokens,
+	highlighter_options options) const
+{
+	std::optional<highlighter_error> maybe_error =
+		code_tokenizer(code, {m_keywords.data(), m_keywords.data() + m_keywords.size()}, code_tokens.get_allocator().resource())
+		.fill_with_tokens(options.highlight_printf_formatting, code_tokens, options.cancellation);
 
 	if (maybe_error)
-		return *maybe_error;
+		return maybe_error;
 
-	m_builder.reset();
-	// based on measuring mirror highlight which has very similar output size
-	m_builder.reserve(code.size() * 5u);
+	return improve_code_tokens(code, code_tokens, sem_tokens, options.cancellation);
+}
+
+std::optional<highlighter_error> highlighter::run_internal(
+	highlighter_context& context,
+	std::string_view code,
+	utility::range<const semantic_token*> sem_tokens,
+	highlighter_options options) const
+{
+	if (auto maybe_error = fill_code_tokens(context.code_tokens, code, sem_tokens, options); maybe_error)
+		return maybe_error;
+
+	context.builder.set_span_coalescing(options.coalesce_spans, options.whitespace_insensitive_css_classes);
+	context.builder.set_class_map(options.class_map);
+
+	std::optional<highlighter_error> maybe_error = generate_html(
+		context.builder, context.code_tokens, text::count_lines(code), options.table_wrap_css_class, options.color_variants, options.cancellation);
 
-	return generate_html(
-		m_builder, m_code_tokens, text::count_lines(code), options.table_wrap_css_class, options.color_variants);
+	m_state->num_code_tokens.store(context.code_tokens.size(), std::memory_order_relaxed);
+	m_state->num_coalesced_bytes.store(context.builder.coalesced_bytes(), std::memory_order_relaxed);
+	return maybe_error;
 }
 
 }
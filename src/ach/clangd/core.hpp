@@ -3,14 +3,28 @@
 #include <ach/clangd/semantic_token.hpp>
 #include <ach/clangd/code_token.hpp>
 #include <ach/clangd/highlighter_error.hpp>
+#include <ach/mirror/core.hpp>
 #include <ach/web/html_builder.hpp>
+#include <ach/web/css_class_map.hpp>
+#include <ach/web/output_sink.hpp>
+#include <ach/utility/cancellation.hpp>
+#include <ach/utility/retention.hpp>
 #include <ach/utility/range.hpp>
 
+#include <memory>
+#include <memory_resource>
+#include <optional>
 #include <string_view>
 #include <string>
 #include <variant>
 #include <vector>
 
+namespace ach::mirror {
+
+class color_program;
+
+}
+
 namespace ach::clangd {
 
 struct highlighter_options
@@ -18,14 +32,71 @@ struct highlighter_options
 	std::string_view table_wrap_css_class = {};
 	int color_variants = 6;
 	bool highlight_printf_formatting = false;
+	// merge adjacent spans with the same class, see web::html_builder::set_span_coalescing
+	bool coalesce_spans = false;
+	std::string_view whitespace_insensitive_css_classes = {};
+	// compact output: replace class names with short identifiers from this map (if not null)
+	web::css_class_map* class_map = nullptr;
+	// stops a run with error_reason::cancelled, checked while tokenizing, applying
+	// semantic tokens and generating output (see utility::cancellation)
+	utility::cancellation cancellation = {};
+};
+
+/*
+ * Scratch memory of a run, reused between runs (see highlighter). Tokens (the largest
+ * per-run allocation) and tokenizer state are allocated from the given resource, e.g.
+ * a utility::arena on the stack for small snippets. The resource must outlive the context.
+ * For output from the same resource, run with a web::pmr_string_sink.
+ *
+ * The retention policy is applied to the last run when it is no longer needed: at the
+ * start of the next run or by trim().
+ */
+struct highlighter_context
+{
+	explicit highlighter_context(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+	: code_tokens(resource)
+	{}
+
+	std::pmr::memory_resource* resource() const noexcept { return code_tokens.get_allocator().resource(); }
+
+	// heap memory kept for next runs
+	std::size_t retained_bytes() const noexcept;
+	// applies the retention policy now (once per run), output of the last run is no longer valid
+	void trim();
+	// frees memory kept for next runs, output of the last run is no longer valid
+	void release_memory();
+
+	std::pmr::vector<code_token> code_tokens;
+	web::html_builder builder;
+	utility::retention_policy retention = {};
+
+private:
+	friend class highlighter;
+
+	// trims after the previous run
+	void begin_run();
+
+	utility::retention_tracker m_retention_tracker;
+	bool m_has_untrimmed_run = false;
 };
 
+/*
+ * Thread-safe: after construction the highlighter is immutable (keywords), memory
+ * that runs need is held by a highlighter_context. Runs without a context take one from
+ * an internal lock-free pool, so one highlighter can serve any number of threads and
+ * still reuse allocations. Runs with a context (e.g. one per worker thread) skip the pool.
+ *
+ * Options are not synchronized: a class map must not be used by concurrent runs.
+ */
 class highlighter
 {
 public:
-	highlighter(std::vector<std::string> keywords)
-	: m_keywords(std::move(keywords))
-	{}
+	// retention applies to contexts of runs without an explicit context
+	highlighter(std::vector<std::string> keywords, utility::retention_policy retention = {});
+	~highlighter();
+
+	highlighter(highlighter&& other) noexcept;
+	highlighter& operator=(highlighter&& other) noexcept;
 
 	[[nodiscard]] std::variant<std::string, highlighter_error>
 	run(
@@ -33,16 +104,82 @@ public:
 		utility::range<const semantic_token*> sem_tokens,
 		highlighter_options options = {}) const;
 
+	// Streaming output: written as generated, flushed at the end. Stable writes reference
+	// code and static strings (see web::segment_list for scatter-gather output).
+	// On error, output may contain partial result.
+	[[nodiscard]] std::optional<highlighter_error>
+	run(
+		std::string_view code,
+		utility::range<const semantic_token*> sem_tokens,
+		web::output_sink& output,
+		highlighter_options options = {}) const;
+
+	// explicit scratch memory, output is valid until the next run with the context
+	[[nodiscard]] std::variant<std::string_view, highlighter_error>
+	run(
+		highlighter_context& context,
+		std::string_view code,
+		utility::range<const semantic_token*> sem_tokens,
+		highlighter_options options = {}) const;
+
+	[[nodiscard]] std::optional<highlighter_error>
+	run(
+		highlighter_context& context,
+		std::string_view code,
+		utility::range<const semantic_token*> sem_tokens,
+		web::output_sink& output,
+		highlighter_options options = {}) const;
+
+	/*
+	 * Instead of generating output, builds a mirror program that reproduces it: once
+	 * exported (and possibly stored, see mirror::color_program::serialize) the same code
+	 * can be highlighted again by the mirror highlighter, without semantic tokens and
+	 * without tokenization. Output is the same when run with to_replay_options(options).
+	 * Only options that affect tokens are used here (highlight_printf_formatting).
+	 */
+	[[nodiscard]] std::optional<highlighter_error>
+	export_program(
+		std::string_view code,
+		utility::range<const semantic_token*> sem_tokens,
+		mirror::color_program& program,
+		highlighter_options options = {}) const;
+
 	std::size_t num_keywords() const { return m_keywords.size(); }
-	std::size_t num_code_tokens() const { return m_code_tokens.size(); }
+	// stats of the last finished run (from any thread)
+	std::size_t num_code_tokens() const;
+	// output bytes saved by span coalescing during last run
+	std::size_t num_coalesced_bytes() const;
+	// heap memory kept by contexts of runs without an explicit context (from any thread)
+	std::size_t retained_bytes() const;
 
 private:
+	[[nodiscard]] std::optional<highlighter_error>
+	fill_code_tokens(
+		std::pmr::vector<code_token>& code_tokens,
+		std::string_view code,
+		utility::range<const semantic_token*> sem_tokens,
+		highlighter_options options) const;
+
+	[[nodiscard]] std::optional<highlighter_error>
+	run_internal(
+		highlighter_context& context,
+		std::string_view code,
+		utility::range<const semantic_token*> sem_tokens,
+		highlighter_options options) const;
+
 	std::vector<std::string> m_keywords;
-	// allocation reuse
-	mutable std::vector<code_token> m_code_tokens;
-	mutable web::html_builder m_builder;
+	// separate allocation: contains atomics which can not move
+	struct shared_state;
+	std::unique_ptr<shared_state> m_state;
 };
 
+// mirror options with the same output options, for running exported programs
+[[nodiscard]] mirror::highlighter_options to_replay_options(const highlighter_options& options);
+
+// class map seeded with every class the highlighter can output (including
+// combinations with disabled code) so that identifiers do not depend on the input
+[[nodiscard]] web::css_class_map make_css_class_map();
+
 [[nodiscard]] utility::range<code_token*>
 find_matching_tokens(
 	utility::range<code_token*> code_tokens,
@@ -52,7 +189,8 @@ find_matching_tokens(
 [[nodiscard]] std::optional<highlighter_error>
 improve_code_tokens(
 	std::string_view code,
-	std::vector<code_token>& code_tokens,
-	utility::range<const semantic_token*> sem_tokens);
+	std::pmr::vector<code_token>& code_tokens,
+	utility::range<const semantic_token*> sem_tokens,
+	const utility::cancellation& cancellation = {});
 
 }
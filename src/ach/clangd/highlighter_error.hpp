@@ -15,6 +15,7 @@ namespace ach::clangd {
 ACH_RICH_ENUM_CLASS(error_reason,
 	(syntax_error)
 	(unsupported)
+	(cancelled)
 	(internal_error_unhandled_preprocessor)
 	(internal_error_unhandled_preprocessor_diagnostic_message)
 	(internal_error_unhandled_context)
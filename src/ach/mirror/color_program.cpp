@@ -0,0 +1,615 @@
+#include <ach/mirror/color_program.hpp>
+#include <ach/mirror/color_tokenizer.hpp>
+#include <ach/utility/hash.hpp>
+#include <ach/utility/retention.hpp>
+#include <ach/utility/visitor.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <charconv>
+#include <iterator>
+#include <optional>
+#include <utility>
+
+namespace ach::mirror {
+
+namespace {
+
+// length prefix: no separator could be ambiguous
+template <typename Output>
+void write_key_field(std::string_view field, Output&& output)
+{
+	std::array<char, 24> buffer;
+	char* last = std::to_chars(buffer.data(), buffer.data() + buffer.size() - 1, field.size()).ptr;
+	*last++ = ':';
+	output(std::string_view(buffer.data(), last - buffer.data()));
+	output(field);
+}
+
+// everything (except color) that affects compilation, in a fixed order
+template <typename Output>
+void write_options_key(const highlighter_options& options, Output&& output)
+{
+	const color_options& co = options.color;
+	const generation_options& go = options.generation;
+
+	const char flags[] = {co.escape_char, co.empty_token_char, go.replace_underscores_to_hyphens ? '1' : '0'};
+	write_key_field(std::string_view(flags, sizeof(flags)), output);
+
+	// set contents are identified without hashing them
+	std::array<char, 24> buffer;
+	char* const last = std::to_chars(buffer.data(), buffer.data() + buffer.size(),
+		go.valid_css_class_set ? go.valid_css_class_set->id() : 0u).ptr;
+	write_key_field(std::string_view(buffer.data(), last - buffer.data()), output);
+
+	for (std::string_view field : {
+		co.num_keyword, co.str_keyword, co.chr_keyword,
+		co.num_class,
+		co.str_class, co.str_esc_class,
+		co.chr_class, co.chr_esc_class,
+		go.valid_css_classes
+	}) {
+		write_key_field(field, output);
+	}
+}
+
+std::uint64_t hash_key(std::string_view color, const highlighter_options& options) noexcept
+{
+	utility::fnv1a_hasher hasher;
+	const auto update = [&](std::string_view data) { hasher.update(data); };
+	write_options_key(options, update);
+	write_key_field(color, update);
+	return hasher.digest();
+}
+
+std::string make_options_key(const highlighter_options& options)
+{
+	std::string key;
+	write_options_key(options, [&](std::string_view data) { key.append(data.data(), data.size()); });
+	return key;
+}
+
+// compares without building the key of the options
+bool matches_options_key(std::string_view key, const highlighter_options& options) noexcept
+{
+	bool result = true;
+	write_options_key(options, [&](std::string_view data) {
+		if (result && key.substr(0, data.size()) == data)
+			key.remove_prefix(data.size());
+		else
+			result = false;
+	});
+
+	return result && key.empty();
+}
+
+constexpr std::string_view program_magic = "ACHP";
+constexpr unsigned char program_version = 1;
+
+void write_varint(std::string& output, std::uint64_t value)
+{
+	while (value >= 0x80u) {
+		output.push_back(static_cast<char>((value & 0x7Fu) | 0x80u));
+		value >>= 7;
+	}
+
+	output.push_back(static_cast<char>(value));
+}
+
+// advances input, false on truncated or too long input
+[[nodiscard]] bool read_varint(std::string_view& input, std::uint64_t& value)
+{
+	value = 0;
+	for (unsigned shift = 0; shift < 64u; shift += 7) {
+		if (input.empty())
+			return false;
+
+		const auto byte = static_cast<unsigned char>(input.front());
+		input.remove_prefix(1);
+		value |= static_cast<std::uint64_t>(byte & 0x7Fu) << shift;
+
+		if ((byte & 0x80u) == 0)
+			return true;
+	}
+
+	return false;
+}
+
+// no_class is stored as 0
+void write_class_index(std::string& output, std::uint32_t index)
+{
+	write_varint(output, index == color_instruction::no_class ? 0u : std::uint64_t{index} + 1u);
+}
+
+[[nodiscard]] bool read_class_index(std::string_view& input, std::size_t num_classes, std::uint32_t& index)
+{
+	std::uint64_t value = 0;
+	if (!read_varint(input, value) || value > num_classes)
+		return false;
+
+	index = value == 0 ? color_instruction::no_class : static_cast<std::uint32_t>(value - 1u);
+	return true;
+}
+
+}
+
+void color_program::assign(std::string_view color, const highlighter_options& options)
+{
+	m_color.assign(color.data(), color.size());
+	m_instructions.clear();
+	m_lines.clear();
+	m_class_names.clear();
+	m_classes.clear();
+	m_hyphenated_classes = options.generation.replace_underscores_to_hyphens;
+
+	// parse text list only if there is no set
+	std::optional<web::css_class_set> parsed_classes;
+	const web::css_class_set* valid_classes = options.generation.valid_css_class_set;
+	if (valid_classes == nullptr && !options.generation.valid_css_classes.empty()) {
+		valid_classes = &parsed_classes.emplace(options.generation.valid_css_classes);
+	}
+
+	color_tokenizer color_tr(m_color);
+	bool done = false;
+	while (!done) {
+		const color_token color_tn = color_tr.next_token(options.color);
+		add_line(color_tn.origin);
+
+		color_instruction& instr = m_instructions.emplace_back();
+		instr.origin = color_tn.origin.span();
+
+		// validation is done on names before underscore replacement
+		const auto set_class = [&](std::uint32_t& index, web::css_class class_) {
+			index = add_class(class_.name);
+
+			if (instr.invalid_class_index == color_instruction::no_class
+				&& valid_classes != nullptr
+				&& !valid_classes->contains(class_.name))
+			{
+				instr.invalid_class_index = index;
+			}
+		};
+
+		const auto set_optional_class = [&](std::optional<web::css_class> class_) {
+			if (class_)
+				set_class(instr.class_index, *class_);
+		};
+
+		std::visit(utility::visitor{
+			[&](identifier_span id_span) {
+				instr.opcode = color_opcode::identifier;
+				set_class(instr.class_index, id_span.class_);
+			},
+			[&](fixed_length_span fl_span) {
+				instr.opcode = color_opcode::fixed_length;
+				instr.length = fl_span.length;
+				set_optional_class(fl_span.class_);
+			},
+			[&](line_delimited_span ld_span) {
+				instr.opcode = color_opcode::line_delimited;
+				set_optional_class(ld_span.class_);
+			},
+			[&](number num) {
+				instr.opcode = color_opcode::number;
+				set_class(instr.class_index, num.class_);
+			},
+			[&](symbol) {
+				// extend previous run of symbols instead (instr is removed, do not use it later)
+				if (m_instructions.size() >= 2u) {
+					color_instruction& prev = m_instructions[m_instructions.size() - 2u];
+					if (prev.opcode == color_opcode::symbol
+						&& prev.origin.line == instr.origin.line
+						&& prev.origin.column + prev.origin.length == instr.origin.column)
+					{
+						++prev.length;
+						++prev.origin.length;
+						m_instructions.pop_back();
+						return;
+					}
+				}
+
+				instr.opcode = color_opcode::symbol;
+				instr.length = 1;
+			},
+			[&](empty_token) {
+				instr.opcode = color_opcode::empty_token;
+			},
+			[&](quoted_span span) {
+				instr.opcode = color_opcode::quoted;
+				instr.symbol = span.delimeter;
+				instr.escape = span.escape;
+				set_class(instr.class_index, span.primary_class);
+				set_class(instr.escape_class_index, span.escape_class);
+			},
+			[&](end_of_line) {
+				instr.opcode = color_opcode::end_of_line;
+			},
+			[&](end_of_input) {
+				instr.opcode = color_opcode::end_of_input;
+				done = true;
+			},
+			[&](invalid_token invalid) {
+				// execution stops here, nothing further is needed
+				instr.opcode = color_opcode::invalid;
+				instr.reason = invalid.reason;
+				done = true;
+			}
+		}, color_tn.token);
+	}
+}
+
+std::uint32_t color_program::add_class(std::string_view name)
+{
+	const auto output_char = [this](char c) {
+		return m_hyphenated_classes && c == '_' ? '-' : c;
+	};
+
+	// programs use few distinct classes, linear search is enough
+	for (std::size_t i = 0; i < m_classes.size(); ++i) {
+		const class_entry entry = m_classes[i];
+		if (entry.length != name.size())
+			continue;
+
+		const auto first = m_class_names.begin() + entry.offset;
+		if (std::equal(name.begin(), name.end(), first, [&](char lhs, char rhs) { return output_char(lhs) == rhs; }))
+			return static_cast<std::uint32_t>(i);
+	}
+
+	const auto offset = static_cast<std::uint32_t>(m_class_names.size());
+	std::transform(name.begin(), name.end(), std::back_inserter(m_class_names), output_char);
+	m_classes.push_back(class_entry{offset, static_cast<std::uint32_t>(name.size())});
+	return static_cast<std::uint32_t>(m_classes.size() - 1);
+}
+
+void color_program::add_line(text::located_span location)
+{
+	const std::size_t line = location.span().line;
+	if (line < m_lines.size())
+		return;
+
+	m_lines.resize(line + 1);
+
+	const std::string_view whole_line = location.whole_line();
+	if (!whole_line.empty())
+		m_lines[line] = line_entry{static_cast<std::size_t>(whole_line.data() - m_color.data()), whole_line.size()};
+}
+
+text::located_span color_program::origin(const color_instruction& instruction, std::string_view color) const noexcept
+{
+	assert(color.size() == m_color.size());
+	assert(instruction.origin.line < m_lines.size());
+	const line_entry line = m_lines[instruction.origin.line];
+	return text::located_span(color.substr(line.offset, line.length), instruction.origin);
+}
+
+std::size_t color_program::capacity_bytes() const noexcept
+{
+	return utility::heap_bytes(m_color)
+		+ utility::heap_bytes(m_instructions)
+		+ utility::heap_bytes(m_lines)
+		+ utility::heap_bytes(m_class_names)
+		+ utility::heap_bytes(m_classes);
+}
+
+void color_program::release_memory()
+{
+	utility::release_memory(m_color);
+	utility::release_memory(m_instructions);
+	utility::release_memory(m_lines);
+	utility::release_memory(m_class_names);
+	utility::release_memory(m_classes);
+	m_hyphenated_classes = false;
+}
+
+void color_program::clear()
+{
+	m_color.clear();
+	m_instructions.clear();
+	m_lines.assign(1, line_entry{}); // built programs have 1 empty line of color
+	m_class_names.clear();
+	m_classes.clear();
+	m_hyphenated_classes = false;
+}
+
+color_instruction& color_program::add_instruction(color_opcode opcode)
+{
+	color_instruction& instr = m_instructions.emplace_back();
+	instr.opcode = opcode;
+	instr.origin = text::span{0, 0, 0};
+	return instr;
+}
+
+void color_program::add_text(std::string_view text, std::optional<web::css_class> class_)
+{
+	if (class_ && text.find('\n') == std::string_view::npos) {
+		color_instruction& instr = add_instruction(color_opcode::fixed_length);
+		instr.length = text.size();
+		instr.class_index = add_class(class_->name);
+		return;
+	}
+
+	// fixed length spans can not cross lines
+	if (class_)
+		open_span(*class_);
+
+	while (!text.empty()) {
+		const std::size_t line_length = std::min(text.find('\n'), text.size());
+
+		if (line_length != 0) {
+			// extend previous text if it has no class (it is on the same line)
+			if (!m_instructions.empty()
+				&& m_instructions.back().opcode == color_opcode::fixed_length
+				&& m_instructions.back().class_index == color_instruction::no_class)
+			{
+				m_instructions.back().length += line_length;
+			}
+			else {
+				add_instruction(color_opcode::fixed_length).length = line_length;
+			}
+		}
+
+		if (line_length == text.size())
+			break;
+
+		add_instruction(color_opcode::end_of_line);
+		text.remove_prefix(line_length + 1);
+	}
+
+	if (class_)
+		close_span();
+}
+
+void color_program::open_span(web::css_class class_, std::optional<web::css_class> class2)
+{
+	const std::uint32_t index = add_class(class_.name);
+	const std::uint32_t index2 = class2 ? add_class(class2->name) : color_instruction::no_class;
+
+	color_instruction& instr = add_instruction(color_opcode::open_span);
+	instr.class_index = index;
+	instr.escape_class_index = index2;
+}
+
+void color_program::close_span()
+{
+	add_instruction(color_opcode::close_span);
+}
+
+void color_program::finish()
+{
+	add_instruction(color_opcode::end_of_input);
+}
+
+bool color_program::serialize(std::string& output) const
+{
+	if (!is_built() || m_instructions.empty() || m_instructions.back().opcode != color_opcode::end_of_input)
+		return false;
+
+	output.append(program_magic.data(), program_magic.size());
+	output.push_back(static_cast<char>(program_version));
+
+	write_varint(output, m_classes.size());
+	for (std::size_t i = 0; i < m_classes.size(); ++i) {
+		const std::string_view name = class_at(static_cast<std::uint32_t>(i)).name;
+		write_varint(output, name.size());
+		output.append(name.data(), name.size());
+	}
+
+	write_varint(output, m_instructions.size());
+	for (const color_instruction& instr : m_instructions) {
+		output.push_back(static_cast<char>(instr.opcode));
+
+		switch (instr.opcode) {
+			case color_opcode::fixed_length:
+				write_varint(output, instr.length);
+				write_class_index(output, instr.class_index);
+				break;
+			case color_opcode::open_span:
+				write_class_index(output, instr.class_index);
+				write_class_index(output, instr.escape_class_index);
+				break;
+			case color_opcode::close_span:
+			case color_opcode::end_of_line:
+			case color_opcode::end_of_input:
+				break;
+			default:
+				// only compilation creates other instructions and compiled programs have color
+				assert(false);
+				return false;
+		}
+	}
+
+	return true;
+}
+
+bool color_program::deserialize(std::string_view input)
+{
+	clear();
+
+	const auto fail = [this]() {
+		clear();
+		return false;
+	};
+
+	if (input.substr(0, program_magic.size()) != program_magic)
+		return fail();
+
+	input.remove_prefix(program_magic.size());
+	if (input.empty() || static_cast<unsigned char>(input.front()) != program_version)
+		return fail();
+
+	input.remove_prefix(1);
+
+	std::uint64_t num_classes = 0;
+	if (!read_varint(input, num_classes) || num_classes > input.size())
+		return fail();
+
+	for (std::uint64_t i = 0; i < num_classes; ++i) {
+		std::uint64_t length = 0;
+		if (!read_varint(input, length) || length > input.size())
+			return fail();
+
+		// names are output unescaped in class attributes: a tampered program must not inject markup
+		const std::string_view name = input.substr(0, static_cast<std::size_t>(length));
+		if (!std::all_of(name.begin(), name.end(), web::is_css_class_char))
+			return fail();
+
+		// not add_class - indexes must be kept even if names repeat
+		const auto offset = static_cast<std::uint32_t>(m_class_names.size());
+		m_class_names.append(input.data(), length);
+		m_classes.push_back(class_entry{offset, static_cast<std::uint32_t>(length)});
+		input.remove_prefix(length);
+	}
+
+	std::uint64_t num_instructions = 0;
+	if (!read_varint(input, num_instructions) || num_instructions > input.size())
+		return fail();
+
+	std::size_t span_depth = 0;
+	for (std::uint64_t i = 0; i < num_instructions; ++i) {
+		if (input.empty())
+			return fail();
+
+		const auto opcode = static_cast<color_opcode>(static_cast<unsigned char>(input.front()));
+		input.remove_prefix(1);
+
+		switch (opcode) {
+			case color_opcode::fixed_length: {
+				std::uint64_t length = 0;
+				std::uint32_t class_index = color_instruction::no_class;
+				if (!read_varint(input, length) || !read_class_index(input, m_classes.size(), class_index))
+					return fail();
+
+				color_instruction& instr = add_instruction(opcode);
+				instr.length = static_cast<std::size_t>(length);
+				instr.class_index = class_index;
+				break;
+			}
+			case color_opcode::open_span: {
+				std::uint32_t class_index = color_instruction::no_class;
+				std::uint32_t class_index2 = color_instruction::no_class;
+				if (!read_class_index(input, m_classes.size(), class_index)
+					|| class_index == color_instruction::no_class
+					|| !read_class_index(input, m_classes.size(), class_index2))
+				{
+					return fail();
+				}
+
+				color_instruction& instr = add_instruction(opcode);
+				instr.class_index = class_index;
+				instr.escape_class_index = class_index2;
+				++span_depth;
+				break;
+			}
+			case color_opcode::close_span: {
+				if (span_depth == 0)
+					return fail();
+
+				add_instruction(opcode);
+				--span_depth;
+				break;
+			}
+			case color_opcode::end_of_line:
+			case color_opcode::end_of_input: {
+				add_instruction(opcode);
+				break;
+			}
+			default: {
+				return fail();
+			}
+		}
+	}
+
+	if (!input.empty()
+		|| span_depth != 0
+		|| m_instructions.empty()
+		|| m_instructions.back().opcode != color_opcode::end_of_input)
+	{
+		return fail();
+	}
+
+	return true;
+}
+
+std::shared_ptr<const color_program> color_program_cache::get(std::string_view color, const highlighter_options& options)
+{
+	const std::uint64_t hash = hash_key(color, options);
+
+	if (std::shared_ptr<const color_program> program = find(hash, color, options); program)
+		return program;
+
+	// only options are stored in the key, the program has its own copy of color
+	auto program = std::make_shared<const color_program>(color, options);
+	insert(hash, make_options_key(options), program);
+	return program;
+}
+
+std::shared_ptr<const color_program> color_program_cache::find(
+	std::uint64_t hash, std::string_view color, const highlighter_options& options)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	const auto it = m_index.find(hash);
+	if (it == m_index.end()
+		|| it->second->program->color() != color
+		|| !matches_options_key(it->second->options_key, options))
+	{
+		++m_misses;
+		return nullptr;
+	}
+
+	++m_hits;
+	m_entries.splice(m_entries.begin(), m_entries, it->second);
+	return it->second->program;
+}
+
+void color_program_cache::insert(std::uint64_t hash, std::string options_key, std::shared_ptr<const color_program> program)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (m_capacity == 0)
+		return;
+
+	// present if another thread compiled the same program or on hash collision - replace
+	if (const auto it = m_index.find(hash); it != m_index.end()) {
+		m_entries.erase(it->second);
+		m_index.erase(it);
+	}
+
+	m_entries.push_front(entry{hash, std::move(options_key), std::move(program)});
+	m_index.emplace(hash, m_entries.begin());
+
+	while (m_entries.size() > m_capacity) {
+		m_index.erase(m_entries.back().hash);
+		m_entries.pop_back();
+	}
+}
+
+void color_program_cache::clear()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_entries.clear();
+	m_index.clear();
+	m_hits = 0;
+	m_misses = 0;
+}
+
+std::size_t color_program_cache::size() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_entries.size();
+}
+
+std::size_t color_program_cache::hits() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_hits;
+}
+
+std::size_t color_program_cache::misses() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_misses;
+}
+
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <ach/mirror/core.hpp>
+#include <ach/text/types.hpp>
+#include <ach/web/types.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace ach::mirror {
+
+enum class color_opcode : unsigned char
+{
+	identifier,
+	fixed_length,
+	line_delimited,
+	number,
+	symbol,
+	empty_token,
+	quoted,
+	// only in built programs (see color_program::open_span)
+	open_span,
+	close_span,
+	end_of_line,
+	end_of_input,
+	invalid
+};
+
+// one color token with everything that depends on options already resolved
+struct color_instruction
+{
+	static constexpr std::uint32_t no_class = static_cast<std::uint32_t>(-1);
+
+	color_opcode opcode;
+	char symbol = '\0'; // quoted: delimiter
+	char escape = '\0'; // quoted: escape character
+	std::uint32_t class_index = no_class;
+	std::uint32_t escape_class_index = no_class; // quoted: escape class, open_span: second class
+	// first class not present in valid CSS classes, reported only after code has been matched
+	std::uint32_t invalid_class_index = no_class;
+	// fixed_length: number of characters
+	// symbol: length of the run of consecutive symbols (the run is the origin text)
+	std::size_t length = 0;
+	const char* reason = nullptr; // invalid: error description
+	text::span origin;            // location in color text
+};
+
+/*
+ * Color text compiled for given options: keywords are recognized, numbers parsed and
+ * CSS classes resolved (hyphenated if requested) and validated. Executing a program only
+ * walks the code. Compilation never fails - invalid color tokens become instructions
+ * that report the error when executed, so errors are the same as without compilation.
+ *
+ * Options used: all of color options, replace_underscores_to_hyphens and valid CSS classes.
+ */
+class color_program
+{
+public:
+	color_program() = default;
+	color_program(std::string_view color, const highlighter_options& options)
+	{
+		assign(color, options);
+	}
+
+	// recompile, reusing allocated memory
+	void assign(std::string_view color, const highlighter_options& options);
+
+	std::string_view color() const noexcept { return m_color; }
+	const std::vector<color_instruction>& instructions() const noexcept { return m_instructions; }
+	std::size_t num_classes() const noexcept { return m_classes.size(); }
+	bool has_hyphenated_classes() const noexcept { return m_hyphenated_classes; }
+
+	web::css_class class_at(std::uint32_t index) const noexcept
+	{
+		const class_entry entry = m_classes[index];
+		return web::css_class{std::string_view(m_class_names.data() + entry.offset, entry.length)};
+	}
+
+	// location of the instruction in color, which must have the same contents as the compiled one
+	text::located_span origin(const color_instruction& instruction, std::string_view color) const noexcept;
+
+	/*
+	 * Building without color text: instructions are added directly, which allows to express
+	 * output of other highlighters (nested spans, multiple classes) that color text can not
+	 * (see clangd::highlighter::export_program). Classes are used as given (no validation,
+	 * no underscore replacement). Errors from executing built programs refer to empty color.
+	 *
+	 * Start with clear(), end with finish(). Text is matched by length, so the program should
+	 * be run only on the code it has been built from - other code is reported as an error
+	 * only if it has a different layout (lengths of lines).
+	 */
+	void clear();
+	// text may contain line feeds, if it has a class it is put into 1 span
+	void add_text(std::string_view text, std::optional<web::css_class> class_ = std::nullopt);
+	void open_span(web::css_class class_, std::optional<web::css_class> class2 = std::nullopt);
+	void close_span();
+	void finish();
+
+	bool is_built() const noexcept { return m_color.empty(); }
+
+	// heap memory of the program, including capacity kept for recompilation
+	std::size_t capacity_bytes() const noexcept;
+	// empties the program and frees its memory
+	void release_memory();
+
+	/*
+	 * Binary form of built programs, for storing them. The format is versioned, programs
+	 * stored by a different version are rejected. Returns false if the program has color
+	 * text (store the text instead) or if the input is not a valid program (the program
+	 * is then empty). Class names with characters that can not form a CSS class are invalid.
+	 */
+	[[nodiscard]] bool serialize(std::string& output) const;
+	[[nodiscard]] bool deserialize(std::string_view input);
+
+private:
+	struct class_entry
+	{
+		std::uint32_t offset;
+		std::uint32_t length;
+	};
+
+	struct line_entry
+	{
+		std::size_t offset = 0;
+		std::size_t length = 0;
+	};
+
+	std::uint32_t add_class(std::string_view name);
+	void add_line(text::located_span location);
+	color_instruction& add_instruction(color_opcode opcode);
+
+	std::string m_color;
+	std::vector<color_instruction> m_instructions;
+	std::vector<line_entry> m_lines;
+	// offsets, not views: views into a short string would not survive moving it
+	std::string m_class_names;
+	std::vector<class_entry> m_classes;
+	bool m_hyphenated_classes = false;
+};
+
+/*
+ * Least-recently-used cache of compiled programs, keyed by the color text and options
+ * that affect compilation. Thread-safe; compilation happens outside of the lock.
+ */
+class color_program_cache
+{
+public:
+	static constexpr std::size_t default_capacity = 1024;
+
+	explicit color_program_cache(std::size_t capacity = default_capacity)
+	: m_capacity(capacity) {}
+
+	// compiles on a miss, the program stays valid even if evicted
+	std::shared_ptr<const color_program> get(std::string_view color, const highlighter_options& options);
+
+	void clear();
+
+	std::size_t capacity() const noexcept { return m_capacity; }
+	std::size_t size() const;
+	std::size_t hits() const;
+	std::size_t misses() const;
+
+private:
+	struct entry
+	{
+		std::uint64_t hash;
+		std::string options_key; // color is compared with the program's copy
+		std::shared_ptr<const color_program> program;
+	};
+
+	std::shared_ptr<const color_program> find(std::uint64_t hash, std::string_view color, const highlighter_options& options);
+	void insert(std::uint64_t hash, std::string options_key, std::shared_ptr<const color_program> program);
+
+	mutable std::mutex m_mutex;
+	std::size_t m_capacity;
+	std::list<entry> m_entries; // most recently used first
+	std::unordered_map<std::uint64_t, std::list<entry>::iterator> m_index;
+	std::size_t m_hits = 0;
+	std::size_t m_misses = 0;
+};
+
+}
@@ -6,7 +6,7 @@
 
 namespace ach::mirror {
 
-color_token color_tokenizer::next_token(color_options options)
+color_token color_tokenizer::next_token(const color_options& options)
 {
 	std::optional<char> c = extractor.peek_next_char();
 	if (!c) {
@@ -12,7 +12,7 @@ public:
 	color_tokenizer(std::string_view text)
 	: extractor(text) {}
 
-	color_token next_token(color_options options);
+	color_token next_token(const color_options& options);
 
 	[[nodiscard]] bool has_reached_end() const noexcept { return extractor.has_reached_end(); }
 	text::located_span current_location() const noexcept { return extractor.current_location(); }
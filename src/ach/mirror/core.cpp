@@ -1,150 +1,203 @@
 #include <ach/mirror/core.hpp>
 #include <ach/mirror/errors.hpp>
 #include <ach/mirror/code_tokenizer.hpp>
-#include <ach/mirror/color_tokenizer.hpp>
+#include <ach/mirror/color_program.hpp>
+#include <ach/mirror/color_token.hpp>
+#include <ach/mirror/line_split.hpp>
 #include <ach/web/types.hpp>
 #include <ach/web/html_builder.hpp>
 #include <ach/text/utils.hpp>
 #include <ach/utility/visitor.hpp>
-#include <ach/utility/algorithm.hpp>
 
 #include <cassert>
 #include <algorithm>
 #include <cstddef>
+#include <cstring>
 #include <optional>
 #include <variant>
 #include <utility>
 #include <ostream>
 #include <functional>
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace ach::mirror {
 namespace {
 
-using result_t = std::variant<web::simple_span_element, web::quote_span_element, highlighter_error, end_of_input>;
+// built programs only (see color_program::open_span)
+struct open_span_element
+{
+	web::css_class class_;
+	std::optional<web::css_class> class2;
+};
+
+struct close_span_element {};
+
+using result_t = std::variant<
+	web::simple_span_element,
+	web::quote_span_element,
+	open_span_element,
+	close_span_element,
+	highlighter_error,
+	end_of_input>;
+
+std::optional<web::css_class> class_at(const color_program& program, std::uint32_t index)
+{
+	if (index == color_instruction::no_class)
+		return std::nullopt;
+
+	return program.class_at(index);
+}
 
-result_t process_color_token(color_token color_tn, code_tokenizer& code_tr)
+result_t execute(const color_instruction& instr, text::located_span color_origin, const color_program& program, code_tokenizer& code_tr)
 {
-	return std::visit(utility::visitor{
-		[&](identifier_span id_span) -> result_t {
+	switch (instr.opcode) {
+		case color_opcode::identifier: {
 			const text::located_span extracted_identifier = code_tr.extract_identifier();
 
 			if (extracted_identifier.str().empty()) {
-				return highlighter_error{color_tn.origin, extracted_identifier, errors::expected_identifier};
+				return highlighter_error{color_origin, extracted_identifier, errors::expected_identifier};
 			}
 
-			return web::simple_span_element{web::html_text{extracted_identifier.str()}, id_span.class_};
-		},
-		[&](fixed_length_span fl_span) -> result_t {
-			const text::located_span extracted_characters = code_tr.extract_n_characters(fl_span.length);
+			return web::simple_span_element{web::html_text{extracted_identifier.str()}, program.class_at(instr.class_index)};
+		}
+		case color_opcode::fixed_length: {
+			const text::located_span extracted_characters = code_tr.extract_n_characters(instr.length);
 			const auto extracted_chars = extracted_characters.str().size();
-			assert(extracted_chars <= fl_span.length);
+			assert(extracted_chars <= instr.length);
 
-			if (extracted_chars < fl_span.length) {
-				return highlighter_error{color_tn.origin, extracted_characters, errors::insufficient_characters};
+			if (extracted_chars < instr.length) {
+				return highlighter_error{color_origin, extracted_characters, errors::insufficient_characters};
 			}
 
-			return web::simple_span_element{web::html_text{extracted_characters.str()}, fl_span.class_};
-		},
-		[&](line_delimited_span ld_span) -> result_t {
+			return web::simple_span_element{web::html_text{extracted_characters.str()}, class_at(program, instr.class_index)};
+		}
+		case color_opcode::line_delimited: {
 			const text::located_span extracted_text = code_tr.extract_until_end_of_line();
 			// no if extracted_text.str().empty() here - we want to allow empty extractions
-			return web::simple_span_element{web::html_text{extracted_text.str()}, ld_span.class_};
-		},
-		[&](symbol s) -> result_t {
-			const text::located_span extracted_symbol = code_tr.extract_n_characters(1);
-
-			if (extracted_symbol.str().empty()) {
-				return highlighter_error{color_tn.origin, extracted_symbol, errors::expected_symbol};
+			return web::simple_span_element{web::html_text{extracted_text.str()}, class_at(program, instr.class_index)};
+		}
+		case color_opcode::symbol: {
+			// whole run of symbols is compared at once
+			const std::string_view expected = color_origin.str();
+			const std::string_view remaining = code_tr.remaining_line_text().str();
+			assert(expected.size() == instr.length);
+
+			if (remaining.size() >= expected.size()
+				&& std::memcmp(remaining.data(), expected.data(), expected.size()) == 0)
+			{
+				const text::located_span extracted_symbols = code_tr.extract_n_characters(expected.size());
+				return web::simple_span_element{web::html_text{extracted_symbols.str()}, std::nullopt};
 			}
 
-			assert(extracted_symbol.str().size() == 1u);
+			// report the same error as if every symbol was a separate token
+			const std::size_t num_matched = std::mismatch(
+				expected.begin(),
+				expected.begin() + std::min(expected.size(), remaining.size()),
+				remaining.begin()).first - expected.begin();
+			(void) code_tr.extract_n_characters(num_matched);
 
-			if (extracted_symbol.str().front() != s.expected_symbol) {
-				return highlighter_error{color_tn.origin, extracted_symbol, errors::mismatched_symbol};
+			const text::located_span symbol_origin(
+				color_origin.whole_line(), color_origin.span().line, color_origin.span().column + num_matched, 1);
+			const text::located_span extracted_symbol = code_tr.extract_n_characters(1);
+
+			if (extracted_symbol.str().empty()) {
+				return highlighter_error{symbol_origin, extracted_symbol, errors::expected_symbol};
 			}
 
-			return web::simple_span_element{web::html_text{extracted_symbol.str()}, std::nullopt};
-		},
-		[&](number num) -> result_t {
+			return highlighter_error{symbol_origin, extracted_symbol, errors::mismatched_symbol};
+		}
+		case color_opcode::number: {
 			const text::located_span extracted_digits = code_tr.extract_digits();
 
 			if (extracted_digits.str().empty()) {
-				return highlighter_error{color_tn.origin, extracted_digits, errors::expected_number};
+				return highlighter_error{color_origin, extracted_digits, errors::expected_number};
 			}
 
-			return web::simple_span_element{web::html_text{extracted_digits.str()}, num.class_};
-		},
-		[&](empty_token) -> result_t {
+			return web::simple_span_element{web::html_text{extracted_digits.str()}, program.class_at(instr.class_index)};
+		}
+		case color_opcode::empty_token: {
 			return web::simple_span_element{web::html_text{}, std::nullopt};
-		},
-		[&](quoted_span span) -> result_t {
-			const text::located_span extracted_text = code_tr.extract_quoted(span.delimeter, span.escape);
+		}
+		case color_opcode::quoted: {
+			const text::located_span extracted_text = code_tr.extract_quoted(instr.symbol, instr.escape);
 
 			if (extracted_text.str().empty()) {
-				return highlighter_error{color_tn.origin, extracted_text, errors::expected_quoted};
+				return highlighter_error{color_origin, extracted_text, errors::expected_quoted};
 			}
 
 			return web::quote_span_element{
-				web::html_text{extracted_text.str()}, span.primary_class, span.escape_class, span.escape
+				web::html_text{extracted_text.str()},
+				program.class_at(instr.class_index),
+				program.class_at(instr.escape_class_index),
+				instr.escape
 			};
-		},
-		[&](end_of_line) -> result_t {
+		}
+		case color_opcode::open_span: {
+			return open_span_element{program.class_at(instr.class_index), class_at(program, instr.escape_class_index)};
+		}
+		case color_opcode::close_span: {
+			return close_span_element{};
+		}
+		case color_opcode::end_of_line: {
 			const text::located_span extracted_char = code_tr.extract_n_characters(1);
 
 			if (extracted_char.str().empty()) {
-				return highlighter_error{color_tn.origin, extracted_char, errors::expected_line_feed};
+				return highlighter_error{color_origin, extracted_char, errors::expected_line_feed};
 			}
 
 			assert(extracted_char.str().size() == 1u);
 
 			if (extracted_char.str().front() != '\n') {
-				return highlighter_error{color_tn.origin, extracted_char, errors::expected_line_feed};
+				return highlighter_error{color_origin, extracted_char, errors::expected_line_feed};
 			}
 
 			// ignore if no more lines are present
 			(void) code_tr.load_next_line();
 
 			return web::simple_span_element{web::html_text{extracted_char.str()}, std::nullopt};
-		},
-		[](end_of_input eoi) -> result_t {
-			return eoi;
-		},
-		[&](invalid_token invalid) -> result_t {
-			return highlighter_error{color_tn.origin, code_tr.current_location(), invalid.reason};
 		}
-	}, color_tn.token);
-}
-
-bool is_valid_css_class(web::css_class class_, std::string_view valid_classes)
-{
-	return utility::search_whole_word(
-		valid_classes.begin(),
-		valid_classes.end(),
-		class_.name.begin(),
-		class_.name.end(),
-		text::is_alpha_or_underscore) != valid_classes.end();
-}
-
-std::optional<web::css_class> find_invalid_css_class(web::simple_span_element el, std::string_view valid_classes)
-{
-	if (!el.class_.has_value())
-		return std::nullopt;
-
-	if (is_valid_css_class(*el.class_, valid_classes))
-		return std::nullopt;
-	else
-		return el.class_;
+		case color_opcode::end_of_input: {
+			return end_of_input{};
+		}
+		case color_opcode::invalid:
+		default: {
+			return highlighter_error{color_origin, code_tr.current_location(), instr.reason};
+		}
+	}
 }
 
-std::optional<web::css_class> find_invalid_css_class(web::quote_span_element el, std::string_view valid_classes)
+// Program class names are hyphenated and owned by the program - the name for the error
+// is taken from where the color tokenizer has found it (color text or options), same as
+// if there was no compilation step.
+std::string_view invalid_class_name(
+	const color_instruction& instr,
+	text::located_span color_origin,
+	const color_options& options)
 {
-	if (!is_valid_css_class(el.primary_class, valid_classes))
-		return el.primary_class;
-
-	if (!is_valid_css_class(el.escape_class, valid_classes))
-		return el.escape_class;
-
-	return std::nullopt;
+	switch (instr.opcode) {
+		case color_opcode::number:
+			return options.num_class;
+		case color_opcode::quoted: {
+			const bool is_primary = instr.invalid_class_index == instr.class_index;
+			if (instr.symbol == '"')
+				return is_primary ? options.str_class : options.str_esc_class;
+			else
+				return is_primary ? options.chr_class : options.chr_esc_class;
+		}
+		default: {
+			// identifier or span name, possibly preceded by its length
+			std::string_view name = color_origin.str();
+			name.remove_prefix(std::find_if_not(name.begin(), name.end(), text::is_digit) - name.begin());
+			return name;
+		}
+	}
 }
 
 std::size_t expected_output_size(std::size_t code_size, std::size_t color_size) noexcept
@@ -159,75 +212,546 @@ std::size_t expected_output_size(std::size_t code_size, std::size_t color_size)
 	return std::max(code_size, color_size) * 5u;
 }
 
+// hyphenated_classes is a storage for whitespace-insensitive classes, must outlive the builder's use
+void configure_builder(web::html_builder& builder, const highlighter_options& options, std::string& hyphenated_classes)
+{
+	// class names are already hyphenated so whitespace-insensitive ones must be too
+	std::string_view whitespace_insensitive_classes = options.generation.whitespace_insensitive_css_classes;
+	if (options.generation.replace_underscores_to_hyphens
+		&& options.generation.coalesce_spans
+		&& whitespace_insensitive_classes.find('_') != std::string_view::npos)
+	{
+		hyphenated_classes = whitespace_insensitive_classes;
+		std::replace(hyphenated_classes.begin(), hyphenated_classes.end(), '_', '-');
+		whitespace_insensitive_classes = hyphenated_classes;
+	}
+
+	builder.set_span_coalescing(options.generation.coalesce_spans, whitespace_insensitive_classes);
+	builder.set_class_map(options.generation.class_map);
+	// the program may not outlive the output
+	builder.set_stable_class_names(false);
 }
 
-std::variant<std::string, highlighter_error> run_highlighter(
+// color must have the same contents as the one the program was compiled from,
+// errors refer to it (not to the program which may be temporary)
+[[nodiscard]] std::optional<highlighter_error> execute_program(
+	web::html_builder& builder,
 	std::string_view code,
 	std::string_view color,
+	const color_program& program,
 	const highlighter_options& options)
 {
-	const bool wrap_in_table = !options.generation.table_wrap_css_class.empty();
-	const auto num_lines = text::count_lines(code);
-	web::html_builder builder;
-	builder.reserve(expected_output_size(code.size(), color.size()));
-	if (wrap_in_table) {
-		builder.open_table(num_lines, options.generation.table_wrap_css_class);
-	}
-
-	color_tokenizer color_tr(color);
 	code_tokenizer code_tr(code);
+	utility::cancellation_checker is_cancelled(options.generation.cancellation);
 
-	bool done = false;
-	while (!done) {
-		const color_token color_tn = color_tr.next_token(options.color);
+	for (const color_instruction& instr : program.instructions()) {
+		const text::located_span color_origin = program.origin(instr, color);
 		const text::located_span last_code_location = code_tr.current_location();
 
+		if (is_cancelled())
+			return highlighter_error{color_origin, last_code_location, errors::cancelled};
+
 		auto visitor = utility::visitor{
 			[](highlighter_error error) -> std::optional<highlighter_error> {
 				return error;
 			},
+			[&](open_span_element span) -> std::optional<highlighter_error> {
+				if (span.class2)
+					builder.open_span(span.class_, *span.class2);
+				else
+					builder.open_span(span.class_);
+
+				return std::nullopt;
+			},
+			[&](close_span_element) -> std::optional<highlighter_error> {
+				builder.close_span();
+				return std::nullopt;
+			},
 			[&](auto span) -> std::optional<highlighter_error> {
-				if (!options.generation.valid_css_classes.empty()) {
-					std::optional<web::css_class> invalid_class = find_invalid_css_class(
-						span, options.generation.valid_css_classes);
-
-					if (invalid_class)
-						return highlighter_error{
-							color_tn.origin,
-							last_code_location,
-							errors::invalid_css_class,
-							(*invalid_class).name};
+				if (instr.invalid_class_index != color_instruction::no_class) {
+					return highlighter_error{
+						color_origin,
+						last_code_location,
+						errors::invalid_css_class,
+						invalid_class_name(instr, color_origin, options.color)};
 				}
 
-				builder.add_span(span, options.generation.replace_underscores_to_hyphens);
+				builder.add_span(span);
 				return std::nullopt;
 			},
 			[&](end_of_input) -> std::optional<highlighter_error> {
-				done = true; // exit the loop when color input ends
+				if (!code_tr.has_reached_end()) {
+					// underline remaining code
+					return highlighter_error{
+						color_origin,
+						code_tr.remaining_line_text(),
+						errors::exhausted_color
+					};
+				}
+
 				return std::nullopt;
 			}
 		};
 
-		auto maybe_error = std::visit(visitor, process_color_token(color_tn, code_tr));
+		auto maybe_error = std::visit(visitor, execute(instr, color_origin, program, code_tr));
 		if (maybe_error)
-			return *maybe_error;
+			return maybe_error;
 	}
 
-	if (!code_tr.has_reached_end()) {
-		// underline remaining code
-		return highlighter_error{
-			color_tr.current_location(),
-			code_tr.remaining_line_text(),
-			errors::exhausted_color
-		};
+	return std::nullopt;
+}
+
+[[nodiscard]] std::optional<highlighter_error> generate(
+	web::html_builder& builder,
+	std::string_view code,
+	std::string_view color,
+	const color_program& program,
+	const highlighter_options& options,
+	generation_stats& stats)
+{
+	const bool wrap_in_table = !options.generation.table_wrap_css_class.empty();
+
+	std::string hyphenated_classes;
+	configure_builder(builder, options, hyphenated_classes);
+
+	if (wrap_in_table) {
+		builder.open_table(text::count_lines(code), options.generation.table_wrap_css_class);
 	}
 
+	if (auto maybe_error = execute_program(builder, code, color, program, options); maybe_error)
+		return maybe_error;
+
+	builder.flush();
+	stats.coalesced_bytes = builder.coalesced_bytes();
+
 	if (wrap_in_table)
 		builder.close_table();
 
+	return std::nullopt;
+}
+
+[[nodiscard]] std::optional<highlighter_error> generate(
+	web::html_builder& builder,
+	std::string_view code,
+	std::string_view color,
+	const highlighter_options& options,
+	generation_stats& stats)
+{
+	if (options.generation.program_cache) {
+		const std::shared_ptr<const color_program> program = options.generation.program_cache->get(color, options);
+		return generate(builder, code, color, *program, options, stats);
+	}
+
+	const color_program program(color, options);
+	return generate(builder, code, color, program, options, stats);
+}
+
+}
+
+std::variant<std::string, highlighter_error> run_highlighter(
+	std::string_view code,
+	std::string_view color,
+	const highlighter_options& options)
+{
+	generation_stats stats;
+	return run_highlighter(code, color, options, stats);
+}
+
+std::variant<std::string, highlighter_error> run_highlighter(
+	std::string_view code,
+	std::string_view color,
+	const highlighter_options& options,
+	generation_stats& stats)
+{
+	web::html_builder builder;
+	builder.reserve(expected_output_size(code.size(), color.size()));
+
+	if (auto maybe_error = generate(builder, code, color, options, stats); maybe_error)
+		return *maybe_error;
+
 	return std::move(builder.str());
 }
 
+std::optional<highlighter_error> run_highlighter(
+	std::string_view code,
+	std::string_view color,
+	web::output_sink& output,
+	const highlighter_options& options)
+{
+	web::html_builder builder;
+	builder.set_sink(&output);
+	generation_stats stats;
+	std::optional<highlighter_error> maybe_error = generate(builder, code, color, options, stats);
+	output.flush();
+	return maybe_error;
+}
+
+std::variant<std::string, highlighter_error> run_highlighter(
+	std::string_view code,
+	const color_program& program,
+	const highlighter_options& options)
+{
+	web::html_builder builder;
+	builder.reserve(expected_output_size(code.size(), program.color().size()));
+
+	generation_stats stats;
+	if (auto maybe_error = generate(builder, code, program.color(), program, options, stats); maybe_error)
+		return *maybe_error;
+
+	return std::move(builder.str());
+}
+
+namespace {
+
+using batch_result = std::variant<std::string, highlighter_error>;
+
+// batches are claimed one at a time by the caller and by helper tasks
+struct parallel_run_state
+{
+	parallel_run_state(std::vector<line_split_part> batches, const highlighter_options& options)
+	: batches(std::move(batches))
+	, options(options)
+	, outputs(this->batches.size())
+	, first_failed_batch(this->batches.size())
+	{
+		this->options.generation.table_wrap_css_class = {};
+		// single-use batch programs would evict useful entries and every batch would lock it
+		this->options.generation.program_cache = nullptr;
+	}
+
+	void run_batches()
+	{
+		for (std::size_t i = next_batch++; i < batches.size(); i = next_batch++) {
+			// batches after a failed one are not needed
+			if (i < first_failed_batch.load(std::memory_order_relaxed)) {
+				try {
+					outputs[i] = run_highlighter(batches[i].code, batches[i].color, options);
+				}
+				catch (...) {
+					std::lock_guard<std::mutex> lock(mutex);
+					if (!exception)
+						exception = std::current_exception();
+				}
+
+				if (std::holds_alternative<highlighter_error>(outputs[i])) {
+					std::size_t expected = first_failed_batch.load(std::memory_order_relaxed);
+					while (i < expected && !first_failed_batch.compare_exchange_weak(expected, i)) {}
+				}
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			if (++num_done == batches.size())
+				done.notify_all();
+		}
+	}
+
+	// until all batches are done, rethrows the first exception of any batch
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		done.wait(lock, [this]() { return num_done == batches.size(); });
+		if (exception)
+			std::rethrow_exception(exception);
+	}
+
+	// code, color and options are only accessed while the caller waits
+	std::vector<line_split_part> batches;
+	highlighter_options options;
+	std::vector<batch_result> outputs;
+	std::atomic<std::size_t> next_batch = 0;
+	std::atomic<std::size_t> first_failed_batch;
+
+	std::mutex mutex;
+	std::condition_variable done;
+	std::size_t num_done = 0;
+	std::exception_ptr exception;
+};
+
+}
+
+std::variant<std::string, highlighter_error> run_highlighter(
+	std::string_view code,
+	std::string_view color,
+	const highlighter_options& options,
+	utility::thread_pool& pool,
+	std::size_t lines_per_batch)
+{
+	const auto num_code_line_feeds = static_cast<std::size_t>(std::count(code.begin(), code.end(), '\n'));
+	const auto num_color_line_feeds = static_cast<std::size_t>(std::count(color.begin(), color.end(), '\n'));
+
+	if (lines_per_batch == 0
+		|| num_code_line_feeds != num_color_line_feeds
+		|| num_code_line_feeds < 2 * lines_per_batch
+		|| options.generation.coalesce_spans
+		|| options.generation.class_map != nullptr)
+	{
+		return run_highlighter(code, color, options);
+	}
+
+	// shared with helper tasks: a helper may start after the run has returned (then it finds no work)
+	const auto state = std::make_shared<parallel_run_state>(split_into_parts(code, color, lines_per_batch), options);
+
+	// The calling thread takes part, helpers only speed it up: if the caller is a task of
+	// the same pool and all workers are busy (or waiting like this one), nothing deadlocks.
+	const std::size_t num_helpers = std::min(pool.num_threads(), state->batches.size() - 1);
+	for (std::size_t i = 0; i < num_helpers; ++i)
+		(void) pool.submit([state]() { state->run_batches(); });
+
+	state->run_batches();
+	state->wait();
+
+	std::vector<batch_result>& outputs = state->outputs;
+	const std::vector<line_split_part>& batches = state->batches;
+	std::size_t total_size = 0;
+	for (std::size_t i = 0; i < outputs.size(); ++i) {
+		if (auto error = std::get_if<highlighter_error>(&outputs[i]); error != nullptr) {
+			// batch locations are relative to the first line of the batch
+			error->code_location = shift_lines(error->code_location, batches[i].first_line);
+			error->color_location = shift_lines(error->color_location, batches[i].first_line);
+			return *error;
+		}
+
+		total_size += std::get<std::string>(outputs[i]).size();
+	}
+
+	web::html_builder builder;
+	builder.reserve(total_size);
+	const bool wrap_in_table = !options.generation.table_wrap_css_class.empty();
+	if (wrap_in_table)
+		builder.open_table(text::count_lines(code), options.generation.table_wrap_css_class);
+
+	// already escaped - append directly
+	for (const batch_result& output : outputs)
+		builder.str() += std::get<std::string>(output);
+
+	if (wrap_in_table)
+		builder.close_table();
+
+	return std::move(builder.str());
+}
+
+struct highlighter::owned_options
+{
+	void assign(const highlighter_options& source)
+	{
+		const generation_options& gen = source.generation;
+		const color_options& col = source.color;
+
+		table_wrap_css_class = gen.table_wrap_css_class;
+		valid_css_classes = gen.valid_css_classes;
+		whitespace_insensitive_css_classes = gen.whitespace_insensitive_css_classes;
+		// done once here instead of on every run (it would be done anyway, see generate)
+		if (gen.replace_underscores_to_hyphens)
+			std::replace(whitespace_insensitive_css_classes.begin(), whitespace_insensitive_css_classes.end(), '_', '-');
+		num_keyword = col.num_keyword;
+		str_keyword = col.str_keyword;
+		chr_keyword = col.chr_keyword;
+		num_class = col.num_class;
+		str_class = col.str_class;
+		str_esc_class = col.str_esc_class;
+		chr_class = col.chr_class;
+		chr_esc_class = col.chr_esc_class;
+
+		valid_css_class_set.clear();
+		if (gen.valid_css_class_set == nullptr && !gen.valid_css_classes.empty())
+			valid_css_class_set.add(gen.valid_css_classes);
+
+		options = source;
+		options.generation.table_wrap_css_class = table_wrap_css_class;
+		options.generation.valid_css_classes = valid_css_classes;
+		options.generation.whitespace_insensitive_css_classes = whitespace_insensitive_css_classes;
+		if (gen.valid_css_class_set == nullptr && !gen.valid_css_classes.empty())
+			options.generation.valid_css_class_set = &valid_css_class_set;
+		options.color.num_keyword = num_keyword;
+		options.color.str_keyword = str_keyword;
+		options.color.chr_keyword = chr_keyword;
+		options.color.num_class = num_class;
+		options.color.str_class = str_class;
+		options.color.str_esc_class = str_esc_class;
+		options.color.chr_class = chr_class;
+		options.color.chr_esc_class = chr_esc_class;
+	}
+
+	highlighter_options options;
+
+	std::string table_wrap_css_class;
+	std::string valid_css_classes;
+	std::string whitespace_insensitive_css_classes;
+	std::string num_keyword;
+	std::string str_keyword;
+	std::string chr_keyword;
+	std::string num_class;
+	std::string str_class;
+	std::string str_esc_class;
+	std::string chr_class;
+	std::string chr_esc_class;
+	web::css_class_set valid_css_class_set;
+};
+
+highlighter::highlighter()
+: highlighter(highlighter_options{})
+{}
+
+highlighter::highlighter(const highlighter_options& options)
+: m_options(std::make_unique<owned_options>())
+, m_program(std::make_unique<color_program>())
+{
+	m_options->assign(options);
+}
+
+highlighter::~highlighter() = default;
+highlighter::highlighter(highlighter&& other) noexcept = default;
+highlighter& highlighter::operator=(highlighter&& other) noexcept = default;
+
+void highlighter::set_options(const highlighter_options& options)
+{
+	m_options->assign(options);
+}
+
+const highlighter_options& highlighter::options() const noexcept
+{
+	return m_options->options;
+}
+
+std::size_t highlighter::retained_bytes() const noexcept
+{
+	return m_builder.capacity_bytes()
+		+ m_program->capacity_bytes()
+		+ utility::heap_bytes(m_code_line)
+		+ utility::heap_bytes(m_color_line)
+		+ utility::heap_bytes(m_hyphenated_classes);
+}
+
+void highlighter::trim()
+{
+	if (!m_has_untrimmed_run)
+		return;
+
+	m_has_untrimmed_run = false;
+	// color is the size of the compiled program, lines are only used when streaming
+	const std::size_t used = m_builder.str().size() + m_program->color().size() + m_code_line.size() + m_color_line.size();
+	if (m_retention_tracker.should_release(m_retention, used, retained_bytes()))
+		release_memory();
+}
+
+void highlighter::release_memory()
+{
+	m_builder.release_memory();
+	m_program->release_memory();
+	utility::release_memory(m_code_line);
+	utility::release_memory(m_color_line);
+	utility::release_memory(m_hyphenated_classes);
+}
+
+void highlighter::begin_run()
+{
+	trim();
+	m_has_untrimmed_run = true;
+}
+
+std::variant<std::string_view, highlighter_error>
+highlighter::run(std::string_view code, std::string_view color)
+{
+	begin_run();
+	m_builder.reset();
+	m_builder.reserve(expected_output_size(code.size(), color.size()));
+
+	if (auto maybe_error = run_internal(code, color); maybe_error)
+		return *maybe_error;
+
+	return std::string_view(m_builder.str());
+}
+
+std::optional<highlighter_error>
+highlighter::run(std::string_view code, std::string_view color, web::output_sink& output)
+{
+	begin_run();
+	m_builder.reset();
+	m_builder.set_sink(&output);
+	std::optional<highlighter_error> maybe_error = run_internal(code, color);
+	m_builder.set_sink(nullptr);
+	output.flush();
+	return maybe_error;
+}
+
+std::variant<std::string_view, highlighter_error>
+highlighter::run(std::string_view code, const color_program& program)
+{
+	begin_run();
+	m_builder.reset();
+	m_builder.reserve(expected_output_size(code.size(), program.color().size()));
+
+	if (auto maybe_error = generate(m_builder, code, program.color(), program, m_options->options, m_stats); maybe_error)
+		return *maybe_error;
+
+	return std::string_view(m_builder.str());
+}
+
+std::optional<highlighter_error>
+highlighter::run(text::line_source& code, text::line_source& color, web::output_sink& output)
+{
+	begin_run();
+	const highlighter_options& options = m_options->options;
+
+	if (!options.generation.table_wrap_css_class.empty()) {
+		m_code_line.clear();
+		m_color_line.clear();
+		return highlighter_error{
+			text::located_span(m_color_line, 0, 0, 0),
+			text::located_span(m_code_line, 0, 0, 0),
+			errors::streaming_table_wrap};
+	}
+
+	m_builder.reset();
+	m_builder.set_sink(&output);
+	// line buffers are reused
+	m_builder.set_stable_input(false);
+	// builder state (span coalescing, class map) continues across lines
+	configure_builder(m_builder, options, m_hyphenated_classes);
+
+	std::optional<highlighter_error> maybe_error;
+	for (std::size_t line = 0; ; ++line) {
+		const bool has_code = code.read_line(m_code_line);
+		const bool has_color = color.read_line(m_color_line);
+
+		if (!has_code && !has_color)
+			break;
+
+		// not through the program cache: single-line programs would evict useful entries
+		// and every line would lock it
+		m_program->assign(m_color_line, options);
+		maybe_error = execute_program(m_builder, m_code_line, m_color_line, *m_program, options);
+
+		if (maybe_error) {
+			// locations are relative to the line
+			maybe_error->code_location = shift_lines(maybe_error->code_location, line);
+			maybe_error->color_location = shift_lines(maybe_error->color_location, line);
+			break;
+		}
+	}
+
+	m_builder.flush();
+	m_stats.coalesced_bytes = m_builder.coalesced_bytes();
+	m_builder.set_sink(nullptr);
+	m_builder.set_stable_input(true);
+	output.flush();
+	return maybe_error;
+}
+
+std::optional<highlighter_error>
+highlighter::run_internal(std::string_view code, std::string_view color)
+{
+	const highlighter_options& options = m_options->options;
+
+	if (options.generation.program_cache) {
+		const std::shared_ptr<const color_program> program = options.generation.program_cache->get(color, options);
+		return generate(m_builder, code, color, *program, options, m_stats);
+	}
+
+	m_program->assign(color, options);
+	return generate(m_builder, code, color, *m_program, options, m_stats);
+}
+
 std::ostream& operator<<(std::ostream& os, text::located_span ls)
 {
 	// index is 0-based, add 1 for human output
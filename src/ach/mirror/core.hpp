@@ -1,8 +1,18 @@
 #pragma once
 
 #include <ach/text/types.hpp>
+#include <ach/text/line_source.hpp>
 #include <ach/mirror/color_options.hpp>
+#include <ach/web/css_class_map.hpp>
+#include <ach/web/css_class_set.hpp>
+#include <ach/web/output_sink.hpp>
+#include <ach/web/html_builder.hpp>
+#include <ach/utility/cancellation.hpp>
+#include <ach/utility/retention.hpp>
+#include <ach/utility/thread_pool.hpp>
 
+#include <memory>
+#include <optional>
 #include <string>
 #include <string_view>
 #include <variant>
@@ -10,11 +20,27 @@
 
 namespace ach::mirror {
 
+class color_program;
+class color_program_cache;
+
 struct generation_options
 {
 	bool replace_underscores_to_hyphens = false;
 	std::string_view table_wrap_css_class = {};
+	// if not empty, only these classes are allowed (names separated by non-identifier characters)
 	std::string_view valid_css_classes = {};
+	// same but parsed once and reusable, takes precedence over valid_css_classes (if not null)
+	const web::css_class_set* valid_css_class_set = nullptr;
+	// merge adjacent spans with the same class, see web::html_builder::set_span_coalescing
+	bool coalesce_spans = false;
+	std::string_view whitespace_insensitive_css_classes = {};
+	// compact output: replace class names (after underscore replacement)
+	// with short identifiers from this map (if not null)
+	web::css_class_map* class_map = nullptr;
+	// reuse compiled color (see color_program.hpp) across calls (if not null)
+	color_program_cache* program_cache = nullptr;
+	// stops a run with errors::cancelled, checked while executing color (see utility::cancellation)
+	utility::cancellation cancellation = {};
 };
 
 struct highlighter_options
@@ -31,11 +57,141 @@ struct highlighter_error
 	std::string_view extra_reason = {};
 };
 
+struct generation_stats
+{
+	std::size_t coalesced_bytes = 0;
+};
+
+std::variant<std::string, highlighter_error> run_highlighter(
+	std::string_view code,
+	std::string_view color,
+	const highlighter_options& options = {});
+
 std::variant<std::string, highlighter_error> run_highlighter(
 	std::string_view code,
 	std::string_view color,
+	const highlighter_options& options,
+	generation_stats& stats);
+
+// Streaming output: written as generated, flushed at the end. Stable writes reference
+// code, color and options strings (see web::segment_list for scatter-gather output).
+// On error, output may contain partial result.
+[[nodiscard]] std::optional<highlighter_error> run_highlighter(
+	std::string_view code,
+	std::string_view color,
+	web::output_sink& output,
 	const highlighter_options& options = {});
 
+// Executes a program compiled beforehand or built without color (see color_program.hpp).
+// Options that affect compilation (color options, valid classes, underscore replacement)
+// are not used. Errors refer to color stored in the program.
+std::variant<std::string, highlighter_error> run_highlighter(
+	std::string_view code,
+	const color_program& program,
+	const highlighter_options& options = {});
+
+/*
+ * Line-parallel mode: each color line mirrors one code line so batches of lines are
+ * highlighted independently and then concatenated. Output and errors (the first failing
+ * line) are the same as in the sequential mode. The calling thread highlights batches too,
+ * pool threads only help, so it is safe to call from a task of the same pool.
+ *
+ * Runs sequentially if the input is too small for at least 2 batches, if line counts
+ * of code and color differ or if options require sequential processing (span coalescing
+ * and class map - both depend on previous spans).
+ */
+constexpr std::size_t default_lines_per_batch = 256;
+
+std::variant<std::string, highlighter_error> run_highlighter(
+	std::string_view code,
+	std::string_view color,
+	const highlighter_options& options,
+	utility::thread_pool& pool,
+	std::size_t lines_per_batch = default_lines_per_batch);
+
+/*
+ * Same as run_highlighter but for repeated use: options are copied once (class list
+ * is parsed once) and memory is reused between runs, so steady-state runs do not allocate.
+ * Pointers in options (class map, program cache, class set) must outlive the highlighter.
+ * Errors may refer to owned options, valid until they are changed.
+ */
+class highlighter
+{
+public:
+	highlighter();
+	explicit highlighter(const highlighter_options& options);
+	~highlighter();
+
+	highlighter(highlighter&& other) noexcept;
+	highlighter& operator=(highlighter&& other) noexcept;
+
+	void set_options(const highlighter_options& options);
+	const highlighter_options& options() const noexcept;
+
+	// output is valid until the next run
+	[[nodiscard]] std::variant<std::string_view, highlighter_error>
+	run(std::string_view code, std::string_view color);
+
+	// see run_highlighter overload with output_sink
+	[[nodiscard]] std::optional<highlighter_error>
+	run(std::string_view code, std::string_view color, web::output_sink& output);
+
+	// see run_highlighter overload with color_program
+	[[nodiscard]] std::variant<std::string_view, highlighter_error>
+	run(std::string_view code, const color_program& program);
+
+	/*
+	 * Streaming: code and color are read line by line and output of each line is written
+	 * to the sink as it is generated, so memory use is bounded by the longest line.
+	 * Output is the same as for whole texts. Errors refer to the lines that were being
+	 * processed (valid until the next run), locations only differ if color has more lines
+	 * than code (error is reported on the first extra line, not at the end of the code).
+	 * Table wrap is not supported - it requires the number of lines upfront.
+	 * The program cache is not used (it would be flooded with single-line programs).
+	 * Reading errors end the input, check the sources afterwards.
+	 */
+	[[nodiscard]] std::optional<highlighter_error>
+	run(text::line_source& code, text::line_source& color, web::output_sink& output);
+
+	// output bytes saved by span coalescing during last run
+	std::size_t num_coalesced_bytes() const noexcept { return m_stats.coalesced_bytes; }
+
+	/*
+	 * Memory of a run is kept for next runs. The retention policy is applied to the last
+	 * run when it is no longer needed: at the start of the next run or by trim().
+	 */
+	void set_retention_policy(const utility::retention_policy& policy) noexcept { m_retention = policy; }
+	const utility::retention_policy& retention_policy() const noexcept { return m_retention; }
+	// heap memory kept for next runs
+	std::size_t retained_bytes() const noexcept;
+	// applies the retention policy now (once per run), output and errors of the last run
+	// are no longer valid
+	void trim();
+	// frees memory kept for next runs, output and errors of the last run are no longer valid
+	void release_memory();
+
+private:
+	// trims after the previous run
+	void begin_run();
+
+	[[nodiscard]] std::optional<highlighter_error>
+	run_internal(std::string_view code, std::string_view color);
+
+	struct owned_options;
+	// separate allocations: options contain views to owned strings and must not move
+	std::unique_ptr<owned_options> m_options;
+	std::unique_ptr<color_program> m_program; // allocation reuse when there is no program cache
+	web::html_builder m_builder;
+	generation_stats m_stats;
+	// streaming only: current lines
+	std::string m_code_line;
+	std::string m_color_line;
+	std::string m_hyphenated_classes;
+	utility::retention_policy m_retention;
+	utility::retention_tracker m_retention_tracker;
+	bool m_has_untrimmed_run = false;
+};
+
 std::ostream& operator<<(std::ostream& os, text::located_span ls);
 std::ostream& operator<<(std::ostream& os, const mirror::highlighter_error& error);
 
@@ -0,0 +1,219 @@
+#include <ach/mirror/document.hpp>
+#include <ach/mirror/line_split.hpp>
+#include <ach/text/scan.hpp>
+#include <ach/text/utils.hpp>
+
+#include <algorithm>
+#include <utility>
+
+namespace ach::mirror {
+namespace {
+
+// each line includes its line feed, the last one is what remains after the last line feed (possibly empty)
+template <typename Entry>
+void split_lines(std::string_view text, std::vector<Entry>& lines, std::size_t Entry::* offset, std::size_t Entry::* length)
+{
+	const char* const first = text.data();
+	const char* const last = text.data() + text.size();
+	std::size_t num_lines = 0;
+	for (const char* it = first; ; ++num_lines) {
+		const char* const line_feed = text::find_char(it, last, '\n');
+		const char* const line_last = line_feed == last ? last : line_feed + 1;
+
+		if (num_lines == lines.size())
+			lines.emplace_back();
+
+		lines[num_lines].*offset = static_cast<std::size_t>(it - first);
+		lines[num_lines].*length = static_cast<std::size_t>(line_last - it);
+
+		if (line_feed == last)
+			break;
+
+		it = line_last;
+	}
+
+	lines.resize(num_lines + 1);
+}
+
+}
+
+void document::set_options(const highlighter_options& options)
+{
+	highlighter_options line_options = options;
+	line_options.generation.table_wrap_css_class = {};
+	// lines are small and would flood the cache, the document is a cache itself
+	if (!options.generation.coalesce_spans && options.generation.class_map == nullptr)
+		line_options.generation.program_cache = nullptr;
+
+	m_highlighter.set_options(line_options);
+	m_table_wrap_css_class = options.generation.table_wrap_css_class;
+	clear();
+}
+
+void document::clear()
+{
+	m_code.clear();
+	m_color.clear();
+	m_lines.clear();
+	m_output.clear();
+	m_table_head_length = 0;
+	m_table_lines = 0;
+	m_num_highlighted_lines = 0;
+}
+
+std::variant<std::string_view, highlighter_error>
+document::update(std::string_view code, std::string_view color)
+{
+	const generation_options& options = m_highlighter.options().generation;
+
+	const bool lines_independent = !options.coalesce_spans
+		&& options.class_map == nullptr
+		&& std::count(code.begin(), code.end(), '\n') == std::count(color.begin(), color.end(), '\n');
+
+	std::optional<highlighter_error> maybe_error = lines_independent
+		? update_lines(code, color)
+		: update_whole(code, color);
+
+	if (maybe_error)
+		return *maybe_error;
+
+	return std::string_view(m_output);
+}
+
+std::optional<highlighter_error>
+document::update_lines(std::string_view code, std::string_view color)
+{
+	// both texts have the same number of line feeds
+	split_lines(code, m_new_lines, &line_entry::code_offset, &line_entry::code_length);
+	split_lines(color, m_new_lines, &line_entry::color_offset, &line_entry::color_length);
+
+	const auto new_code_line = [&](const line_entry& line) { return code.substr(line.code_offset, line.code_length); };
+	const auto new_color_line = [&](const line_entry& line) { return color.substr(line.color_offset, line.color_length); };
+	const auto is_same_line = [&](const line_entry& old_line, const line_entry& new_line) {
+		return code_line(old_line) == new_code_line(new_line) && color_line(old_line) == new_color_line(new_line);
+	};
+
+	// Typical edits touch one place: unchanged lines at the beginning and at the end are reused.
+	// If the number of lines did not change, unchanged lines in between are reused too.
+	const std::size_t num_old = m_lines.size();
+	const std::size_t num_new = m_new_lines.size();
+	const std::size_t num_common = std::min(num_old, num_new);
+
+	std::size_t num_prefix = 0;
+	while (num_prefix < num_common && is_same_line(m_lines[num_prefix], m_new_lines[num_prefix]))
+		++num_prefix;
+
+	std::size_t num_suffix = 0;
+	while (num_suffix < num_common - num_prefix
+		&& is_same_line(m_lines[num_old - 1 - num_suffix], m_new_lines[num_new - 1 - num_suffix]))
+	{
+		++num_suffix;
+	}
+
+	const bool same_num_lines = num_old == num_new;
+	const bool is_fresh = m_lines.empty();
+
+	std::size_t old_offset = m_table_head_length;
+	for (std::size_t i = 0; i < num_prefix; ++i)
+		old_offset += m_lines[i].output_length;
+
+	const std::size_t changed_offset = old_offset;
+	m_spliced_output.clear();
+	std::size_t num_highlighted = 0;
+
+	for (std::size_t i = num_prefix; i < num_new - num_suffix; ++i) {
+		line_entry& line = m_new_lines[i];
+
+		if (same_num_lines && is_same_line(m_lines[i], line)) {
+			line.output_length = m_lines[i].output_length;
+			m_spliced_output.append(m_output, old_offset, line.output_length);
+			old_offset += line.output_length;
+			continue;
+		}
+
+		if (same_num_lines)
+			old_offset += m_lines[i].output_length;
+
+		auto result = m_highlighter.run(new_code_line(line), new_color_line(line));
+		if (auto error = std::get_if<highlighter_error>(&result); error != nullptr) {
+			// locations are relative to the line
+			error->code_location = shift_lines(error->code_location, i);
+			error->color_location = shift_lines(error->color_location, i);
+			return *error;
+		}
+
+		const std::string_view line_output = std::get<std::string_view>(result);
+		line.output_length = line_output.size();
+		m_spliced_output += line_output;
+		++num_highlighted;
+	}
+
+	std::size_t changed_length = 0;
+	for (std::size_t i = num_prefix; i < num_old - num_suffix; ++i)
+		changed_length += m_lines[i].output_length;
+
+	for (std::size_t i = 0; i < num_prefix; ++i)
+		m_new_lines[i].output_length = m_lines[i].output_length;
+
+	for (std::size_t i = 0; i < num_suffix; ++i)
+		m_new_lines[num_new - 1 - i].output_length = m_lines[num_old - 1 - i].output_length;
+
+	// success: commit the new state
+	if (is_fresh) {
+		m_output.swap(m_spliced_output);
+		m_table_head_length = 0;
+		if (!m_table_wrap_css_class.empty()) {
+			m_table_builder.reset();
+			m_table_builder.close_table();
+			m_output += m_table_builder.str();
+		}
+	}
+	else {
+		m_output.replace(changed_offset, changed_length, m_spliced_output);
+	}
+
+	update_table(text::count_lines(code));
+	m_code.assign(code);
+	m_color.assign(color);
+	m_lines.swap(m_new_lines);
+	m_num_highlighted_lines = num_highlighted;
+	return std::nullopt;
+}
+
+std::optional<highlighter_error>
+document::update_whole(std::string_view code, std::string_view color)
+{
+	auto result = m_highlighter.run(code, color);
+	if (auto error = std::get_if<highlighter_error>(&result); error != nullptr)
+		return *error;
+
+	clear();
+	m_output = std::get<std::string_view>(result);
+	if (!m_table_wrap_css_class.empty()) {
+		m_table_builder.reset();
+		m_table_builder.close_table();
+		m_output += m_table_builder.str();
+	}
+
+	update_table(text::count_lines(code));
+	m_num_highlighted_lines = text::count_lines(code);
+	return std::nullopt;
+}
+
+// output must already contain the table tail (if any)
+void document::update_table(std::size_t num_lines)
+{
+	if (m_table_wrap_css_class.empty())
+		return;
+
+	if (m_table_head_length != 0 && m_table_lines == num_lines)
+		return;
+
+	m_table_builder.reset();
+	m_table_builder.open_table(num_lines, m_table_wrap_css_class);
+	m_output.replace(0, m_table_head_length, m_table_builder.str());
+	m_table_head_length = m_table_builder.str().size();
+	m_table_lines = num_lines;
+}
+
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <ach/mirror/core.hpp>
+
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <variant>
+#include <vector>
+
+namespace ach::mirror {
+
+/*
+ * Incremental highlighting for live editing. The document keeps the last highlighted
+ * code, color and output per line. On update, lines of code and color are compared
+ * with the previous ones and only lines where either differs are highlighted again,
+ * then spliced into the cached output. Output and errors are the same as run_highlighter.
+ *
+ * Lines are independent in the mirror format (no token spans a line feed), the only
+ * shared state is the table wrapper which depends on the number of lines. Whole texts
+ * are highlighted again if line counts of code and color differ or if options require
+ * sequential processing (span coalescing and class map - both depend on previous spans).
+ *
+ * After an error the document keeps the last successful state.
+ */
+class document
+{
+public:
+	document() = default;
+	explicit document(const highlighter_options& options) { set_options(options); }
+
+	// options are copied, invalidates all lines
+	void set_options(const highlighter_options& options);
+
+	// output is valid until the next update, errors refer to given code and color
+	[[nodiscard]] std::variant<std::string_view, highlighter_error>
+	update(std::string_view code, std::string_view color);
+
+	std::string_view output() const noexcept { return m_output; }
+	// 0 if the last update had to highlight whole texts
+	std::size_t num_cached_lines() const noexcept { return m_lines.size(); }
+	// lines highlighted during the last successful update (others were reused)
+	std::size_t num_highlighted_lines() const noexcept { return m_num_highlighted_lines; }
+
+	void clear();
+
+private:
+	struct line_entry
+	{
+		std::size_t code_offset = 0;
+		std::size_t code_length = 0;
+		std::size_t color_offset = 0;
+		std::size_t color_length = 0;
+		std::size_t output_length = 0;
+	};
+
+	std::string_view code_line(const line_entry& line) const noexcept
+	{
+		return std::string_view(m_code).substr(line.code_offset, line.code_length);
+	}
+
+	std::string_view color_line(const line_entry& line) const noexcept
+	{
+		return std::string_view(m_color).substr(line.color_offset, line.color_length);
+	}
+
+	[[nodiscard]] std::optional<highlighter_error>
+	update_lines(std::string_view code, std::string_view color);
+	[[nodiscard]] std::optional<highlighter_error>
+	update_whole(std::string_view code, std::string_view color);
+	void update_table(std::size_t num_lines);
+
+	highlighter m_highlighter; // without table wrap, lines are wrapped here
+	std::string m_table_wrap_css_class;
+
+	// last successful state
+	std::string m_code;
+	std::string m_color;
+	std::vector<line_entry> m_lines; // empty if the whole text was highlighted at once
+	std::string m_output; // table head + lines + table tail
+	std::size_t m_table_head_length = 0;
+	std::size_t m_table_lines = 0;
+	std::size_t m_num_highlighted_lines = 0;
+
+	// scratch, reused between updates
+	std::vector<line_entry> m_new_lines;
+	std::string m_spliced_output;
+	web::html_builder m_table_builder;
+};
+
+}
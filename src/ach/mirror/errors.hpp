@@ -17,4 +17,10 @@ namespace ach::mirror::errors {
 	constexpr auto expected_span_class = "expected span class name";
 	constexpr auto invalid_css_class = "invalid CSS class";
 
+	// errors against options
+	constexpr auto streaming_table_wrap = "table wrap is not supported when streaming (requires the number of lines upfront)";
+
+	// run interrupted (see generation_options::cancellation)
+	constexpr auto cancelled = "highlighting cancelled or past its deadline";
+
 }
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <ach/text/types.hpp>
+
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+/*
+ * Splitting code and color into parts that can be highlighted independently (in
+ * parallel or line by line) - shared by line-parallel runs, batches and documents.
+ */
+namespace ach::mirror {
+
+// part of split code and color, lines are counted from the beginning of the texts
+struct line_split_part
+{
+	std::string_view code;
+	std::string_view color;
+	std::size_t first_line;
+};
+
+inline std::size_t next_line_start(std::string_view text, std::size_t pos) noexcept
+{
+	const std::size_t line_feed = text.find('\n', pos);
+	return line_feed == std::string_view::npos ? text.size() : line_feed + 1;
+}
+
+// Split both texts at the first line feed after max_lines lines or after max_code_bytes
+// bytes of code, whichever comes first. Texts must have the same number of line feeds.
+inline std::vector<line_split_part> split_into_parts(
+	std::string_view code,
+	std::string_view color,
+	std::size_t max_lines,
+	std::size_t max_code_bytes = static_cast<std::size_t>(-1))
+{
+	std::vector<line_split_part> result;
+	std::size_t line = 0;
+	while (!code.empty() || !color.empty()) {
+		std::size_t code_length = 0;
+		std::size_t color_length = 0;
+		std::size_t num_lines = 0;
+		for (; num_lines < max_lines && code_length < max_code_bytes && code_length < code.size(); ++num_lines) {
+			code_length = next_line_start(code, code_length);
+			color_length = next_line_start(color, color_length);
+		}
+
+		// last part takes remaining text (in case of no line feed at the end)
+		if (code_length == code.size() || color_length == color.size()) {
+			code_length = code.size();
+			color_length = color.size();
+		}
+
+		result.push_back(line_split_part{code.substr(0, code_length), color.substr(0, color_length), line});
+		code.remove_prefix(code_length);
+		color.remove_prefix(color_length);
+		line += num_lines;
+	}
+
+	return result;
+}
+
+// locations of a part are relative to its first line
+inline text::located_span shift_lines(text::located_span location, std::size_t num_lines)
+{
+	text::span s = location.span();
+	s.line += num_lines;
+	return text::located_span(location.whole_line(), s);
+}
+
+}
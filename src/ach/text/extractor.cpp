@@ -1,7 +1,7 @@
 #include <ach/text/extractor.hpp>
 #include <ach/text/utils.hpp>
+#include <ach/text/scan.hpp>
 
-#include <algorithm>
 #include <cassert>
 
 namespace ach::text {
@@ -11,7 +11,7 @@ bool extractor::load_next_line()
 	const auto first = _remaining_text.data();
 	const auto last = _remaining_text.data() + _remaining_text.size();
 
-	auto it = std::find(first, last, '\n');
+	auto it = find_char(first, last, '\n');
 
 	if (it != last) { // we want to include '\n' in the line if possible
 		++it;
@@ -30,14 +30,13 @@ bool extractor::load_next_line()
 	return true;
 }
 
-template <typename Predicate>
-located_span extractor::extract_by(Predicate pred)
+located_span extractor::extract_by(unsigned char classes)
 {
 	const auto text = remaining_line_str();
 	const auto first = text.data();
 	const auto last = text.data() + text.size();
 
-	const auto it = std::find_if_not(first, last, pred);
+	const auto it = find_first_not_of_class(first, last, classes);
 	const auto length = it - first;
 
 	return consume_n_characters(length);
@@ -45,7 +44,7 @@ located_span extractor::extract_by(Predicate pred)
 
 located_span extractor::extract_non_newline_whitespace()
 {
-	return extract_by(is_non_newline_whitespace);
+	return extract_by(char_class::non_newline_whitespace);
 }
 
 located_span extractor::extract_identifier()
@@ -54,17 +53,17 @@ located_span extractor::extract_identifier()
 	if (!c || is_digit(*c))
 		return no_match();
 
-	return extract_by(is_alnum_or_underscore);
+	return extract_by(char_class::alnum | char_class::underscore);
 }
 
 located_span extractor::extract_alphas_underscores()
 {
-	return extract_by(is_alpha_or_underscore);
+	return extract_by(char_class::alpha | char_class::underscore);
 }
 
 located_span extractor::extract_digits()
 {
-	return extract_by(is_digit);
+	return extract_by(char_class::digit);
 }
 
 located_span extractor::extract_n_characters(std::size_t n)
@@ -78,7 +77,10 @@ located_span extractor::extract_n_characters(std::size_t n)
 
 located_span extractor::extract_until_end_of_line()
 {
-	return extract_by([](char c) { return c != '\n'; });
+	const auto text = remaining_line_str();
+	const auto first = text.data();
+	const auto last = text.data() + text.size();
+	return consume_n_characters(find_char(first, last, '\n') - first);
 }
 
 located_span extractor::extract_quoted(char quote, char escape)
@@ -93,35 +95,22 @@ located_span extractor::extract_quoted(char quote, char escape)
 		return text;
 	}();
 
-	const auto first = remaining.begin();
-	const auto last  = remaining.end();
-
-	bool inside_escape = false;
-	bool closing_quote_found = false;
-	auto it = first;
-	for (; it != last; ++it) {
-		if (inside_escape) {
-			inside_escape = false;
-			continue; // we don't really care what is being escaped
-		}
-
-		if (*it == escape) {
-			inside_escape = true;
-			continue;
-		}
-
-		if (*it == quote) {
-			++it;
-			closing_quote_found = true;
-			break;
-		}
+	const auto first = remaining.data();
+	const auto last  = remaining.data() + remaining.size();
+
+	// jump between quotes and escapes, we don't really care what is being escaped
+	auto it = find_either(first, last, quote, escape);
+	while (it != last && *it == escape) {
+		if (last - it < 2) // remaining text finished before escape was fullfilled - this is an error
+			return no_match();
+
+		it = find_either(it + 2, last, quote, escape);
 	}
 
-	if (inside_escape) // remaining text finished before escape was fullfilled - this is an error
+	if (it == last) // closing quote not found
 		return no_match();
 
-	if (!closing_quote_found)
-		return no_match();
+	++it;
 
 	const auto length = 1 + (it - first); // 1 is the starting quote, rest is the loop
 	return consume_n_characters(length);
@@ -73,9 +73,8 @@ private:
 		return result;
 	}
 
-	// implemented and instantiated only in source
-	template <typename Predicate>
-	located_span extract_by(Predicate pred);
+	// extract characters that have any of the classes (see text::char_class)
+	located_span extract_by(unsigned char classes);
 
 	std::string_view _remaining_text;
 	std::string_view _current_line;
@@ -0,0 +1,92 @@
+#include <ach/text/line_source.hpp>
+#include <ach/text/scan.hpp>
+
+#include <cassert>
+#include <cerrno>
+#include <istream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace ach::text {
+
+bool istream_line_source::read_line(std::string& line)
+{
+	if (!std::getline(m_is, line)) {
+		line.clear();
+		return false;
+	}
+
+	// end of input reached before line feed: the last line has no line feed
+	if (!m_is.eof())
+		line += '\n';
+
+	return true;
+}
+
+fd_line_source::fd_line_source(int fd, std::size_t buffer_size)
+: m_fd(fd)
+, m_buffer(std::make_unique<char[]>(buffer_size))
+, m_buffer_size(buffer_size)
+{
+	assert(buffer_size > 0);
+}
+
+bool fd_line_source::read_line(std::string& line)
+{
+	line.clear();
+
+	while (true) {
+		const char* const first = m_buffer.get() + m_first;
+		const char* const last = m_buffer.get() + m_last;
+		const char* const line_feed = find_char(first, last, '\n');
+
+		if (line_feed != last) {
+			line.append(first, line_feed + 1);
+			m_first += static_cast<std::size_t>(line_feed + 1 - first);
+			return true;
+		}
+
+		// line continues in the next part of input
+		line.append(first, last);
+		m_first = m_last;
+
+		if (!refill())
+			return !line.empty();
+	}
+}
+
+bool fd_line_source::refill()
+{
+	m_first = 0;
+	m_last = 0;
+
+	while (!m_reached_end && !m_error) {
+#ifdef _WIN32
+		const auto result = ::_read(m_fd, m_buffer.get(), static_cast<unsigned>(m_buffer_size));
+#else
+		const auto result = ::read(m_fd, m_buffer.get(), m_buffer_size);
+#endif
+		if (result < 0) {
+			if (errno != EINTR)
+				m_error = std::error_code(errno, std::generic_category());
+
+			continue;
+		}
+
+		if (result == 0) {
+			m_reached_end = true;
+			break;
+		}
+
+		m_last = static_cast<std::size_t>(result);
+		return true;
+	}
+
+	return false;
+}
+
+}
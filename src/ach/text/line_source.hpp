@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstddef>
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <system_error>
+
+namespace ach::text {
+
+/*
+ * Source of input read line by line, counterpart of web::output_sink.
+ * Allows to process input larger than memory - only the current line is kept.
+ */
+class line_source
+{
+public:
+	virtual ~line_source() = default;
+
+	// replaces line with the next line, including its line feed (if present)
+	// returns false (and leaves line empty) if there are no more lines
+	[[nodiscard]] virtual bool read_line(std::string& line) = 0;
+};
+
+class istream_line_source final : public line_source
+{
+public:
+	explicit istream_line_source(std::istream& is)
+	: m_is(is) {}
+
+	[[nodiscard]] bool read_line(std::string& line) override;
+
+private:
+	std::istream& m_is;
+};
+
+// reads from a file descriptor, reading stops after first error
+class fd_line_source final : public line_source
+{
+public:
+	static constexpr std::size_t default_buffer_size = 64 * 1024;
+
+	explicit fd_line_source(int fd, std::size_t buffer_size = default_buffer_size);
+
+	[[nodiscard]] bool read_line(std::string& line) override;
+
+	// first error that occured when reading, if any
+	std::error_code error() const noexcept { return m_error; }
+
+private:
+	bool refill();
+
+	int m_fd;
+	std::unique_ptr<char[]> m_buffer;
+	std::size_t m_buffer_size;
+	std::size_t m_first = 0;
+	std::size_t m_last = 0;
+	std::error_code m_error;
+	bool m_reached_end = false;
+};
+
+}
@@ -0,0 +1,189 @@
+#include <ach/text/scan.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+#if (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)) && !defined(ACH_DISABLE_SIMD)
+#define ACH_SCAN_SSE2
+#include <emmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+namespace ach::text {
+
+namespace scalar {
+
+	const char* find_char(const char* first, const char* last, char c) noexcept
+	{
+		return std::find(first, last, c);
+	}
+
+	const char* find_either(const char* first, const char* last, char c1, char c2) noexcept
+	{
+		return std::find_if(first, last, [=](char c) { return c == c1 || c == c2; });
+	}
+
+	const char* find_first_not_of_class(const char* first, const char* last, unsigned char classes) noexcept
+	{
+		return std::find_if_not(first, last, [=](char c) { return has_char_class(c, classes); });
+	}
+
+}
+
+// memchr is already vectorized by every relevant C library
+const char* find_char(const char* first, const char* last, char c) noexcept
+{
+	if (first == last)
+		return last;
+
+	const void* const result = std::memchr(first, static_cast<unsigned char>(c), static_cast<std::size_t>(last - first));
+	return result ? static_cast<const char*>(result) : last;
+}
+
+#ifdef ACH_SCAN_SSE2
+
+namespace {
+
+constexpr std::ptrdiff_t block_size = 16;
+
+inline int lowest_bit_index(unsigned mask) noexcept
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return static_cast<int>(index);
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+inline __m128i load(const char* ptr) noexcept
+{
+	return _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr));
+}
+
+/*
+ * Byte range [Low, High] tested with one add and one signed compare:
+ * x - Low (mod 256) <= High - Low, shifted by 0x80 because SSE2 has no unsigned compare.
+ * Correct for all byte values, including >= 0x80.
+ */
+template <char Low, char High>
+inline __m128i in_range(__m128i chunk) noexcept
+{
+	constexpr int low = static_cast<unsigned char>(Low);
+	constexpr int high = static_cast<unsigned char>(High);
+	const __m128i bias = _mm_set1_epi8(static_cast<char>(0x80 - low));
+	const __m128i limit = _mm_set1_epi8(static_cast<char>(-128 + (high - low + 1)));
+	return _mm_cmplt_epi8(_mm_add_epi8(chunk, bias), limit);
+}
+
+// classes are a template parameter so that all ranges are constants
+template <unsigned char Classes>
+inline __m128i class_matches(__m128i chunk) noexcept
+{
+	__m128i result = _mm_setzero_si128();
+
+	if constexpr ((Classes & char_class::digit) != 0)
+		result = _mm_or_si128(result, in_range<'0', '9'>(chunk));
+	if constexpr ((Classes & char_class::lower) != 0)
+		result = _mm_or_si128(result, in_range<'a', 'z'>(chunk));
+	if constexpr ((Classes & char_class::upper) != 0)
+		result = _mm_or_si128(result, in_range<'A', 'Z'>(chunk));
+	if constexpr ((Classes & char_class::underscore) != 0)
+		result = _mm_or_si128(result, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('_')));
+	if constexpr ((Classes & char_class::non_newline_whitespace) != 0) {
+		result = _mm_or_si128(result, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(' ')));
+		result = _mm_or_si128(result, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\t')));
+		result = _mm_or_si128(result, in_range<'\v', '\r'>(chunk));
+	}
+	if constexpr ((Classes & char_class::newline) != 0)
+		result = _mm_or_si128(result, _mm_cmpeq_epi8(chunk, _mm_set1_epi8('\n')));
+	if constexpr ((Classes & char_class::hex_letter) != 0 && (Classes & char_class::lower) == 0)
+		result = _mm_or_si128(result, in_range<'a', 'f'>(chunk));
+	if constexpr ((Classes & char_class::hex_letter) != 0 && (Classes & char_class::upper) == 0)
+		result = _mm_or_si128(result, in_range<'A', 'F'>(chunk));
+
+	return result;
+}
+
+template <unsigned char Classes>
+const char* find_first_not_of_class_sse2(const char* first, const char* last) noexcept
+{
+	for (; last - first >= block_size; first += block_size) {
+		const unsigned mask = ~static_cast<unsigned>(_mm_movemask_epi8(class_matches<Classes>(load(first)))) & 0xFFFFu;
+
+		if (mask != 0)
+			return first + lowest_bit_index(mask);
+	}
+
+	return scalar::find_first_not_of_class(first, last, Classes);
+}
+
+}
+
+const char* find_either(const char* first, const char* last, char c1, char c2) noexcept
+{
+	// quoted strings are usually short too
+	for (int i = 0; i < block_size; ++i, ++first) {
+		if (first == last || *first == c1 || *first == c2)
+			return first;
+	}
+
+	const __m128i v1 = _mm_set1_epi8(c1);
+	const __m128i v2 = _mm_set1_epi8(c2);
+
+	for (; last - first >= block_size; first += block_size) {
+		const __m128i chunk = load(first);
+		const __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(chunk, v1), _mm_cmpeq_epi8(chunk, v2));
+		const unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(eq));
+
+		if (mask != 0)
+			return first + lowest_bit_index(mask);
+	}
+
+	return scalar::find_either(first, last, c1, c2);
+}
+
+const char* find_first_not_of_class(const char* first, const char* last, unsigned char classes) noexcept
+{
+	// most extracted tokens are short - do not bother with vectors for them
+	for (int i = 0; i < block_size; ++i, ++first) {
+		if (first == last || !has_char_class(*first, classes))
+			return first;
+	}
+
+	// classes used by text::extractor
+	constexpr unsigned char identifier = char_class::alnum | char_class::underscore;
+	constexpr unsigned char alpha_underscore = char_class::alpha | char_class::underscore;
+
+	switch (classes) {
+		case identifier:
+			return find_first_not_of_class_sse2<identifier>(first, last);
+		case alpha_underscore:
+			return find_first_not_of_class_sse2<alpha_underscore>(first, last);
+		case char_class::digit:
+			return find_first_not_of_class_sse2<char_class::digit>(first, last);
+		case char_class::non_newline_whitespace:
+			return find_first_not_of_class_sse2<char_class::non_newline_whitespace>(first, last);
+		default:
+			return scalar::find_first_not_of_class(first, last, classes);
+	}
+}
+
+#else
+
+const char* find_either(const char* first, const char* last, char c1, char c2) noexcept
+{
+	return scalar::find_either(first, last, c1, c2);
+}
+
+const char* find_first_not_of_class(const char* first, const char* last, unsigned char classes) noexcept
+{
+	return scalar::find_first_not_of_class(first, last, classes);
+}
+
+#endif
+
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <ach/text/utils.hpp>
+
+namespace ach::text {
+
+/*
+ * Scanning primitives used by text::extractor. All functions work on [first, last)
+ * and return last if nothing has been found. SSE2 implementations process 16 bytes
+ * at once; define ACH_DISABLE_SIMD (CMake option ACH_ENABLE_SIMD) to use only the
+ * scalar ones.
+ */
+
+// first occurence of c
+const char* find_char(const char* first, const char* last, char c) noexcept;
+
+// first occurence of c1 or c2
+const char* find_either(const char* first, const char* last, char c1, char c2) noexcept;
+
+// first character that has none of the classes (see char_class)
+const char* find_first_not_of_class(const char* first, const char* last, unsigned char classes) noexcept;
+
+// reference implementations, exposed for tests and benchmarks
+namespace scalar {
+
+	const char* find_char(const char* first, const char* last, char c) noexcept;
+	const char* find_either(const char* first, const char* last, char c1, char c2) noexcept;
+	const char* find_first_not_of_class(const char* first, const char* last, unsigned char classes) noexcept;
+
+}
+
+}
@@ -1,18 +1,76 @@
 #pragma once
 
+#include <array>
 #include <string_view>
 #include <ostream>
 
 namespace ach::text {
 
+// character classes, can be combined
+namespace char_class {
+
+	constexpr unsigned char digit = 1 << 0;
+	constexpr unsigned char lower = 1 << 1;
+	constexpr unsigned char upper = 1 << 2;
+	constexpr unsigned char underscore = 1 << 3;
+	constexpr unsigned char non_newline_whitespace = 1 << 4;
+	constexpr unsigned char newline = 1 << 5;
+	constexpr unsigned char hex_letter = 1 << 6;
+
+	constexpr unsigned char alpha = lower | upper;
+	constexpr unsigned char alnum = alpha | digit;
+	constexpr unsigned char whitespace = non_newline_whitespace | newline;
+
+}
+
+namespace detail {
+
+	constexpr std::array<unsigned char, 256> make_char_class_table() noexcept
+	{
+		std::array<unsigned char, 256> result{};
+
+		for (int c = '0'; c <= '9'; ++c)
+			result[c] |= char_class::digit;
+
+		for (int c = 'a'; c <= 'z'; ++c)
+			result[c] |= char_class::lower;
+
+		for (int c = 'A'; c <= 'Z'; ++c)
+			result[c] |= char_class::upper;
+
+		for (int c = 'a'; c <= 'f'; ++c)
+			result[c] |= char_class::hex_letter;
+
+		for (int c = 'A'; c <= 'F'; ++c)
+			result[c] |= char_class::hex_letter;
+
+		result['_'] |= char_class::underscore;
+		result['\n'] |= char_class::newline;
+
+		for (char c : {' ', '\t', '\r', '\f', '\v'})
+			result[static_cast<unsigned char>(c)] |= char_class::non_newline_whitespace;
+
+		return result;
+	}
+
+}
+
+// one lookup instead of chained comparisons
+inline constexpr std::array<unsigned char, 256> char_class_table = detail::make_char_class_table();
+
+constexpr bool has_char_class(char c, unsigned char classes) noexcept
+{
+	return (char_class_table[static_cast<unsigned char>(c)] & classes) != 0;
+}
+
 constexpr bool is_non_newline_whitespace(char c) noexcept
 {
-	return c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v';
+	return has_char_class(c, char_class::non_newline_whitespace);
 }
 
 constexpr bool is_whitespace(char c) noexcept
 {
-	return c == '\n' || is_non_newline_whitespace(c);
+	return has_char_class(c, char_class::whitespace);
 }
 
 constexpr bool is_digit_binary(char c) noexcept
@@ -32,27 +90,27 @@ constexpr bool is_digit_octal(char c) noexcept
 
 constexpr bool is_digit_hex(char c) noexcept
 {
-	return is_digit(c) || ('a' <= c && c <= 'f') || ('A' <= c && c <= 'F');
+	return has_char_class(c, char_class::digit | char_class::hex_letter);
 }
 
 constexpr bool is_alpha(char c) noexcept
 {
-	return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z');
+	return has_char_class(c, char_class::alpha);
 }
 
 constexpr bool is_alnum(char c) noexcept
 {
-	return is_alpha(c) || is_digit(c);
+	return has_char_class(c, char_class::alnum);
 }
 
 constexpr bool is_alpha_or_underscore(char c) noexcept
 {
-	return is_alpha(c) || c == '_';
+	return has_char_class(c, char_class::alpha | char_class::underscore);
 }
 
 constexpr bool is_alnum_or_underscore(char c) noexcept
 {
-	return is_alnum(c) || c == '_';
+	return has_char_class(c, char_class::alnum | char_class::underscore);
 }
 
 // https://en.cppreference.com/w/cpp/language/charset#Basic_character_set
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory_resource>
+
+namespace ach::utility {
+
+/*
+ * Monotonic memory resource with an inline first block: allocations never free memory
+ * individually, everything is freed at once by release() or the destructor. Allocations
+ * that fit into the inline block do not touch the upstream resource, so an arena on the
+ * stack serves small runs without any heap allocation.
+ *
+ * Objects allocated from the arena must not be used after release or destruction.
+ */
+template <std::size_t InlineSize = 16 * 1024>
+class arena
+{
+public:
+	static_assert(InlineSize > 0);
+
+	explicit arena(std::pmr::memory_resource* upstream = std::pmr::get_default_resource())
+	: m_resource(m_buffer.data(), m_buffer.size(), upstream)
+	{}
+
+	arena(const arena&) = delete;
+	arena& operator=(const arena&) = delete;
+
+	std::pmr::memory_resource* resource() noexcept { return &m_resource; }
+
+	// next allocations start again from the inline block
+	void release() { m_resource.release(); }
+
+	static constexpr std::size_t inline_size() noexcept { return InlineSize; }
+
+private:
+	alignas(std::max_align_t) std::array<std::byte, InlineSize> m_buffer;
+	std::pmr::monotonic_buffer_resource m_resource; // after the buffer: initialized with it
+};
+
+}
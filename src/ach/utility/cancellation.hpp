@@ -0,0 +1,73 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <optional>
+
+namespace ach::utility {
+
+// set from any thread, observed by runs that refer to it
+class cancellation_token
+{
+public:
+	cancellation_token() = default;
+
+	cancellation_token(const cancellation_token&) = delete;
+	cancellation_token& operator=(const cancellation_token&) = delete;
+
+	void cancel() noexcept { m_cancelled.store(true, std::memory_order_relaxed); }
+	void reset() noexcept { m_cancelled.store(false, std::memory_order_relaxed); }
+	bool is_cancelled() const noexcept { return m_cancelled.load(std::memory_order_relaxed); }
+
+private:
+	std::atomic<bool> m_cancelled = false;
+};
+
+/*
+ * Cooperative interruption of a long run: loops check the token and the deadline
+ * every check_interval iterations (tokens, instructions) and stop with a cancellation
+ * error. Nothing is checked if neither is set.
+ */
+struct cancellation
+{
+	const cancellation_token* token = nullptr; // must outlive runs
+	std::optional<std::chrono::steady_clock::time_point> deadline = std::nullopt;
+	std::size_t check_interval = 1024;
+
+	bool is_enabled() const noexcept { return token != nullptr || deadline.has_value(); }
+
+	bool should_stop() const noexcept
+	{
+		if (token != nullptr && token->is_cancelled())
+			return true;
+
+		return deadline && std::chrono::steady_clock::now() >= *deadline;
+	}
+};
+
+// counts iterations of one loop, checks on every n-th one
+class cancellation_checker
+{
+public:
+	explicit cancellation_checker(const cancellation& c) noexcept
+	: m_cancellation(c)
+	, m_countdown(1)
+	{}
+
+	// first call checks immediately (a run can be cancelled before it starts)
+	bool operator()() noexcept
+	{
+		if (!m_cancellation.is_enabled() || --m_countdown != 0)
+			return false;
+
+		m_countdown = m_cancellation.check_interval != 0 ? m_cancellation.check_interval : 1;
+		return m_cancellation.should_stop();
+	}
+
+private:
+	const cancellation& m_cancellation;
+	std::size_t m_countdown;
+};
+
+}
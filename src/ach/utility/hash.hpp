@@ -0,0 +1,36 @@
+#pragma once
+
+#include <cstdint>
+#include <string_view>
+
+namespace ach::utility {
+
+// FNV-1a, 64-bit: fast, good enough for cache keys (not for untrusted adversarial input)
+class fnv1a_hasher
+{
+public:
+	constexpr void update(std::string_view data) noexcept
+	{
+		for (char c : data) {
+			m_state ^= static_cast<unsigned char>(c);
+			m_state *= prime;
+		}
+	}
+
+	constexpr std::uint64_t digest() const noexcept { return m_state; }
+
+private:
+	static constexpr std::uint64_t offset_basis = 14695981039346656037ull;
+	static constexpr std::uint64_t prime = 1099511628211ull;
+
+	std::uint64_t m_state = offset_basis;
+};
+
+constexpr std::uint64_t fnv1a(std::string_view data) noexcept
+{
+	fnv1a_hasher hasher;
+	hasher.update(data);
+	return hasher.digest();
+}
+
+}
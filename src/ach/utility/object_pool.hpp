@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <memory>
+#include <thread>
+
+namespace ach::utility {
+
+/*
+ * Lock-free pool of reusable objects (typically scratch memory). Acquire takes any
+ * pooled object or creates a new one, release puts it back or destroys it if all slots
+ * are taken. Objects are not reset - reusing their memory is the point.
+ *
+ * Each slot is one atomic pointer, acquire and release are a scan with exchanges so there
+ * is no ABA problem and no allocation once the pool is warm.
+ */
+template <typename T>
+class object_pool
+{
+public:
+	// 0 means std::thread::hardware_concurrency() (at least 1)
+	explicit object_pool(std::size_t capacity = 0)
+	: m_capacity(capacity != 0 ? capacity : std::max(1u, std::thread::hardware_concurrency()))
+	, m_slots(std::make_unique<std::atomic<T*>[]>(m_capacity))
+	{
+		for (std::size_t i = 0; i < m_capacity; ++i)
+			m_slots[i].store(nullptr, std::memory_order_relaxed);
+	}
+
+	~object_pool()
+	{
+		for (std::size_t i = 0; i < m_capacity; ++i)
+			delete m_slots[i].load(std::memory_order_relaxed);
+	}
+
+	object_pool(const object_pool&) = delete;
+	object_pool& operator=(const object_pool&) = delete;
+
+	std::unique_ptr<T> acquire()
+	{
+		for (std::size_t i = 0; i < m_capacity; ++i) {
+			// cheap check first: empty slots are not written
+			if (m_slots[i].load(std::memory_order_relaxed) == nullptr)
+				continue;
+
+			if (T* const object = m_slots[i].exchange(nullptr, std::memory_order_acquire); object != nullptr)
+				return std::unique_ptr<T>(object);
+		}
+
+		return std::make_unique<T>();
+	}
+
+	void release(std::unique_ptr<T> object) noexcept
+	{
+		for (std::size_t i = 0; i < m_capacity; ++i) {
+			T* expected = nullptr;
+			if (m_slots[i].compare_exchange_strong(expected, object.get(), std::memory_order_release, std::memory_order_relaxed)) {
+				(void) object.release();
+				return;
+			}
+		}
+	}
+
+	// returns the object to the pool when destroyed
+	class lease
+	{
+	public:
+		explicit lease(object_pool& pool)
+		: m_pool(pool), m_object(pool.acquire()) {}
+
+		~lease() { m_pool.release(std::move(m_object)); }
+
+		lease(const lease&) = delete;
+		lease& operator=(const lease&) = delete;
+
+		T& operator*() const noexcept { return *m_object; }
+		T* operator->() const noexcept { return m_object.get(); }
+
+	private:
+		object_pool& m_pool;
+		std::unique_ptr<T> m_object;
+	};
+
+	std::size_t capacity() const noexcept { return m_capacity; }
+
+	// objects currently in the pool (not in use), for tests and diagnostics
+	std::size_t size() const noexcept
+	{
+		std::size_t result = 0;
+		for (std::size_t i = 0; i < m_capacity; ++i)
+			if (m_slots[i].load(std::memory_order_relaxed) != nullptr)
+				++result;
+
+		return result;
+	}
+
+private:
+	std::size_t m_capacity;
+	std::unique_ptr<std::atomic<T*>[]> m_slots;
+};
+
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace ach::utility {
+
+/*
+ * When reused scratch memory is given back. Without a policy, buffers keep the capacity
+ * of the largest run they have seen. Released memory is allocated again by next runs,
+ * only as much as they need.
+ */
+struct retention_policy
+{
+	// memory is released after a run that leaves more than this retained (0: no limit)
+	std::size_t max_retained_bytes = 0;
+	// memory is released after this many consecutive runs that used at most
+	// 1 / small_run_ratio of the retained memory (0: never)
+	std::size_t decay_after_runs = 0;
+	std::size_t small_run_ratio = 4;
+};
+
+// decides after each run of one owner of buffers whether to release them
+class retention_tracker
+{
+public:
+	// used: memory the run needed, retained: memory buffers keep
+	[[nodiscard]] bool should_release(const retention_policy& policy, std::size_t used, std::size_t retained) noexcept
+	{
+		if (policy.max_retained_bytes != 0 && retained > policy.max_retained_bytes) {
+			m_num_small_runs = 0;
+			return true;
+		}
+
+		if (policy.decay_after_runs == 0 || retained == 0)
+			return false;
+
+		const std::size_t ratio = policy.small_run_ratio != 0 ? policy.small_run_ratio : 1;
+		if (used > retained / ratio) {
+			m_num_small_runs = 0;
+			return false;
+		}
+
+		if (++m_num_small_runs < policy.decay_after_runs)
+			return false;
+
+		m_num_small_runs = 0;
+		return true;
+	}
+
+private:
+	std::size_t m_num_small_runs = 0;
+};
+
+// heap memory held by a buffer (strings: only beyond the small string buffer)
+
+template <typename T, typename Allocator>
+std::size_t heap_bytes(const std::vector<T, Allocator>& v) noexcept
+{
+	return v.capacity() * sizeof(T);
+}
+
+template <typename Char, typename Traits, typename Allocator>
+std::size_t heap_bytes(const std::basic_string<Char, Traits, Allocator>& str) noexcept
+{
+	const std::size_t local_capacity = std::basic_string<Char, Traits, Allocator>().capacity();
+	return str.capacity() > local_capacity ? (str.capacity() + 1) * sizeof(Char) : 0;
+}
+
+// frees the memory of a buffer (works with any allocator, unlike swapping with an empty one)
+template <typename Buffer>
+void release_memory(Buffer& buffer)
+{
+	buffer.clear();
+	buffer.shrink_to_fit();
+}
+
+}
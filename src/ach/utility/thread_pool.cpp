@@ -0,0 +1,61 @@
+#include <ach/utility/thread_pool.hpp>
+
+#include <algorithm>
+#include <utility>
+
+namespace ach::utility {
+
+thread_pool::thread_pool(std::size_t num_threads)
+{
+	if (num_threads == 0)
+		num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+	m_threads.reserve(num_threads);
+	for (std::size_t i = 0; i < num_threads; ++i)
+		m_threads.emplace_back([this]() { worker_loop(); });
+}
+
+thread_pool::~thread_pool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopping = true;
+	}
+
+	m_condition.notify_all();
+
+	for (std::thread& thread : m_threads)
+		thread.join();
+}
+
+void thread_pool::push(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_tasks.push_back(std::move(task));
+	}
+
+	m_condition.notify_one();
+}
+
+void thread_pool::worker_loop()
+{
+	while (true) {
+		std::function<void()> task;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_condition.wait(lock, [this]() { return m_stopping || !m_tasks.empty(); });
+
+			if (m_tasks.empty())
+				return; // stopping and nothing left to do
+
+			task = std::move(m_tasks.front());
+			m_tasks.pop_front();
+		}
+
+		task();
+	}
+}
+
+}
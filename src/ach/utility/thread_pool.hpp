@@ -0,0 +1,52 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+namespace ach::utility {
+
+// fixed number of threads executing tasks in submission order
+class thread_pool
+{
+public:
+	// 0 means std::thread::hardware_concurrency() (at least 1)
+	explicit thread_pool(std::size_t num_threads = 0);
+	// finishes already submitted tasks
+	~thread_pool();
+
+	thread_pool(const thread_pool&) = delete;
+	thread_pool& operator=(const thread_pool&) = delete;
+
+	template <typename F>
+	std::future<std::invoke_result_t<F>> submit(F f)
+	{
+		using result_type = std::invoke_result_t<F>;
+		// std::function requires copyable callables
+		auto task = std::make_shared<std::packaged_task<result_type()>>(std::move(f));
+		std::future<result_type> result = task->get_future();
+		push([task]() { (*task)(); });
+		return result;
+	}
+
+	std::size_t num_threads() const noexcept { return m_threads.size(); }
+
+private:
+	void push(std::function<void()> task);
+	void worker_loop();
+
+	std::mutex m_mutex;
+	std::condition_variable m_condition;
+	std::deque<std::function<void()>> m_tasks;
+	bool m_stopping = false;
+	std::vector<std::thread> m_threads;
+};
+
+}
@@ -0,0 +1,77 @@
+#include <ach/web/css_class_map.hpp>
+
+namespace ach::web {
+
+namespace {
+
+// CSS identifiers can not start with a digit
+constexpr std::string_view first_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+constexpr std::string_view next_chars = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789";
+
+}
+
+css_class_map::css_class_map(const css_class_map& other)
+{
+	*this = other;
+}
+
+css_class_map& css_class_map::operator=(const css_class_map& other)
+{
+	if (this == &other)
+		return *this;
+
+	// the index must refer to own strings
+	m_entries = other.m_entries;
+	m_index.clear();
+	for (std::size_t i = 0; i < m_entries.size(); ++i)
+		m_index.emplace(m_entries[i].classes, i);
+
+	return *this;
+}
+
+css_class_map::css_class_map(css_class_map&& other) noexcept
+: m_entries(std::move(other.m_entries))
+, m_index(std::move(other.m_index))
+{
+	other.m_entries.clear();
+	other.m_index.clear();
+}
+
+css_class_map& css_class_map::operator=(css_class_map&& other) noexcept
+{
+	if (this == &other)
+		return *this;
+
+	m_entries = std::move(other.m_entries);
+	m_index = std::move(other.m_index);
+	other.m_entries.clear();
+	other.m_index.clear();
+	return *this;
+}
+
+std::string_view css_class_map::short_name(std::string_view classes)
+{
+	if (const auto it = m_index.find(classes); it != m_index.end())
+		return m_entries[it->second].short_name;
+
+	const std::size_t index = m_entries.size();
+	const entry& e = m_entries.emplace_back(entry{make_short_name(index), std::string(classes)});
+	m_index.emplace(e.classes, index);
+	return e.short_name;
+}
+
+std::string css_class_map::make_short_name(std::size_t index)
+{
+	std::string result(1, first_chars[index % first_chars.size()]);
+	index /= first_chars.size();
+
+	while (index > 0) {
+		--index;
+		result.push_back(next_chars[index % next_chars.size()]);
+		index /= next_chars.size();
+	}
+
+	return result;
+}
+
+}
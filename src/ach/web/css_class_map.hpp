@@ -0,0 +1,51 @@
+#pragma once
+
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace ach::web {
+
+/*
+ * Assigns short identifiers to (possibly space-separated multiple) CSS classes.
+ * Used by compact output mode to shorten class attributes.
+ *
+ * Identifiers are assigned in order of first use so reuse the same map
+ * (or seed it in a fixed order) to keep them stable across multiple calls.
+ */
+class css_class_map
+{
+public:
+	struct entry
+	{
+		std::string short_name;
+		std::string classes;
+	};
+
+	css_class_map() = default;
+
+	css_class_map(const css_class_map& other);
+	css_class_map& operator=(const css_class_map& other);
+	// moving a deque does not move its elements so views stay valid
+	css_class_map(css_class_map&& other) noexcept;
+	css_class_map& operator=(css_class_map&& other) noexcept;
+
+	// return short identifier for given classes, assign a new one if classes were not seen before
+	std::string_view short_name(std::string_view classes);
+
+	// mapping from short identifiers to original classes, in assignment order
+	const std::deque<entry>& entries() const noexcept { return m_entries; }
+	std::size_t size() const noexcept { return m_entries.size(); }
+	bool empty() const noexcept { return m_entries.empty(); }
+
+	// 1 character for first 52 entries, 2 characters for next 3224 entries and so on
+	static std::string make_short_name(std::size_t index);
+
+private:
+	// deque does not invalidate references on insertion so it can own strings for the index
+	std::deque<entry> m_entries;
+	std::unordered_map<std::string_view, std::size_t> m_index;
+};
+
+}
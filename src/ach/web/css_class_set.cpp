@@ -0,0 +1,80 @@
+#include <ach/web/css_class_set.hpp>
+#include <ach/web/types.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <utility>
+
+namespace ach::web {
+
+std::uint64_t css_class_set::next_id() noexcept
+{
+	static std::atomic<std::uint64_t> last_id{0};
+	return ++last_id;
+}
+
+css_class_set::css_class_set(const css_class_set& other)
+{
+	*this = other;
+}
+
+css_class_set& css_class_set::operator=(const css_class_set& other)
+{
+	if (this == &other)
+		return *this;
+
+	clear();
+	for (const std::string& name : other.m_names) {
+		m_index.insert(m_names.emplace_back(name));
+	}
+
+	return *this;
+}
+
+css_class_set::css_class_set(css_class_set&& other) noexcept
+: m_names(std::move(other.m_names))
+, m_index(std::move(other.m_index))
+, m_id(other.m_id)
+{
+	other.clear();
+}
+
+css_class_set& css_class_set::operator=(css_class_set&& other) noexcept
+{
+	if (this == &other)
+		return *this;
+
+	m_names = std::move(other.m_names);
+	m_index = std::move(other.m_index);
+	m_id = other.m_id;
+	other.clear();
+	return *this;
+}
+
+void css_class_set::add(std::string_view classes)
+{
+	m_id = next_id();
+
+	auto it = classes.begin();
+	const auto last = classes.end();
+	while (it != last) {
+		const auto first = std::find_if(it, last, is_css_class_char);
+		it = std::find_if_not(first, last, is_css_class_char);
+
+		if (first == it)
+			continue;
+
+		const std::string_view name(&*first, it - first);
+		if (m_index.count(name) == 0u)
+			m_index.insert(m_names.emplace_back(name));
+	}
+}
+
+void css_class_set::clear()
+{
+	m_names.clear();
+	m_index.clear();
+	m_id = next_id();
+}
+
+}
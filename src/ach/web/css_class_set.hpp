@@ -0,0 +1,48 @@
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+
+namespace ach::web {
+
+/*
+ * Set of allowed CSS classes, parsed once from a list of names separated by
+ * any characters that can not be a part of a CSS class name (spaces, commas etc.).
+ * Lookups are whole-name matches, O(1) on average.
+ */
+class css_class_set
+{
+public:
+	css_class_set() = default;
+	explicit css_class_set(std::string_view classes) { add(classes); }
+
+	css_class_set(const css_class_set& other);
+	css_class_set& operator=(const css_class_set& other);
+	// moving a deque does not move its elements so views stay valid
+	css_class_set(css_class_set&& other) noexcept;
+	css_class_set& operator=(css_class_set&& other) noexcept;
+
+	void add(std::string_view classes);
+	void clear();
+
+	bool contains(std::string_view class_name) const { return m_index.count(class_name) != 0u; }
+	std::size_t size() const noexcept { return m_index.size(); }
+	bool empty() const noexcept { return m_index.empty(); }
+
+	// Identifies contents of the set: changes on every modification, never reused.
+	// Allows to use the set as a part of a cache key without hashing all names.
+	std::uint64_t id() const noexcept { return m_id; }
+
+private:
+	static std::uint64_t next_id() noexcept;
+
+	// deque does not invalidate references on insertion so it can own strings for the index
+	std::deque<std::string> m_names;
+	std::unordered_set<std::string_view> m_index;
+	std::uint64_t m_id = next_id();
+};
+
+}
@@ -0,0 +1,132 @@
+#include <ach/web/deflate_sink.hpp>
+
+#include <zlib.h>
+
+#include <algorithm>
+#include <limits>
+
+namespace ach::web {
+
+std::optional<deflate_format> parse_deflate_format(std::string_view name) noexcept
+{
+	if (name == "gzip")
+		return deflate_format::gzip;
+	if (name == "zlib" || name == "deflate")
+		return deflate_format::zlib;
+	if (name == "raw")
+		return deflate_format::raw;
+
+	return std::nullopt;
+}
+
+namespace {
+
+int window_bits(deflate_format format) noexcept
+{
+	constexpr int max_window_bits = 15;
+	switch (format) {
+		case deflate_format::gzip:
+			return max_window_bits + 16;
+		case deflate_format::raw:
+			return -max_window_bits;
+		case deflate_format::zlib:
+		default:
+			return max_window_bits;
+	}
+}
+
+}
+
+deflate_sink::deflate_sink(
+	output_sink& destination,
+	deflate_format format,
+	int level,
+	std::size_t chunk_size)
+: buffered_sink(chunk_size)
+, m_destination(destination)
+, m_stream(std::make_unique<z_stream_s>())
+, m_output(std::make_unique<char[]>(chunk_size))
+, m_output_size(chunk_size)
+{
+	constexpr int default_mem_level = 8;
+	const int status = deflateInit2(
+		m_stream.get(), level, Z_DEFLATED, window_bits(format), default_mem_level, Z_DEFAULT_STRATEGY);
+
+	if (status != Z_OK) {
+		set_error(status);
+		m_stream.reset();
+	}
+}
+
+deflate_sink::~deflate_sink()
+{
+	if (m_stream)
+		deflateEnd(m_stream.get());
+}
+
+void deflate_sink::write_chunk(std::string_view chunk)
+{
+	if (m_stream_finished && m_error.empty()) {
+		deflateReset(m_stream.get());
+		m_stream_finished = false;
+	}
+
+	// zlib counts input in uInt which may be narrower than std::size_t
+	constexpr std::size_t max_input = std::numeric_limits<uInt>::max();
+	while (!chunk.empty()) {
+		const std::size_t n = std::min(chunk.size(), max_input);
+		deflate_chunk(chunk.substr(0, n), Z_NO_FLUSH);
+		chunk.remove_prefix(n);
+	}
+}
+
+void deflate_sink::on_flush()
+{
+	if (!m_stream_finished) {
+		deflate_chunk({}, Z_FINISH);
+		m_stream_finished = true;
+	}
+
+	m_destination.flush();
+}
+
+void deflate_sink::deflate_chunk(std::string_view chunk, int flush_mode)
+{
+	if (!m_error.empty())
+		return;
+
+	z_stream_s& stream = *m_stream;
+	// zlib does not modify input, the cast is required by its pre-const API
+	stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(chunk.data()));
+	stream.avail_in = static_cast<uInt>(chunk.size());
+
+	do {
+		stream.next_out = reinterpret_cast<Bytef*>(m_output.get());
+		stream.avail_out = static_cast<uInt>(m_output_size);
+
+		const int status = deflate(&stream, flush_mode);
+		if (status == Z_STREAM_ERROR) {
+			set_error(status);
+			return;
+		}
+
+		const std::size_t n = m_output_size - stream.avail_out;
+		if (n > 0) {
+			m_destination.write({m_output.get(), n});
+			m_num_output_bytes += n;
+		}
+	} while (stream.avail_out == 0);
+}
+
+void deflate_sink::set_error(int status)
+{
+	if (!m_error.empty())
+		return;
+
+	if (m_stream && m_stream->msg != nullptr)
+		m_error = m_stream->msg;
+	else
+		m_error = zError(status);
+}
+
+}
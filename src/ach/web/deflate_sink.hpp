@@ -0,0 +1,74 @@
+#pragma once
+
+// available only if zlib was found at configure time
+#ifdef ACH_HAVE_ZLIB
+
+#include <ach/web/output_sink.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <optional>
+#include <string_view>
+
+struct z_stream_s;
+
+namespace ach::web {
+
+enum class deflate_format
+{
+	gzip,   // RFC 1952, what HTTP calls "gzip"
+	zlib,   // RFC 1950, what HTTP calls "deflate"
+	raw     // RFC 1951, no header and no checksum
+};
+
+// accepts "gzip", "zlib", "deflate" (same as zlib) and "raw"
+[[nodiscard]] std::optional<deflate_format> parse_deflate_format(std::string_view name) noexcept;
+
+/*
+ * Compresses output as it is produced and writes compressed bytes to another sink.
+ * Input is collected into chunks so that the compressor is not called for every tag.
+ *
+ * flush() completes the compressed stream (and flushes the destination). Anything
+ * written later starts a new stream - for gzip this forms a valid multi-member file.
+ * The destination must outlive this object.
+ */
+class deflate_sink final : public buffered_sink
+{
+public:
+	static constexpr int default_level = -1; // Z_DEFAULT_COMPRESSION
+
+	explicit deflate_sink(
+		output_sink& destination,
+		deflate_format format = deflate_format::gzip,
+		int level = default_level,
+		std::size_t chunk_size = default_chunk_size);
+	~deflate_sink();
+
+	deflate_sink(const deflate_sink&) = delete;
+	deflate_sink& operator=(const deflate_sink&) = delete;
+
+	// description of the first compression error, empty if there was none
+	std::string_view error() const noexcept { return m_error; }
+
+	// compressed bytes written to the destination so far
+	std::size_t num_output_bytes() const noexcept { return m_num_output_bytes; }
+
+private:
+	void write_chunk(std::string_view chunk) override;
+	void on_flush() override;
+
+	void deflate_chunk(std::string_view chunk, int flush_mode);
+	void set_error(int status);
+
+	output_sink& m_destination;
+	std::unique_ptr<z_stream_s> m_stream;
+	std::unique_ptr<char[]> m_output;
+	std::size_t m_output_size;
+	std::size_t m_num_output_bytes = 0;
+	bool m_stream_finished = false;
+	std::string_view m_error;
+};
+
+}
+
+#endif
@@ -1,6 +1,11 @@
 #include <ach/web/html_builder.hpp>
+#include <ach/text/utils.hpp>
+#include <ach/utility/retention.hpp>
 
+#include <algorithm>
+#include <array>
 #include <cassert>
+#include <charconv>
 
 namespace ach::web {
 
@@ -22,27 +27,95 @@ std::string_view to_escaped_html(const char& c) noexcept
 	}
 }
 
+constexpr bool needs_html_escape(char c) noexcept
+{
+	return c == '&' || c == '<' || c == '>';
+}
+
+constexpr std::string_view span_open_begin = "<span class=\"";
+constexpr std::string_view span_open_end = "\">";
+constexpr std::string_view span_close = "</span>";
+
+}
+
+void html_builder::reset()
+{
+	result.clear();
+	m_num_open_spans = 0;
+	m_pending_close = false;
+	m_pending_whitespace.clear();
+	m_coalesced_bytes = 0;
+}
+
+std::size_t html_builder::capacity_bytes() const noexcept
+{
+	std::size_t bytes = utility::heap_bytes(result)
+		+ utility::heap_bytes(m_classes)
+		+ utility::heap_bytes(m_whitespace_insensitive_classes)
+		+ utility::heap_bytes(m_open_spans)
+		+ utility::heap_bytes(m_pending.classes)
+		+ utility::heap_bytes(m_pending_whitespace);
+
+	for (const open_span_state& span : m_open_spans)
+		bytes += utility::heap_bytes(span.classes);
+
+	return bytes;
+}
+
+void html_builder::release_memory()
+{
+	reset();
+	utility::release_memory(result);
+	utility::release_memory(m_classes);
+	utility::release_memory(m_open_spans);
+	utility::release_memory(m_pending.classes);
+	utility::release_memory(m_pending_whitespace);
+}
+
+void html_builder::set_span_coalescing(bool enabled, std::string_view whitespace_insensitive_classes)
+{
+	m_coalesce_spans = enabled;
+	m_whitespace_insensitive_classes.clear();
+
+	auto it = whitespace_insensitive_classes.begin();
+	const auto last = whitespace_insensitive_classes.end();
+	while (it != last) {
+		const auto first = std::find_if(it, last, is_css_class_char);
+		it = std::find_if_not(first, last, is_css_class_char);
+
+		if (first != it)
+			m_whitespace_insensitive_classes.emplace_back(&*first, it - first);
+	}
+}
+
+void html_builder::flush()
+{
+	flush_pending_close();
 }
 
 void html_builder::open_table(std::size_t lines, std::string_view code_class)
 {
-	result +=
+	flush_pending_close();
+	write_stable(
 		"<table class=\"codetable\">"
-		"<tbody><tr><td class=\"linenos\"><div class=\"linenodiv\"><pre>";
+		"<tbody><tr><td class=\"linenos\"><div class=\"linenodiv\"><pre>");
 
+	std::array<char, 24> buffer;
 	for (std::size_t i = 1; i <= lines; ++i) {
-		result.append(std::to_string(i));
-		result += "\n";
+		char* const last = std::to_chars(buffer.data(), buffer.data() + buffer.size() - 1, i).ptr;
+		*last = '\n';
+		write({buffer.data(), static_cast<std::size_t>(last + 1 - buffer.data())});
 	}
 
-	result += "</pre></div></td><td class=\"code\"><pre class=\"code ";
-	result += code_class;
-	result += "\">";
+	write_stable("</pre></div></td><td class=\"code\"><pre class=\"code ");
+	write_stable(code_class);
+	write_stable("\">");
 }
 
 void html_builder::close_table()
 {
-	result += "</pre></td></tr></tbody></table>";
+	flush_pending_close();
+	write_stable("</pre></td></tr></tbody></table>");
 }
 
 void html_builder::add_span(simple_span_element span, bool replace_underscores_to_hyphens)
@@ -66,35 +139,141 @@ void html_builder::add_span(quote_span_element span, bool replace_underscores_to
 
 void html_builder::open_span(css_class class_, bool replace_underscores_to_hyphens)
 {
-	result += "<span class=\"";
-	append_class(class_, replace_underscores_to_hyphens);
-	result += "\">";
+	if (!m_coalesce_spans && m_class_map == nullptr) {
+		write_stable(span_open_begin);
+		append_class(class_, replace_underscores_to_hyphens);
+		write_stable(span_open_end);
+		return;
+	}
+
+	m_classes.clear();
+	append_class(m_classes, class_, replace_underscores_to_hyphens);
+	open_span_from_classes(is_whitespace_insensitive(class_));
 }
 
 void html_builder::open_span(css_class class1, css_class class2, bool replace_underscores_to_hyphens)
 {
-	result += "<span class=\"";
-	append_class(class1, replace_underscores_to_hyphens);
-	result += " ";
-	append_class(class2, replace_underscores_to_hyphens);
-	result += "\">";
+	if (!m_coalesce_spans && m_class_map == nullptr) {
+		write_stable(span_open_begin);
+		append_class(class1, replace_underscores_to_hyphens);
+		write_stable(" ");
+		append_class(class2, replace_underscores_to_hyphens);
+		write_stable(span_open_end);
+		return;
+	}
+
+	m_classes.clear();
+	append_class(m_classes, class1, replace_underscores_to_hyphens);
+	m_classes += " ";
+	append_class(m_classes, class2, replace_underscores_to_hyphens);
+	open_span_from_classes(is_whitespace_insensitive(class1) && is_whitespace_insensitive(class2));
+}
+
+void html_builder::open_span_from_classes(bool is_whitespace_insensitive)
+{
+	std::string_view classes = m_classes;
+	if (m_class_map != nullptr)
+		classes = m_class_map->short_name(classes);
+
+	if (!m_coalesce_spans) {
+		write_stable(span_open_begin);
+		write(classes);
+		write_stable(span_open_end);
+		return;
+	}
+
+	if (m_num_open_spans == m_open_spans.size())
+		m_open_spans.emplace_back();
+
+	open_span_state& state = m_open_spans[m_num_open_spans++];
+	state.classes.assign(classes.data(), classes.size());
+	state.is_whitespace_insensitive = is_whitespace_insensitive;
+	coalesce_or_open_span();
 }
 
 void html_builder::close_span()
 {
-	result += "</span>";
+	if (!m_coalesce_spans) {
+		write_stable(span_close);
+		return;
+	}
+
+	// nested spans: the inner closing tag can not be deferred any longer
+	flush_pending_close();
+
+	assert(m_num_open_spans > 0);
+	std::swap(m_pending, m_open_spans[--m_num_open_spans]);
+	m_pending_close = true;
+}
+
+void html_builder::coalesce_or_open_span()
+{
+	assert(m_num_open_spans > 0);
+	const open_span_state& state = m_open_spans[m_num_open_spans - 1];
+
+	if (m_pending_close) {
+		// whitespace is deferred only for whitespace-insensitive spans
+		// so if classes are the same, the whitespace can be moved inside the span
+		if (state.classes == m_pending.classes) {
+			write(m_pending_whitespace);
+			m_pending_whitespace.clear();
+			m_pending_close = false;
+			m_coalesced_bytes += span_close.size() + span_open_begin.size() + state.classes.size() + span_open_end.size();
+			return;
+		}
+
+		flush_pending_close();
+	}
+
+	write_stable(span_open_begin);
+	write(state.classes);
+	write_stable(span_open_end);
+}
+
+void html_builder::flush_pending_close()
+{
+	if (!m_pending_close)
+		return;
+
+	write_stable(span_close);
+	write(m_pending_whitespace);
+	m_pending_whitespace.clear();
+	m_pending_close = false;
+}
+
+bool html_builder::is_whitespace_insensitive(css_class class_) const
+{
+	return std::find(
+		m_whitespace_insensitive_classes.begin(),
+		m_whitespace_insensitive_classes.end(),
+		class_.name) != m_whitespace_insensitive_classes.end();
 }
 
 void html_builder::append_class(css_class class_, bool replace_underscores_to_hyphens)
+{
+	if (replace_underscores_to_hyphens) {
+		m_classes.clear();
+		append_class(m_classes, class_, true);
+		write(m_classes);
+	}
+	else if (m_stable_class_names) {
+		write_stable(class_.name);
+	}
+	else {
+		write(class_.name);
+	}
+}
+
+void html_builder::append_class(std::string& str, css_class class_, bool replace_underscores_to_hyphens)
 {
 	if (replace_underscores_to_hyphens) {
 		for (char c : class_.name) {
-			result.push_back(c == '_' ? '-' : c);
+			str.push_back(c == '_' ? '-' : c);
 		}
 	}
 	else {
 		const auto css_class = class_.name;
-		result.append(css_class.data(), css_class.data() + css_class.length());
+		str.append(css_class.data(), css_class.data() + css_class.length());
 	}
 }
 
@@ -109,7 +288,7 @@ void html_builder::append_quoted(
 
 	bool inside_escape = false;
 	bool escape_opened = false;
-	for (char c : text) {
+	for (const char& c : text) {
 		if (inside_escape) {
 			append_raw(c);
 			inside_escape = false;
@@ -143,14 +322,43 @@ void html_builder::append_quoted(
 
 void html_builder::append_raw(std::string_view text)
 {
-	for (char c : text)
-		append_raw(c);
+	if (m_pending_close) {
+		if (m_pending.is_whitespace_insensitive && std::all_of(text.begin(), text.end(), text::is_whitespace)) {
+			m_pending_whitespace += text;
+			return;
+		}
+
+		flush_pending_close();
+	}
+
+	// write longest possible fragments of unmodified text
+	auto first = text.data();
+	const auto last = text.data() + text.size();
+	while (first != last) {
+		const auto it = std::find_if(first, last, needs_html_escape);
+		if (it != first)
+			write_input({first, static_cast<std::size_t>(it - first)});
+
+		if (it == last)
+			break;
+
+		write_stable(to_escaped_html(*it));
+		first = it + 1;
+	}
 }
 
-void html_builder::append_raw(char c)
+void html_builder::append_raw(const char& c)
 {
-	const std::string_view escaped = to_escaped_html(c);
-	result.append(escaped.data(), escaped.data() + escaped.length());
+	if (m_pending_close) {
+		if (m_pending.is_whitespace_insensitive && text::is_whitespace(c)) {
+			m_pending_whitespace.push_back(c);
+			return;
+		}
+
+		flush_pending_close();
+	}
+
+	write_input(to_escaped_html(c));
 }
 
 }
@@ -1,9 +1,12 @@
 #pragma once
 
 #include <ach/web/types.hpp>
+#include <ach/web/css_class_map.hpp>
+#include <ach/web/output_sink.hpp>
 
 #include <string>
 #include <string_view>
+#include <vector>
 
 namespace ach::web {
 
@@ -12,8 +15,13 @@ class html_builder
 public:
 	explicit html_builder() = default;
 
-	void reset() { result.clear(); }
+	void reset();
 	void reserve(std::size_t n) { result.reserve(n); };
+
+	// heap memory kept for next uses (output and scratch buffers)
+	std::size_t capacity_bytes() const noexcept;
+	// resets and frees output and scratch buffers (configuration is kept)
+	void release_memory();
 	void add_span(simple_span_element span, bool replace_underscores_to_hyphens = false);
 	void add_span(quote_span_element span, bool replace_underscores_to_hyphens = false);
 
@@ -28,9 +36,85 @@ public:
 	void close_span();
 	void append_raw(std::string_view text);
 
+	/*
+	 * When enabled, closing a span is deferred until it is known whether the next
+	 * span has the same classes. If it does, both spans are merged into one.
+	 * Spans whose every class is listed in whitespace_insensitive_classes (names separated
+	 * by any non-identifier characters, compared before underscore replacement)
+	 * are also merged across whitespace-only text.
+	 *
+	 * Call flush() before reading the output.
+	 */
+	void set_span_coalescing(bool enabled, std::string_view whitespace_insensitive_classes = {});
+	// number of output bytes not written thanks to span coalescing since last reset
+	std::size_t coalesced_bytes() const noexcept { return m_coalesced_bytes; }
+	// write any deferred output
+	void flush();
+
+	/*
+	 * When set, class attributes are replaced by short identifiers from the map.
+	 * Multiple classes of one span are mapped as a whole to a single identifier.
+	 * The map must outlive its use in the builder. Pass nullptr to disable.
+	 */
+	void set_class_map(css_class_map* class_map) noexcept { m_class_map = class_map; }
+
+	/*
+	 * When set, output is written to the sink instead of the internal string.
+	 * Input text and class names passed to the builder are written as stable text
+	 * (except class names with underscore replacement or any other transformation).
+	 * The builder does not flush the sink. Pass nullptr to return to the internal string.
+	 */
+	void set_sink(output_sink* sink) noexcept { m_sink = sink; }
+
+	// Whether class names passed to the builder outlive the sink's output (default: true).
+	// If not, they are always copied.
+	void set_stable_class_names(bool stable) noexcept { m_stable_class_names = stable; }
+
+	// Same for input text (default: true). Not stable if input buffers are reused (streaming).
+	void set_stable_input(bool stable) noexcept { m_stable_input = stable; }
+
 private:
-	void append_raw(char c);
+	struct open_span_state
+	{
+		std::string classes; // exactly as written in the class attribute
+		bool is_whitespace_insensitive = false;
+	};
+
+	// text is copied
+	void write(std::string_view text)
+	{
+		if (m_sink)
+			m_sink->write(text);
+		else
+			result.append(text.data(), text.size());
+	}
+
+	// text outlives the output (input text, string literals) and can be referenced
+	void write_stable(std::string_view text)
+	{
+		if (m_sink)
+			m_sink->write_stable(text);
+		else
+			result.append(text.data(), text.size());
+	}
+
+	void write_input(std::string_view text)
+	{
+		if (m_stable_input)
+			write_stable(text);
+		else
+			write(text);
+	}
+
+	// reference parameter: if no escaping is needed, the character itself is referenced
+	void append_raw(const char& c);
 	void append_class(css_class class_, bool replace_underscores_to_hyphens);
+	void append_class(std::string& str, css_class class_, bool replace_underscores_to_hyphens);
+
+	bool is_whitespace_insensitive(css_class class_) const;
+	void open_span_from_classes(bool is_whitespace_insensitive);
+	void coalesce_or_open_span();
+	void flush_pending_close();
 
 	/*
 	 * text must be a valid quoted string (eg text == "\"abc\""):
@@ -46,6 +130,21 @@ private:
 		bool replace_underscores_to_hyphens);
 
 	std::string result;
+	std::string m_classes; // allocation reuse when class attribute has to be composed first
+	css_class_map* m_class_map = nullptr;
+	output_sink* m_sink = nullptr;
+	bool m_stable_class_names = true;
+	bool m_stable_input = true;
+
+	// span coalescing
+	bool m_coalesce_spans = false;
+	std::vector<std::string_view> m_whitespace_insensitive_classes;
+	std::vector<open_span_state> m_open_spans; // used as a stack, elements are reused
+	std::size_t m_num_open_spans = 0;
+	bool m_pending_close = false;
+	open_span_state m_pending; // span which closing tag has been deferred
+	std::string m_pending_whitespace; // text written after deferred closing tag
+	std::size_t m_coalesced_bytes = 0;
 };
 
 }
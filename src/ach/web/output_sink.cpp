@@ -0,0 +1,90 @@
+#include <ach/web/output_sink.hpp>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <ostream>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+namespace ach::web {
+
+buffered_sink::buffered_sink(std::size_t chunk_size)
+: m_buffer(std::make_unique<char[]>(chunk_size))
+, m_chunk_size(chunk_size)
+{
+	assert(chunk_size > 0);
+}
+
+void buffered_sink::write(std::string_view text)
+{
+	while (!text.empty()) {
+		if (m_used == 0 && text.size() >= m_chunk_size) {
+			// nothing buffered: avoid the copy
+			write_chunk(text);
+			return;
+		}
+
+		const std::size_t n = std::min(text.size(), m_chunk_size - m_used);
+		std::memcpy(m_buffer.get() + m_used, text.data(), n);
+		m_used += n;
+		text.remove_prefix(n);
+
+		if (m_used == m_chunk_size) {
+			write_chunk({m_buffer.get(), m_used});
+			m_used = 0;
+		}
+	}
+}
+
+void buffered_sink::flush()
+{
+	if (m_used > 0) {
+		write_chunk({m_buffer.get(), m_used});
+		m_used = 0;
+	}
+
+	on_flush();
+}
+
+void fd_sink::write_chunk(std::string_view chunk)
+{
+	while (!m_error && !chunk.empty()) {
+#ifdef _WIN32
+		const auto result = ::_write(m_fd, chunk.data(), static_cast<unsigned>(chunk.size()));
+#else
+		const auto result = ::write(m_fd, chunk.data(), chunk.size());
+#endif
+		if (result < 0) {
+			if (errno != EINTR)
+				m_error = std::error_code(errno, std::generic_category());
+
+			continue;
+		}
+
+		// nothing written for a non-empty chunk: retrying would never end
+		if (result == 0) {
+			m_error = std::make_error_code(std::errc::io_error);
+			break;
+		}
+
+		chunk.remove_prefix(static_cast<std::size_t>(result));
+	}
+}
+
+void ostream_sink::write_chunk(std::string_view chunk)
+{
+	m_os.write(chunk.data(), static_cast<std::streamsize>(chunk.size()));
+}
+
+void ostream_sink::on_flush()
+{
+	m_os.flush();
+}
+
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <iosfwd>
+#include <memory>
+#include <memory_resource>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+namespace ach::web {
+
+/*
+ * Destination of generated output. Highlighters write to it as output is produced
+ * so that (depending on implementation) it can be delivered before generation finishes.
+ */
+class output_sink
+{
+public:
+	virtual ~output_sink() = default;
+
+	// text may be a temporary - if the sink needs it later, it must copy it
+	virtual void write(std::string_view text) = 0;
+
+	// text outlives the sink's output (input text, string literals) - the sink may reference it
+	virtual void write_stable(std::string_view text) { write(text); }
+
+	// deliver any buffered output
+	virtual void flush() {}
+};
+
+// appends to a string, the string itself serves as the buffer
+class string_sink final : public output_sink
+{
+public:
+	explicit string_sink(std::string& str)
+	: m_str(str) {}
+
+	void write(std::string_view text) override { m_str.append(text.data(), text.size()); }
+
+	std::string& str() noexcept { return m_str; }
+	const std::string& str() const noexcept { return m_str; }
+
+private:
+	std::string& m_str;
+};
+
+// same, with memory of the string's resource (e.g. an arena shared with the run)
+class pmr_string_sink final : public output_sink
+{
+public:
+	explicit pmr_string_sink(std::pmr::string& str)
+	: m_str(str) {}
+
+	void write(std::string_view text) override { m_str.append(text.data(), text.size()); }
+
+	std::pmr::string& str() noexcept { return m_str; }
+	const std::pmr::string& str() const noexcept { return m_str; }
+
+private:
+	std::pmr::string& m_str;
+};
+
+/*
+ * Collects output in a fixed-size buffer and passes it further in chunks of that size.
+ * Text larger than the chunk size is passed directly when the buffer is empty.
+ */
+class buffered_sink : public output_sink
+{
+public:
+	static constexpr std::size_t default_chunk_size = 16 * 1024;
+
+	explicit buffered_sink(std::size_t chunk_size = default_chunk_size);
+
+	void write(std::string_view text) final;
+	void flush() final;
+
+	std::size_t chunk_size() const noexcept { return m_chunk_size; }
+
+protected:
+	virtual void write_chunk(std::string_view chunk) = 0;
+	// called after remaining buffered output has been passed to write_chunk
+	virtual void on_flush() {}
+
+private:
+	std::unique_ptr<char[]> m_buffer;
+	std::size_t m_chunk_size;
+	std::size_t m_used = 0;
+};
+
+// writes to a file descriptor, stops writing after first error
+class fd_sink final : public buffered_sink
+{
+public:
+	explicit fd_sink(int fd, std::size_t chunk_size = default_chunk_size)
+	: buffered_sink(chunk_size), m_fd(fd) {}
+
+	// first error that occured when writing, if any
+	std::error_code error() const noexcept { return m_error; }
+
+private:
+	void write_chunk(std::string_view chunk) override;
+
+	int m_fd;
+	std::error_code m_error;
+};
+
+class ostream_sink final : public buffered_sink
+{
+public:
+	explicit ostream_sink(std::ostream& os, std::size_t chunk_size = default_chunk_size)
+	: buffered_sink(chunk_size), m_os(os) {}
+
+private:
+	void write_chunk(std::string_view chunk) override;
+	void on_flush() override;
+
+	std::ostream& m_os;
+};
+
+class callback_sink final : public buffered_sink
+{
+public:
+	using callback_type = std::function<void(std::string_view)>;
+
+	explicit callback_sink(callback_type callback, std::size_t chunk_size = default_chunk_size)
+	: buffered_sink(chunk_size), m_callback(std::move(callback)) {}
+
+private:
+	void write_chunk(std::string_view chunk) override { m_callback(chunk); }
+
+	callback_type m_callback;
+};
+
+}
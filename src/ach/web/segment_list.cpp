@@ -0,0 +1,74 @@
+#include <ach/web/segment_list.hpp>
+
+#include <algorithm>
+#include <cstring>
+
+namespace ach::web {
+
+void segment_list::write(std::string_view text)
+{
+	if (text.empty())
+		return;
+
+	while (m_current_block < m_blocks.size()
+		&& m_blocks[m_current_block].capacity - m_current_block_used < text.size())
+	{
+		++m_current_block;
+		m_current_block_used = 0;
+	}
+
+	if (m_current_block == m_blocks.size()) {
+		const std::size_t capacity = std::max(min_block_size, text.size());
+		m_blocks.push_back(block{std::make_unique<char[]>(capacity), capacity});
+		m_current_block_used = 0;
+	}
+
+	char* const destination = m_blocks[m_current_block].data.get() + m_current_block_used;
+	std::memcpy(destination, text.data(), text.size());
+	m_current_block_used += text.size();
+	write_stable({destination, text.size()});
+}
+
+void segment_list::write_stable(std::string_view text)
+{
+	if (text.empty())
+		return;
+
+	m_size += text.size();
+
+	// merge with previous segment if contiguous (e.g. consecutive fragments of the input)
+	if (!m_segments.empty()) {
+		segment& last = m_segments.back();
+		if (last.data + last.size == text.data()) {
+			last.size += text.size();
+			return;
+		}
+	}
+
+	m_segments.push_back(segment{text.data(), text.size()});
+}
+
+void segment_list::clear() noexcept
+{
+	m_segments.clear();
+	m_size = 0;
+	m_current_block = 0;
+	m_current_block_used = 0;
+}
+
+void segment_list::copy_to(char* out) const noexcept
+{
+	for (segment s : m_segments) {
+		std::memcpy(out, s.data, s.size);
+		out += s.size;
+	}
+}
+
+std::string segment_list::str() const
+{
+	std::string result(m_size, '\0');
+	copy_to(result.data());
+	return result;
+}
+
+}
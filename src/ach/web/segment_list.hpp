@@ -0,0 +1,65 @@
+#pragma once
+
+#include <ach/web/output_sink.hpp>
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace ach::web {
+
+// same layout as POSIX struct iovec (except constness) so it can be passed to writev()
+struct segment
+{
+	const char* data;
+	std::size_t size;
+};
+
+/*
+ * Scatter-gather output: a list of segments which together form the output.
+ * Segments point either to text which outlives the list (input code, string literals)
+ * or to a small arena owned by the list (text which had to be transformed).
+ *
+ * Segments are valid until the list is cleared or destroyed
+ * and as long as any referenced input is not modified or destroyed.
+ */
+class segment_list final : public output_sink
+{
+public:
+	// copy text into the arena
+	void write(std::string_view text) override;
+	// reference text directly, it must outlive the list (or its next clear)
+	void write_stable(std::string_view text) override;
+
+	// remove all segments, keep allocated memory for reuse
+	void clear() noexcept;
+
+	const std::vector<segment>& segments() const noexcept { return m_segments; }
+	// total length of all segments
+	std::size_t size() const noexcept { return m_size; }
+	bool empty() const noexcept { return m_size == 0; }
+
+	// concatenate all segments, out must point to at least size() bytes
+	void copy_to(char* out) const noexcept;
+	std::string str() const;
+
+private:
+	struct block
+	{
+		std::unique_ptr<char[]> data;
+		std::size_t capacity;
+	};
+
+	static constexpr std::size_t min_block_size = 4096;
+
+	std::vector<segment> m_segments;
+	std::size_t m_size = 0;
+
+	std::vector<block> m_blocks;
+	std::size_t m_current_block = 0;
+	std::size_t m_current_block_used = 0;
+};
+
+}
@@ -1,10 +1,18 @@
 #pragma once
 
+#include <ach/text/utils.hpp>
+
 #include <string_view>
 #include <optional>
 
 namespace ach::web {
 
+// characters which can form CSS class names (in practice - this does not implement full CSS grammar)
+constexpr bool is_css_class_char(char c) noexcept
+{
+	return text::is_alnum_or_underscore(c) || c == '-';
+}
+
 struct html_text
 {
 	std::string_view text;
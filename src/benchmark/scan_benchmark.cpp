@@ -0,0 +1,120 @@
+// Compares SIMD text scanning (used by text::extractor) with the scalar reference.
+// Usage: ach_benchmark [token length] [total megabytes]
+
+#include <ach/text/scan.hpp>
+#include <ach/text/extractor.hpp>
+
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace {
+
+using namespace ach::text;
+
+using scan_function = const char* (*)(const char*, const char*);
+
+// tokens of given length separated by single spaces, each token ends with a quote
+std::string make_input(std::size_t token_length, std::size_t total_size)
+{
+	std::string result;
+	result.reserve(total_size + token_length);
+
+	const char alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_0123456789";
+	std::size_t n = 0;
+	while (result.size() < total_size) {
+		for (std::size_t i = 0; i + 1 < token_length; ++i)
+			result += alphabet[n++ % (sizeof(alphabet) - 1)];
+
+		result += (n % 8 == 0) ? '\n' : '"';
+		result += ' ';
+	}
+
+	return result;
+}
+
+// how many tokens have been found, so that the work can not be optimized out
+template <typename F>
+std::size_t count_tokens(const std::string& input, F scan)
+{
+	const char* first = input.data();
+	const char* const last = input.data() + input.size();
+
+	std::size_t result = 0;
+	while (first != last) {
+		first = scan(first, last);
+		if (first != last)
+			++first;
+
+		++result;
+	}
+
+	return result;
+}
+
+template <typename F>
+void measure(const char* name, const std::string& input, F scan)
+{
+	const auto start = std::chrono::steady_clock::now();
+	const std::size_t tokens = count_tokens(input, scan);
+	const auto stop = std::chrono::steady_clock::now();
+
+	const double seconds = std::chrono::duration<double>(stop - start).count();
+	const double mb_per_s = static_cast<double>(input.size()) / seconds / 1e6;
+	std::cout << std::left << std::setw(36) << name
+		<< std::right << std::setw(10) << std::fixed << std::setprecision(1) << mb_per_s << " MB/s"
+		<< " (" << tokens << " tokens)\n";
+}
+
+void measure_extractor(const std::string& input)
+{
+	const auto start = std::chrono::steady_clock::now();
+	extractor ex(input);
+	std::size_t tokens = 0;
+	while (!ex.has_reached_end()) {
+		if (ex.extract_identifier().is_empty() && ex.extract_non_newline_whitespace().is_empty()
+			&& ex.extract_n_characters(1).is_empty())
+			(void) ex.load_next_line();
+
+		++tokens;
+	}
+	const auto stop = std::chrono::steady_clock::now();
+
+	const double seconds = std::chrono::duration<double>(stop - start).count();
+	std::cout << std::left << std::setw(36) << "extractor walk"
+		<< std::right << std::setw(10) << std::fixed << std::setprecision(1)
+		<< static_cast<double>(input.size()) / seconds / 1e6 << " MB/s"
+		<< " (" << tokens << " tokens)\n";
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+	const std::size_t token_length = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 24;
+	const std::size_t megabytes = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 64;
+
+	if (token_length < 2 || megabytes == 0) {
+		std::cerr << "usage: " << argv[0] << " [token length >= 2] [total megabytes > 0]\n";
+		return EXIT_FAILURE;
+	}
+
+	const std::string input = make_input(token_length, megabytes * 1000 * 1000);
+	std::cout << "token length: " << token_length << ", input: " << input.size() << " bytes\n";
+
+	constexpr unsigned char identifier = char_class::alnum | char_class::underscore;
+
+	measure("find_char (scalar)", input, [](const char* f, const char* l) { return scalar::find_char(f, l, '\n'); });
+	measure("find_char", input, [](const char* f, const char* l) { return find_char(f, l, '\n'); });
+	measure("find_either (scalar)", input, [](const char* f, const char* l) { return scalar::find_either(f, l, '"', '\\'); });
+	measure("find_either", input, [](const char* f, const char* l) { return find_either(f, l, '"', '\\'); });
+	measure("find_first_not_of_class (scalar)", input, [](const char* f, const char* l) {
+		return scalar::find_first_not_of_class(f, l, identifier);
+	});
+	measure("find_first_not_of_class", input, [](const char* f, const char* l) {
+		return find_first_not_of_class(f, l, identifier);
+	});
+	measure_extractor(input);
+}
@@ -0,0 +1,40 @@
+#include "files.hpp"
+
+#include <fstream>
+
+namespace sfs = std::filesystem;
+
+std::string load_file(const sfs::path& path, std::error_code& ec)
+{
+	std::string file_contents;
+	load_file(path, file_contents, ec);
+	return file_contents;
+}
+
+void load_file(const sfs::path& path, std::string& contents, std::error_code& ec)
+{
+	contents.clear();
+
+	sfs::file_status status = sfs::status(path, ec);
+	if (ec)
+		return;
+
+	if (sfs::is_directory(status)) {
+		ec = std::make_error_code(std::errc::is_a_directory);
+		return;
+	}
+
+	const auto file_size = sfs::file_size(path, ec);
+	if (ec)
+		return;
+
+	std::ifstream file(path, std::ios::binary);
+
+	if (!file.good()) {
+		ec = std::make_error_code(std::io_errc::stream);
+		return;
+	}
+
+	contents.resize(file_size);
+	file.read(contents.data(), static_cast<std::streamsize>(file_size));
+}
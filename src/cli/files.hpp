@@ -0,0 +1,9 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <system_error>
+
+std::string load_file(const std::filesystem::path& path, std::error_code& ec);
+// reads into existing contents, reusing their memory
+void load_file(const std::filesystem::path& path, std::string& contents, std::error_code& ec);
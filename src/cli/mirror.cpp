@@ -0,0 +1,304 @@
+#include "mirror.hpp"
+#include "files.hpp"
+
+#include <ach/mirror/color_program.hpp>
+#include <ach/text/line_source.hpp>
+#include <ach/utility/thread_pool.hpp>
+#include <ach/web/css_class_set.hpp>
+#include <ach/web/deflate_sink.hpp>
+#include <ach/web/output_sink.hpp>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <atomic>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <system_error>
+#include <vector>
+
+namespace
+{
+
+namespace pt = boost::property_tree;
+
+using ach::mirror::highlighter_error;
+
+std::string to_string(const highlighter_error& error)
+{
+	std::ostringstream ss;
+	ss << error;
+	return ss.str();
+}
+
+// returns error message, empty on success
+using generate_function = std::function<std::string(ach::web::output_sink&)>;
+
+std::string generate_compressed(
+	ach::web::output_sink& destination,
+	const mirror_job_options& options,
+	const generate_function& generate)
+{
+#ifdef ACH_HAVE_ZLIB
+	const std::optional<ach::web::deflate_format> format = ach::web::parse_deflate_format(options.compress);
+	if (!format)
+		return "compress should be one of: gzip, zlib, deflate, raw";
+
+	ach::web::deflate_sink sink(destination, *format, options.compress_level);
+	std::string error = generate(sink);
+	if (error.empty() && !sink.error().empty())
+		error = std::string("compression failed: ").append(sink.error());
+
+	return error;
+#else
+	(void) destination;
+	(void) options;
+	(void) generate;
+	return "compressed output is not available: program was built without zlib";
+#endif
+}
+
+// writes to the file or to standard output if there is no path
+std::string write_output(
+	const boost::optional<std::string>& path_output,
+	const mirror_job_options& options,
+	const generate_function& generate)
+{
+	std::ofstream file;
+	if (path_output) {
+		file.open(*path_output, std::ios::binary);
+		if (!file.good())
+			return "failed to open output file " + *path_output;
+	}
+
+	std::ostream& os = path_output ? file : std::cout;
+	ach::web::ostream_sink sink(os);
+	std::string error = options.compress.empty() ? generate(sink) : generate_compressed(sink, options, generate);
+
+	if (error.empty() && !os.good())
+		error = "failed to write output";
+
+	// do not leave partial output
+	if (!error.empty() && path_output) {
+		file.close();
+		std::error_code ec;
+		std::filesystem::remove(*path_output, ec);
+	}
+
+	return error;
+}
+
+std::string load_input(const std::string& path, std::string& contents)
+{
+	std::error_code ec;
+	load_file(path, contents, ec);
+	if (ec)
+		return "failed to load file " + path + ": " + ec.message();
+
+	return {};
+}
+
+std::string run_streaming(const std::string& path_code, const std::string& path_color, ach::mirror::highlighter& hl, ach::web::output_sink& output)
+{
+	std::ifstream code_file(path_code, std::ios::binary);
+	if (!code_file.good())
+		return "failed to open file " + path_code;
+
+	std::ifstream color_file(path_color, std::ios::binary);
+	if (!color_file.good())
+		return "failed to open file " + path_color;
+
+	ach::text::istream_line_source code(code_file);
+	ach::text::istream_line_source color(color_file);
+	if (const std::optional<highlighter_error> maybe_error = hl.run(code, color, output); maybe_error)
+		return to_string(*maybe_error);
+
+	if (code_file.bad() || color_file.bad())
+		return "failed to read input";
+
+	return {};
+}
+
+struct job
+{
+	std::string path_code;
+	std::string path_color;
+	std::string path_output;
+	mirror_job_options options;
+	bool has_valid_css_classes = false; // overrides default list
+};
+
+// returns error message, empty on success
+std::string parse_job(const std::string& line, const mirror_job_options& default_options, job& result)
+{
+	try {
+		pt::ptree tree;
+		std::istringstream ss(line);
+		pt::read_json(ss, tree);
+
+		result.path_code = tree.get<std::string>("code");
+		result.path_color = tree.get<std::string>("color");
+		result.path_output = tree.get<std::string>("output");
+		result.options = default_options;
+
+		if (const boost::optional<pt::ptree&> options = tree.get_child_optional("options"); options) {
+			mirror_job_options& opts = result.options;
+			opts.table_wrap_css_class = options->get("table_wrap_css_class", opts.table_wrap_css_class);
+			opts.whitespace_insensitive_css_classes = options->get(
+				"whitespace_insensitive_css_classes", opts.whitespace_insensitive_css_classes);
+			opts.replace_underscores_to_hyphens = options->get("replace", opts.replace_underscores_to_hyphens);
+			opts.coalesce_spans = options->get("coalesce_spans", opts.coalesce_spans);
+			opts.compress = options->get("compress", opts.compress);
+			opts.compress_level = options->get("compress_level", opts.compress_level);
+
+			if (const boost::optional<std::string> classes = options->get_optional<std::string>("valid_css_classes"); classes) {
+				opts.valid_css_classes = *classes;
+				result.has_valid_css_classes = true;
+			}
+		}
+	}
+	catch (const pt::ptree_error& e) {
+		return e.what();
+	}
+
+	return {};
+}
+
+}
+
+ach::mirror::highlighter_options mirror_job_options::to_highlighter_options() const
+{
+	ach::mirror::highlighter_options result;
+	result.generation.table_wrap_css_class = table_wrap_css_class;
+	result.generation.valid_css_classes = valid_css_classes;
+	result.generation.whitespace_insensitive_css_classes = whitespace_insensitive_css_classes;
+	result.generation.replace_underscores_to_hyphens = replace_underscores_to_hyphens;
+	result.generation.coalesce_spans = coalesce_spans;
+	return result;
+}
+
+bool run_mirror(
+	const boost::optional<std::string>& path_input_code,
+	const boost::optional<std::string>& path_input_color,
+	const boost::optional<std::string>& path_output,
+	const mirror_job_options& options,
+	bool stream)
+{
+	if (!path_input_code || !path_input_color) {
+		std::cout << "Error: mirror highlighting requires input code and input color\n";
+		return false;
+	}
+
+	ach::mirror::highlighter hl(options.to_highlighter_options());
+	std::string code;
+	std::string color;
+
+	const std::string error = write_output(path_output, options, [&](ach::web::output_sink& output) -> std::string {
+		if (stream)
+			return run_streaming(*path_input_code, *path_input_color, hl, output);
+
+		if (std::string error = load_input(*path_input_code, code); !error.empty())
+			return error;
+
+		if (std::string error = load_input(*path_input_color, color); !error.empty())
+			return error;
+
+		if (const std::optional<highlighter_error> maybe_error = hl.run(code, color, output); maybe_error)
+			return to_string(*maybe_error);
+
+		return {};
+	});
+
+	if (!error.empty()) {
+		std::cout << "Error: " << error << "\n";
+		return false;
+	}
+
+	return true;
+}
+
+bool run_manifest(const std::string& path_manifest, const mirror_job_options& default_options, unsigned num_threads)
+{
+	std::ifstream manifest(path_manifest);
+	if (!manifest.good()) {
+		std::cout << "Error: failed to open manifest " << path_manifest << "\n";
+		return false;
+	}
+
+	std::vector<job> jobs;
+	std::vector<std::string> errors; // per job, empty on success
+	std::vector<std::size_t> line_numbers; // 1-based, for error messages
+	std::string line;
+	for (std::size_t line_number = 1; std::getline(manifest, line); ++line_number) {
+		if (line.find_first_not_of(" \t\r") == std::string::npos)
+			continue;
+
+		jobs.emplace_back();
+		errors.push_back(parse_job(line, default_options, jobs.back()));
+		line_numbers.push_back(line_number);
+	}
+
+	// shared by all jobs: default class list is parsed once, programs are compiled once per color
+	const ach::web::css_class_set default_classes(default_options.valid_css_classes);
+	ach::mirror::color_program_cache program_cache;
+
+	std::atomic<std::size_t> next_job = 0;
+	const auto worker = [&]() {
+		ach::mirror::highlighter hl;
+		std::string code;
+		std::string color;
+
+		for (std::size_t i = next_job++; i < jobs.size(); i = next_job++) {
+			if (!errors[i].empty())
+				continue;
+
+			const job& j = jobs[i];
+			ach::mirror::highlighter_options options = j.options.to_highlighter_options();
+			options.generation.program_cache = &program_cache;
+			if (!j.has_valid_css_classes && !default_classes.empty())
+				options.generation.valid_css_class_set = &default_classes;
+
+			hl.set_options(options);
+			errors[i] = write_output(j.path_output, j.options, [&](ach::web::output_sink& output) -> std::string {
+				if (std::string error = load_input(j.path_code, code); !error.empty())
+					return error;
+
+				if (std::string error = load_input(j.path_color, color); !error.empty())
+					return error;
+
+				if (const std::optional<highlighter_error> maybe_error = hl.run(code, color, output); maybe_error)
+					return to_string(*maybe_error);
+
+				return {};
+			});
+		}
+	};
+
+	{
+		ach::utility::thread_pool pool(num_threads);
+		std::vector<std::future<void>> workers;
+		for (std::size_t i = 0; i < pool.num_threads(); ++i)
+			workers.push_back(pool.submit(worker));
+
+		for (std::future<void>& w : workers)
+			w.get();
+	}
+
+	std::size_t num_failed = 0;
+	for (std::size_t i = 0; i < jobs.size(); ++i) {
+		if (errors[i].empty())
+			continue;
+
+		++num_failed;
+		std::cout << "Error: manifest line " << line_numbers[i] << ": " << errors[i] << "\n";
+	}
+
+	std::cout << jobs.size() - num_failed << " of " << jobs.size() << " jobs succeeded\n";
+	return num_failed == 0;
+}
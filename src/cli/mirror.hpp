@@ -0,0 +1,41 @@
+#pragma once
+
+#include <ach/mirror/core.hpp>
+
+#include <boost/optional.hpp>
+
+#include <string>
+
+// owned equivalent of mirror::highlighter_options (color options are default)
+struct mirror_job_options
+{
+	std::string table_wrap_css_class;
+	std::string valid_css_classes;
+	std::string whitespace_insensitive_css_classes;
+	bool replace_underscores_to_hyphens = false;
+	bool coalesce_spans = false;
+	std::string compress; // empty if no compression
+	int compress_level = -1;
+
+	// result refers to this object
+	ach::mirror::highlighter_options to_highlighter_options() const;
+};
+
+bool run_mirror(
+	const boost::optional<std::string>& path_input_code,
+	const boost::optional<std::string>& path_input_color,
+	const boost::optional<std::string>& path_output,
+	const mirror_job_options& options,
+	bool stream);
+
+/*
+ * Manifest: JSON Lines file, one job per line (empty lines are skipped):
+ * {"code": "a.txt", "color": "a.color", "output": "a.html", "options": {...}}
+ * Options are optional and override default options. Keys are the same as the fields
+ * of mirror_job_options plus "replace" for replace_underscores_to_hyphens.
+ * Relative paths are relative to the working directory.
+ *
+ * Jobs are processed in parallel, each worker thread reuses its highlighter.
+ * Errors are reported in manifest order, failed jobs do not stop others.
+ */
+bool run_manifest(const std::string& path_manifest, const mirror_job_options& default_options, unsigned num_threads);
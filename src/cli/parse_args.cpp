@@ -1,4 +1,6 @@
 #include "parse_args.hpp"
+#include "files.hpp"
+#include "mirror.hpp"
 
 #include <ach/clangd/code_tokenizer.hpp>
 #include <ach/utility/version.hpp>
@@ -18,35 +20,6 @@
 namespace
 {
 
-namespace sfs = std::filesystem;
-
-std::string load_file(const sfs::path& path, std::error_code& ec)
-{
-	sfs::file_status status = sfs::status(path, ec);
-	if (ec)
-		return {};
-
-	if (sfs::is_directory(status)) {
-		ec = std::make_error_code(std::errc::is_a_directory);
-		return {};
-	}
-
-	const auto file_size = sfs::file_size(path, ec);
-	if (ec)
-		return {};
-
-	std::ifstream file(path, std::ios::binary);
-
-	if (!file.good()) {
-		ec = std::make_error_code(std::io_errc::stream);
-		return {};
-	}
-
-	std::string file_contents(file_size, '\0');
-	file.read(file_contents.data(), static_cast<std::streamsize>(file_size));
-	return file_contents;
-}
-
 bool dump_clangd_tokens(const boost::optional<std::string>& path_input_code)
 {
 	if (!path_input_code) {
@@ -108,12 +81,26 @@ int run(int argc, char* argv[])
 			("output", po::value(&path_output), "output file path, if not present print to stdout")
 		;
 
-		// boost::optional<std::string> path_input_classes;
-		bool replace_underscore_to_hyphen = false;
-		po::options_description mirror_options("mirror highlight options (NOT IMPLEMENTED)");
+		bool mirror = false;
+		bool mirror_stream = false;
+		boost::optional<std::string> path_manifest;
+		unsigned num_jobs = 0;
+		boost::optional<std::string> path_input_classes;
+		mirror_job_options mirror_job;
+		po::options_description mirror_options("mirror highlight options");
 		mirror_options.add_options()
-			// ("check,c",  po::value(&path_input_classes),  "allow only classes that are specified in file")
-			("replace,r", po::bool_switch(&replace_underscore_to_hyphen), "replace _ to - in class names")
+			("mirror,m",   po::bool_switch(&mirror), "highlight input-code using input-color")
+			("stream",     po::bool_switch(&mirror_stream), "read inputs line by line (for inputs larger than memory)")
+			("manifest",   po::value(&path_manifest), "process jobs from JSON Lines file (see documentation)")
+			("jobs,j",     po::value(&num_jobs), "number of threads for manifest jobs, default: number of cores")
+			("check,c",    po::value(&path_input_classes), "allow only classes that are specified in file")
+			("replace,r",  po::bool_switch(&mirror_job.replace_underscores_to_hyphens), "replace _ to - in class names")
+			("table-wrap", po::value(&mirror_job.table_wrap_css_class), "wrap output in a table with line numbers, using given class")
+			("coalesce",   po::bool_switch(&mirror_job.coalesce_spans), "merge adjacent spans with the same class")
+			("whitespace-insensitive", po::value(&mirror_job.whitespace_insensitive_css_classes),
+				"classes which can be coalesced across whitespace")
+			("compress",   po::value(&mirror_job.compress), "compress output: gzip, zlib, deflate or raw")
+			("compress-level", po::value(&mirror_job.compress_level), "compression level, 0-9")
 		;
 
 		bool clangd_dump_tokens = false;
@@ -155,6 +142,21 @@ int run(int argc, char* argv[])
 
 		if (clangd_dump_tokens)
 			return dump_clangd_tokens(path_input_code) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+		if (path_input_classes) {
+			std::error_code ec;
+			mirror_job.valid_css_classes = load_file(*path_input_classes, ec);
+			if (ec) {
+				std::cout << "Error: failed to load file: " << ec.message() << ".\n";
+				return EXIT_FAILURE;
+			}
+		}
+
+		if (path_manifest)
+			return run_manifest(*path_manifest, mirror_job, num_jobs) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+		if (mirror)
+			return run_mirror(path_input_code, path_input_color, path_output, mirror_job, mirror_stream) ? EXIT_SUCCESS : EXIT_FAILURE;
 	}
 	catch (const std::exception& e) {
 		std::cout << "Error: " << e.what() << "\n";
@@ -1,12 +1,24 @@
 #include <ach/mirror/color_options.hpp>
 #include <ach/mirror/core.hpp>
+#include <ach/mirror/color_program.hpp>
 #include <ach/clangd/semantic_token.hpp>
 #include <ach/clangd/core.hpp>
+#include <ach/web/css_class_map.hpp>
+#include <ach/web/css_class_set.hpp>
+#include <ach/web/segment_list.hpp>
+#include <ach/web/deflate_sink.hpp>
+#include <ach/utility/cancellation.hpp>
+#include <ach/utility/retention.hpp>
+#include <ach/utility/thread_pool.hpp>
 #include <ach/utility/version.hpp>
-#include <ach/utility/visitor.hpp>
 
 #include <pybind11/pybind11.h>
 
+#include <algorithm>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <optional>
 #include <stdexcept>
 #include <sstream>
 #include <string>
@@ -27,9 +39,467 @@ std::string to_string(const mirror::highlighter_error& error)
 	return ss.str();
 }
 
-py::str run_mirror_highlighter(
-	// required arguments
-	std::string_view code, std::string_view color,
+/*
+ * Text from Python without copying: str (viewed as UTF-8, cached by Python after the first
+ * use) or any object supporting the buffer protocol (bytes, bytearray, memoryview, mmap...)
+ * which is used as is - no encoding takes place. The buffer is held until destruction,
+ * which requires the GIL. Objects must not be modified while they are being highlighted.
+ */
+class text_input
+{
+public:
+	text_input() = default;
+	~text_input() { release(); }
+
+	text_input(text_input&& other) noexcept
+	: m_buffer(other.m_buffer), m_has_buffer(other.m_has_buffer), m_view(other.m_view)
+	{
+		other.m_has_buffer = false;
+	}
+
+	text_input& operator=(text_input&& other) noexcept
+	{
+		if (this != &other) {
+			release();
+			m_buffer = other.m_buffer;
+			m_has_buffer = other.m_has_buffer;
+			m_view = other.m_view;
+			other.m_has_buffer = false;
+		}
+
+		return *this;
+	}
+
+	// false (and no Python error set) if the object is not supported
+	bool load(py::handle src)
+	{
+		release();
+
+		if (PyUnicode_Check(src.ptr())) {
+			Py_ssize_t size = 0;
+			const char* const data = PyUnicode_AsUTF8AndSize(src.ptr(), &size);
+			if (data == nullptr) {
+				PyErr_Clear();
+				return false;
+			}
+
+			m_view = std::string_view(data, static_cast<std::size_t>(size));
+			return true;
+		}
+
+		// contiguous bytes only
+		if (!PyObject_CheckBuffer(src.ptr()) || PyObject_GetBuffer(src.ptr(), &m_buffer, PyBUF_SIMPLE) != 0) {
+			PyErr_Clear();
+			return false;
+		}
+
+		m_has_buffer = true;
+		m_view = std::string_view(static_cast<const char*>(m_buffer.buf), static_cast<std::size_t>(m_buffer.len));
+		return true;
+	}
+
+	std::string_view view() const noexcept { return m_view; }
+
+private:
+	void release() noexcept
+	{
+		if (m_has_buffer)
+			PyBuffer_Release(&m_buffer);
+
+		m_has_buffer = false;
+		m_view = {};
+	}
+
+	Py_buffer m_buffer = {};
+	bool m_has_buffer = false;
+	std::string_view m_view;
+};
+
+// for jobs of batches, where the type caster is not used
+text_input load_text_input(py::handle src)
+{
+	text_input result;
+	if (!result.load(src))
+		throw py::type_error("code and color should be str or bytes-like objects");
+
+	return result;
+}
+
+// owns output of a highlighter, exposes it through the buffer protocol without a copy
+struct output_buffer
+{
+	std::string data;
+};
+
+enum class output_type { str, bytes, buffer };
+
+output_type parse_output_type(std::string_view name)
+{
+	if (name == "str")
+		return output_type::str;
+	if (name == "bytes")
+		return output_type::bytes;
+	if (name == "buffer")
+		return output_type::buffer;
+
+	throw py::value_error("argument 'output_type' should be one of: str, bytes, buffer");
+}
+
+// compressed output is binary: str means the default (bytes)
+py::object to_py_output(std::string_view text, output_type type, bool compressed)
+{
+	switch (type) {
+		case output_type::buffer:
+			return py::cast(output_buffer{std::string(text)});
+		case output_type::bytes:
+			return py::bytes(text.data(), text.size());
+		case output_type::str:
+		default:
+			if (compressed)
+				return py::bytes(text.data(), text.size());
+
+			return py::str(text.data(), text.size());
+	}
+}
+
+py::object move_to_py_output(std::string&& text, output_type type, bool compressed)
+{
+	if (type == output_type::buffer)
+		return py::cast(output_buffer{std::move(text)});
+
+	return to_py_output(text, type, compressed);
+}
+
+/*
+ * Runs f with the GIL released so that Python threads can highlight in parallel.
+ * Arguments must be converted before (views to Python strings stay valid - the objects
+ * are alive for the whole call and immutable, so are class sets). A class map is modified
+ * by every run and has no synchronization of its own: when used, the GIL is kept and
+ * serializes runs.
+ */
+template <typename F>
+auto without_gil(const web::css_class_map* class_map, F f)
+{
+	if (class_map != nullptr)
+		return f();
+
+	py::gil_scoped_release release;
+	return f();
+}
+
+// concatenate output once, into exactly sized buffer
+py::object to_py_output(const web::segment_list& segments, output_type type)
+{
+	switch (type) {
+		case output_type::bytes: {
+			// segments are copied straight into the bytes object
+			PyObject* const result = PyBytes_FromStringAndSize(nullptr, static_cast<Py_ssize_t>(segments.size()));
+			if (result == nullptr)
+				throw py::error_already_set();
+
+			segments.copy_to(PyBytes_AS_STRING(result));
+			return py::reinterpret_steal<py::object>(result);
+		}
+		case output_type::buffer:
+			return py::cast(output_buffer{segments.str()});
+		case output_type::str:
+		default:
+			return py::str(segments.str());
+	}
+}
+
+// run(web::output_sink&) should throw on error
+// returns str, bytes or output buffer (compressed output is never str)
+template <typename F>
+py::object run_with_output(std::string_view compress, int compress_level, std::string_view output_type_name, F run)
+{
+	const output_type type = parse_output_type(output_type_name);
+
+	if (compress.empty()) {
+		web::segment_list output;
+		run(output);
+		return to_py_output(output, type);
+	}
+
+#ifdef ACH_HAVE_ZLIB
+	const std::optional<web::deflate_format> format = web::parse_deflate_format(compress);
+	if (!format)
+		throw py::value_error("argument 'compress' should be one of: gzip, zlib, deflate, raw");
+
+	std::string compressed;
+	web::string_sink destination(compressed);
+	web::deflate_sink sink(destination, *format, compress_level);
+	run(sink);
+
+	if (!sink.error().empty())
+		throw std::runtime_error(std::string("compression failed: ").append(sink.error()));
+
+	return move_to_py_output(std::move(compressed), type, true);
+#else
+	(void) compress_level;
+	throw py::value_error("compressed output is not available: module was built without zlib");
+#endif
+}
+
+// Batches: many jobs in one call, processed on a thread pool with the GIL released.
+// Fixed cost of a call (argument parsing, conversions) is paid once per batch.
+
+utility::thread_pool& batch_pool()
+{
+	// never destroyed: joining threads during interpreter shutdown is not safe
+	static utility::thread_pool* const pool = new utility::thread_pool();
+	return *pool;
+}
+
+// compression requested by batch arguments, validated before any work starts
+struct batch_compression
+{
+	bool enabled = false;
+#ifdef ACH_HAVE_ZLIB
+	web::deflate_format format = web::deflate_format::gzip;
+#endif
+	int level = -1;
+};
+
+batch_compression parse_batch_compression(std::string_view compress, int compress_level)
+{
+	batch_compression result;
+	if (compress.empty())
+		return result;
+
+#ifdef ACH_HAVE_ZLIB
+	const std::optional<web::deflate_format> format = web::parse_deflate_format(compress);
+	if (!format)
+		throw py::value_error("argument 'compress' should be one of: gzip, zlib, deflate, raw");
+
+	result.enabled = true;
+	result.format = *format;
+	result.level = compress_level;
+	return result;
+#else
+	(void) compress_level;
+	throw py::value_error("compressed output is not available: module was built without zlib");
+#endif
+}
+
+// output of one job, error is empty on success
+struct batch_result
+{
+	std::string output;
+	std::string error;
+};
+
+// run(web::output_sink&) returns error message, empty on success - must not use Python
+template <typename F>
+void run_batch_job(const batch_compression& compression, batch_result& result, F run)
+{
+	web::string_sink destination(result.output);
+	if (!compression.enabled) {
+		result.error = run(destination);
+	}
+	else {
+#ifdef ACH_HAVE_ZLIB
+		web::deflate_sink sink(destination, compression.format, compression.level);
+		result.error = run(sink);
+		if (result.error.empty() && !sink.error().empty())
+			result.error = std::string("compression failed: ").append(sink.error());
+#endif
+	}
+
+	if (!result.error.empty())
+		result.output.clear();
+}
+
+/*
+ * Calls work(state, job_index) for every job. Each worker thread has its own state
+ * (scratch memory) made by make_state. If not parallel, jobs run on the calling thread
+ * with the GIL kept (for options that are not thread-safe, see without_gil).
+ */
+template <typename MakeState, typename F>
+void run_batch(std::size_t num_jobs, bool parallel, MakeState make_state, F work)
+{
+	if (!parallel) {
+		auto state = make_state();
+		for (std::size_t i = 0; i < num_jobs; ++i)
+			work(state, i);
+
+		return;
+	}
+
+	py::gil_scoped_release release;
+	utility::thread_pool& pool = batch_pool();
+	std::atomic<std::size_t> next_job = 0;
+
+	// workers pull jobs so that a few large ones do not delay the rest
+	const std::size_t num_workers = std::min(pool.num_threads(), num_jobs);
+	std::vector<std::future<void>> workers;
+	workers.reserve(num_workers);
+	for (std::size_t i = 0; i < num_workers; ++i) {
+		workers.push_back(pool.submit([&]() {
+			auto state = make_state();
+			for (std::size_t j = next_job++; j < num_jobs; j = next_job++)
+				work(state, j);
+		}));
+	}
+
+	// wait for all before any exception leaves: workers refer to local state
+	for (std::future<void>& worker : workers)
+		worker.wait();
+
+	for (std::future<void>& worker : workers)
+		worker.get();
+}
+
+// errors become RuntimeError objects in place of results
+py::list to_py_list(std::vector<batch_result>& results, const batch_compression& compression, output_type type)
+{
+	py::list list;
+	for (batch_result& result : results) {
+		if (!result.error.empty())
+			list.append(py::handle(PyExc_RuntimeError)(result.error));
+		else
+			list.append(move_to_py_output(std::move(result.output), type, compression.enabled));
+	}
+
+	return list;
+}
+
+// job pair: (first, second) tuple or any other sequence of 2 elements
+py::sequence get_job_pair(py::handle job, const char* error_message)
+{
+	if (!py::isinstance<py::sequence>(job) || py::len(job) != 2u)
+		throw py::value_error(error_message);
+
+	return py::reinterpret_borrow<py::sequence>(job);
+}
+
+/*
+ * Asynchronous runs: a job is highlighted on batch_pool() and its result is delivered to
+ * an asyncio future through call_soon_threadsafe of the loop that submitted it.
+ *
+ * Jobs own their inputs. Python objects (inputs, loop, future) are only touched and
+ * released with the GIL - the last reference to a job is dropped either by the loop
+ * callback or by the worker thread after it has acquired the GIL.
+ *
+ * Cancelling the future skips the job if it has not started yet, a started job stops at
+ * its next cancellation check (see utility::cancellation) and its result is dropped.
+ * The number of jobs submitted and not yet finished is limited, submissions over the
+ * limit raise QueueFullError so callers can apply backpressure instead of queueing
+ * unbounded work.
+ */
+
+struct async_queue_full : std::runtime_error
+{
+	using std::runtime_error::runtime_error;
+};
+
+constexpr std::size_t default_async_queue_limit = 256;
+
+std::atomic<std::size_t> async_queue_size = 0;
+std::atomic<std::size_t> async_queue_limit = default_async_queue_limit;
+
+struct async_job
+{
+	py::object loop;
+	py::object future;
+	std::shared_ptr<void> inputs;
+	utility::cancellation_token token;
+	batch_result result;
+};
+
+// reserves a place in the queue, throws if full
+void reserve_async_slot()
+{
+	std::size_t size = async_queue_size.load();
+	do {
+		if (size >= async_queue_limit.load())
+			throw async_queue_full("too many pending asynchronous jobs (see set_async_queue_limit)");
+	} while (!async_queue_size.compare_exchange_weak(size, size + 1));
+}
+
+// on the loop thread
+void complete_async_job(async_job& job, output_type type, bool compressed)
+{
+	// cancelled meanwhile
+	if (job.future.attr("done")().cast<bool>())
+		return;
+
+	if (!job.result.error.empty())
+		job.future.attr("set_exception")(py::handle(PyExc_RuntimeError)(job.result.error));
+	else
+		job.future.attr("set_result")(move_to_py_output(std::move(job.result.output), type, compressed));
+}
+
+/*
+ * Returns an asyncio future, must be called from a coroutine (running event loop).
+ * work(const Inputs&, const utility::cancellation_token&, web::output_sink&) returns error
+ * message, empty on success - must not use Python. Inputs are destroyed with the GIL,
+ * work must not own Python objects.
+ */
+template <typename Inputs, typename F>
+py::object submit_async(Inputs&& inputs, const batch_compression& compression, output_type type, F work)
+{
+	py::object loop = py::module::import("asyncio").attr("get_running_loop")();
+
+	auto owned_inputs = std::make_shared<Inputs>(std::move(inputs));
+	auto job = std::make_shared<async_job>();
+	job->loop = loop;
+	job->future = loop.attr("create_future")();
+	job->inputs = owned_inputs;
+
+	// weak: the future owns the callback, a strong reference would be a cycle
+	job->future.attr("add_done_callback")(py::cpp_function(
+		[weak_job = std::weak_ptr<async_job>(job)](py::handle future) {
+			if (!future.attr("cancelled")().cast<bool>())
+				return;
+
+			if (const std::shared_ptr<async_job> job = weak_job.lock(); job)
+				job->token.cancel();
+		}));
+
+	reserve_async_slot();
+	py::object future = job->future;
+	const Inputs* const inputs_ptr = owned_inputs.get();
+	owned_inputs.reset();
+
+	try {
+		batch_pool().submit([job, inputs_ptr, compression, type, work]() mutable {
+			if (!job->token.is_cancelled()) {
+				try {
+					run_batch_job(compression, job->result, [&](web::output_sink& output) {
+						return work(*inputs_ptr, job->token, output);
+					});
+				}
+				catch (const std::exception& e) {
+					job->result.output.clear();
+					job->result.error = e.what();
+				}
+			}
+
+			--async_queue_size;
+
+			py::gil_scoped_acquire gil;
+			try {
+				job->loop.attr("call_soon_threadsafe")(py::cpp_function([job, type, compressed = compression.enabled]() {
+					complete_async_job(*job, type, compressed);
+				}));
+			}
+			catch (const py::error_already_set&) {
+				// loop is closed, nobody waits for the result
+			}
+
+			job.reset();
+		});
+	}
+	catch (...) {
+		--async_queue_size;
+		throw;
+	}
+
+	return future;
+}
+
+mirror::highlighter_options make_mirror_options(
 	// optional, keyword arguments
 	std::string_view num_keyword, std::string_view str_keyword, std::string_view chr_keyword,
 	std::string_view num_class,
@@ -38,7 +508,12 @@ py::str run_mirror_highlighter(
 	std::string_view escape_char, std::string_view empty_token_char,
 	std::string_view table_wrap_css_class,
 	std::string_view valid_css_classes,
-	bool replace_underscores_to_hyphens)
+	const web::css_class_set* valid_css_class_set,
+	bool replace_underscores_to_hyphens,
+	bool coalesce_spans,
+	std::string_view whitespace_insensitive_css_classes,
+	web::css_class_map* class_map,
+	mirror::color_program_cache* program_cache)
 {
 	if (escape_char.size() != 1u) {
 		throw py::value_error("argument 'escape_char' should be 1 character");
@@ -48,33 +523,249 @@ py::str run_mirror_highlighter(
 		throw py::value_error("argument 'empty_token_char' should be 1 character");
 	}
 
-	const auto result = mirror::run_highlighter(
-		code,
-		color,
-		mirror::highlighter_options{
-			mirror::generation_options{
-				replace_underscores_to_hyphens,
-				table_wrap_css_class,
-				valid_css_classes
-			},
-			mirror::color_options{
-				num_keyword, str_keyword, chr_keyword,
-				num_class,
-				str_class, str_esc_class,
-				chr_class, chr_esc_class,
-				escape_char.front(),
-				empty_token_char.front()
-			}
-		});
-
-	return std::visit(utility::visitor{
-		[](const std::string& output) {
-			return py::str(output);
+	return mirror::highlighter_options{
+		mirror::generation_options{
+			replace_underscores_to_hyphens,
+			table_wrap_css_class,
+			valid_css_classes,
+			valid_css_class_set,
+			coalesce_spans,
+			whitespace_insensitive_css_classes,
+			class_map,
+			program_cache
 		},
-		[](mirror::highlighter_error error) -> py::str {
-			throw std::runtime_error(to_string(error));
+		mirror::color_options{
+			num_keyword, str_keyword, chr_keyword,
+			num_class,
+			str_class, str_esc_class,
+			chr_class, chr_esc_class,
+			escape_char.front(),
+			empty_token_char.front()
 		}
-	}, result);
+	};
+}
+
+py::object run_mirror_highlighter(
+	// required arguments
+	const text_input& code, const text_input& color,
+	// optional, keyword arguments
+	std::string_view num_keyword, std::string_view str_keyword, std::string_view chr_keyword,
+	std::string_view num_class,
+	std::string_view str_class, std::string_view str_esc_class,
+	std::string_view chr_class, std::string_view chr_esc_class,
+	std::string_view escape_char, std::string_view empty_token_char,
+	std::string_view table_wrap_css_class,
+	std::string_view valid_css_classes,
+	const web::css_class_set* valid_css_class_set,
+	bool replace_underscores_to_hyphens,
+	bool coalesce_spans,
+	std::string_view whitespace_insensitive_css_classes,
+	web::css_class_map* class_map,
+	mirror::color_program_cache* program_cache,
+	std::string_view compress,
+	int compress_level,
+	std::string_view output_type_name)
+{
+	const mirror::highlighter_options options = make_mirror_options(
+		num_keyword, str_keyword, chr_keyword,
+		num_class,
+		str_class, str_esc_class,
+		chr_class, chr_esc_class,
+		escape_char, empty_token_char,
+		table_wrap_css_class,
+		valid_css_classes,
+		valid_css_class_set,
+		replace_underscores_to_hyphens,
+		coalesce_spans,
+		whitespace_insensitive_css_classes,
+		class_map,
+		program_cache);
+
+	return run_with_output(compress, compress_level, output_type_name, [&](web::output_sink& output) {
+		const std::optional<mirror::highlighter_error> maybe_error = without_gil(class_map, [&]() {
+			return mirror::run_highlighter(code.view(), color.view(), output, options);
+		});
+
+		if (maybe_error)
+			throw std::runtime_error(to_string(*maybe_error));
+	});
+}
+
+mirror::highlighter make_mirror_highlighter(
+	std::string_view num_keyword, std::string_view str_keyword, std::string_view chr_keyword,
+	std::string_view num_class,
+	std::string_view str_class, std::string_view str_esc_class,
+	std::string_view chr_class, std::string_view chr_esc_class,
+	std::string_view escape_char, std::string_view empty_token_char,
+	std::string_view table_wrap_css_class,
+	std::string_view valid_css_classes,
+	const web::css_class_set* valid_css_class_set,
+	bool replace_underscores_to_hyphens,
+	bool coalesce_spans,
+	std::string_view whitespace_insensitive_css_classes,
+	web::css_class_map* class_map,
+	mirror::color_program_cache* program_cache,
+	std::size_t max_retained_bytes,
+	std::size_t decay_after_runs)
+{
+	// options are copied, views to Python strings do not need to outlive this call
+	mirror::highlighter hl(make_mirror_options(
+		num_keyword, str_keyword, chr_keyword,
+		num_class,
+		str_class, str_esc_class,
+		chr_class, chr_esc_class,
+		escape_char, empty_token_char,
+		table_wrap_css_class,
+		valid_css_classes,
+		valid_css_class_set,
+		replace_underscores_to_hyphens,
+		coalesce_spans,
+		whitespace_insensitive_css_classes,
+		class_map,
+		program_cache));
+	hl.set_retention_policy(utility::retention_policy{max_retained_bytes, decay_after_runs});
+	return hl;
+}
+
+py::object run_mirror_highlighter_object(
+	mirror::highlighter& hl,
+	const text_input& code,
+	const text_input& color,
+	std::string_view compress,
+	int compress_level,
+	std::string_view output_type_name)
+{
+	if (compress.empty()) {
+		const output_type type = parse_output_type(output_type_name);
+		// output is already contiguous, no need for segments
+		const std::variant<std::string_view, mirror::highlighter_error> result = hl.run(code.view(), color.view());
+		if (const auto error = std::get_if<mirror::highlighter_error>(&result); error != nullptr)
+			throw std::runtime_error(to_string(*error));
+
+		py::object output = to_py_output(std::get<std::string_view>(result), type, false);
+		// output has been copied to Python
+		hl.trim();
+		return output;
+	}
+
+	py::object output = run_with_output(compress, compress_level, output_type_name, [&](web::output_sink& output) {
+		const std::optional<mirror::highlighter_error> maybe_error = hl.run(code.view(), color.view(), output);
+
+		if (maybe_error)
+			throw std::runtime_error(to_string(*maybe_error));
+	});
+	hl.trim();
+	return output;
+}
+
+py::list run_mirror_highlighter_many(
+	// required arguments
+	const py::sequence& jobs,
+	// optional, keyword arguments
+	std::string_view num_keyword, std::string_view str_keyword, std::string_view chr_keyword,
+	std::string_view num_class,
+	std::string_view str_class, std::string_view str_esc_class,
+	std::string_view chr_class, std::string_view chr_esc_class,
+	std::string_view escape_char, std::string_view empty_token_char,
+	std::string_view table_wrap_css_class,
+	std::string_view valid_css_classes,
+	const web::css_class_set* valid_css_class_set,
+	bool replace_underscores_to_hyphens,
+	bool coalesce_spans,
+	std::string_view whitespace_insensitive_css_classes,
+	web::css_class_map* class_map,
+	mirror::color_program_cache* program_cache,
+	std::string_view compress,
+	int compress_level,
+	std::string_view output_type_name)
+{
+	const mirror::highlighter_options options = make_mirror_options(
+		num_keyword, str_keyword, chr_keyword,
+		num_class,
+		str_class, str_esc_class,
+		chr_class, chr_esc_class,
+		escape_char, empty_token_char,
+		table_wrap_css_class,
+		valid_css_classes,
+		valid_css_class_set,
+		replace_underscores_to_hyphens,
+		coalesce_spans,
+		whitespace_insensitive_css_classes,
+		class_map,
+		program_cache);
+
+	const batch_compression compression = parse_batch_compression(compress, compress_level);
+	const output_type type = parse_output_type(output_type_name);
+
+	// converted under the GIL, objects are kept alive (views) while it is released
+	std::vector<py::object> objects;
+	std::vector<text_input> codes;
+	std::vector<text_input> colors;
+	objects.reserve(2 * jobs.size());
+	codes.reserve(jobs.size());
+	colors.reserve(jobs.size());
+	for (const auto& job : jobs) {
+		const py::sequence pair = get_job_pair(job, "each job should be a pair (code, color)");
+		objects.push_back(pair[0]);
+		codes.push_back(load_text_input(objects.back()));
+		objects.push_back(pair[1]);
+		colors.push_back(load_text_input(objects.back()));
+	}
+
+	std::vector<batch_result> results(codes.size());
+	run_batch(codes.size(), class_map == nullptr,
+		[&]() { return mirror::highlighter(options); },
+		[&](mirror::highlighter& hl, std::size_t i) {
+			run_batch_job(compression, results[i], [&](web::output_sink& output) -> std::string {
+				if (const std::optional<mirror::highlighter_error> maybe_error = hl.run(codes[i].view(), colors[i].view(), output); maybe_error)
+					return to_string(*maybe_error);
+
+				return {};
+			});
+		});
+
+	return to_py_list(results, compression, type);
+}
+
+struct mirror_async_inputs
+{
+	py::object highlighter; // owns options
+	py::object code_object;
+	py::object color_object;
+	text_input code;
+	text_input color;
+};
+
+py::object run_mirror_highlighter_async(
+	const py::object& self,
+	const py::object& code,
+	const py::object& color,
+	std::string_view compress,
+	int compress_level,
+	std::string_view output_type_name)
+{
+	const mirror::highlighter& hl = self.cast<const mirror::highlighter&>();
+	if (hl.options().generation.class_map != nullptr)
+		throw py::value_error("asynchronous runs can not use a class map (it is not thread-safe)");
+
+	const batch_compression compression = parse_batch_compression(compress, compress_level);
+	const output_type type = parse_output_type(output_type_name);
+
+	mirror_async_inputs inputs{self, code, color, load_text_input(code), load_text_input(color)};
+	// the highlighter is not used (its scratch memory belongs to synchronous runs), only its options
+	return submit_async(std::move(inputs), compression, type,
+		[hl = &hl](const mirror_async_inputs& inputs, const utility::cancellation_token& token, web::output_sink& output) -> std::string {
+			mirror::highlighter_options options = hl->options();
+			options.generation.cancellation.token = &token;
+
+			if (const std::optional<mirror::highlighter_error> maybe_error = mirror::run_highlighter(
+				inputs.code.view(), inputs.color.view(), output, options); maybe_error)
+			{
+				return to_string(*maybe_error);
+			}
+
+			return {};
+		});
 }
 
 std::vector<clangd::semantic_token_type> parse_semantic_token_types(const py::list& list_semantic_token_types)
@@ -133,6 +824,30 @@ clangd::semantic_token_info get_semantic_token_info(
 	return *decoded;
 }
 
+void parse_semantic_tokens(
+	const clangd::semantic_token_decoder& decoder,
+	const py::list& list_semantic_tokens,
+	std::vector<clangd::semantic_token>& result)
+{
+	result.clear();
+	result.reserve(list_semantic_tokens.size());
+
+	for (const auto& token : list_semantic_tokens) {
+		result.push_back(clangd::semantic_token{
+			text::position{
+				token.attr("line").cast<std::size_t>(),
+				token.attr("column").cast<std::size_t>()
+			},
+			token.attr("length").cast<std::size_t>(),
+			get_semantic_token_info(decoder, token),
+			clangd::semantic_token_color_variance{
+				token.attr("color_variant").cast<int>(),
+				token.attr("last_reference").cast<bool>()
+			}
+		});
+	}
+}
+
 std::vector<std::string> parse_keywords(const py::list& list_keywords)
 {
 	std::vector<std::string> result;
@@ -151,74 +866,237 @@ std::string to_string(const clangd::highlighter_error& error)
 	return ss.str();
 }
 
+// immutable after construction, can be used by multiple Python threads at once
 struct clangd_highlighter
 {
 	clangd::semantic_token_decoder decoder;
 	clangd::highlighter hl;
-
-	// allocation reuse
-	mutable std::vector<clangd::semantic_token> semantic_tokens;
+	utility::retention_policy retention;
 };
 
 clangd_highlighter make_clangd_highlighter(
 	const py::list& legend_semantic_token_types,
 	const py::list& legend_semantic_token_modifiers,
-	const py::list& keywords)
+	const py::list& keywords,
+	std::size_t max_retained_bytes,
+	std::size_t decay_after_runs)
 {
+	const utility::retention_policy retention{max_retained_bytes, decay_after_runs};
 	return clangd_highlighter{
 		clangd::semantic_token_decoder{
 			parse_semantic_token_types(legend_semantic_token_types),
 			parse_semantic_token_modifiers(legend_semantic_token_modifiers)
 		},
-		clangd::highlighter(parse_keywords(keywords)),
-		{}
+		clangd::highlighter(parse_keywords(keywords), retention),
+		retention
 	};
 }
 
-py::str run_clangd_highlighter(
+// parsed semantic tokens, allocation reuse per thread (highlighters may be shared)
+struct semantic_token_buffer
+{
+	~semantic_token_buffer()
+	{
+		total_bytes.fetch_sub(counted_bytes, std::memory_order_relaxed);
+	}
+
+	// after a run, with the policy of its highlighter
+	void trim(const utility::retention_policy& retention)
+	{
+		if (tracker.should_release(retention, tokens.size() * sizeof(clangd::semantic_token), utility::heap_bytes(tokens)))
+			utility::release_memory(tokens);
+
+		const std::size_t bytes = utility::heap_bytes(tokens);
+		total_bytes.fetch_add(bytes - counted_bytes, std::memory_order_relaxed);
+		counted_bytes = bytes;
+	}
+
+	// all threads
+	static inline std::atomic<std::size_t> total_bytes = 0;
+
+	std::vector<clangd::semantic_token> tokens;
+	utility::retention_tracker tracker;
+	std::size_t counted_bytes = 0;
+};
+
+py::object run_clangd_highlighter(
 	const clangd_highlighter& chl,
-	std::string_view code,
+	const text_input& code,
 	const py::list& list_semantic_tokens,
 	std::string_view table_wrap_css_class,
 	int color_variants,
-	bool highlight_printf_formatting)
+	bool highlight_printf_formatting,
+	bool coalesce_spans,
+	std::string_view whitespace_insensitive_css_classes,
+	web::css_class_map* class_map,
+	std::string_view compress,
+	int compress_level,
+	std::string_view output_type_name)
 {
-	chl.semantic_tokens.clear();
-	chl.semantic_tokens.reserve(list_semantic_tokens.size());
+	thread_local semantic_token_buffer buffer;
+	std::vector<clangd::semantic_token>& semantic_tokens = buffer.tokens;
+	parse_semantic_tokens(chl.decoder, list_semantic_tokens, semantic_tokens);
 
-	for (const auto& token : list_semantic_tokens) {
-		chl.semantic_tokens.push_back(clangd::semantic_token{
-			text::position{
-				token.attr("line").cast<std::size_t>(),
-				token.attr("column").cast<std::size_t>()
-			},
-			token.attr("length").cast<std::size_t>(),
-			get_semantic_token_info(chl.decoder, token),
-			clangd::semantic_token_color_variance{
-				token.attr("color_variant").cast<int>(),
-				token.attr("last_reference").cast<bool>()
-			}
+	const clangd::highlighter_options options{
+		table_wrap_css_class,
+		color_variants,
+		highlight_printf_formatting,
+		coalesce_spans,
+		whitespace_insensitive_css_classes,
+		class_map
+	};
+
+	py::object result = run_with_output(compress, compress_level, output_type_name, [&](web::output_sink& output) {
+		// scratch memory of the highlighter is per run (see clangd::highlighter)
+		const std::optional<clangd::highlighter_error> maybe_error = without_gil(class_map, [&]() {
+			return chl.hl.run(
+				code.view(),
+				{semantic_tokens.data(), semantic_tokens.data() + semantic_tokens.size()},
+				output,
+				options);
 		});
+
+		if (maybe_error)
+			throw std::runtime_error(to_string(*maybe_error));
+	});
+	buffer.trim(chl.retention);
+	return result;
+}
+
+py::list run_clangd_highlighter_many(
+	const clangd_highlighter& chl,
+	const py::sequence& jobs,
+	std::string_view table_wrap_css_class,
+	int color_variants,
+	bool highlight_printf_formatting,
+	bool coalesce_spans,
+	std::string_view whitespace_insensitive_css_classes,
+	web::css_class_map* class_map,
+	std::string_view compress,
+	int compress_level,
+	std::string_view output_type_name)
+{
+	const clangd::highlighter_options options{
+		table_wrap_css_class,
+		color_variants,
+		highlight_printf_formatting,
+		coalesce_spans,
+		whitespace_insensitive_css_classes,
+		class_map
+	};
+
+	const batch_compression compression = parse_batch_compression(compress, compress_level);
+	const output_type type = parse_output_type(output_type_name);
+
+	// converted under the GIL, objects are kept alive (views) while it is released
+	std::vector<py::object> objects;
+	std::vector<text_input> codes;
+	std::vector<std::vector<clangd::semantic_token>> semantic_tokens(jobs.size());
+	objects.reserve(jobs.size());
+	codes.reserve(jobs.size());
+	for (const auto& job : jobs) {
+		const py::sequence pair = get_job_pair(job, "each job should be a pair (code, semantic_tokens)");
+		parse_semantic_tokens(chl.decoder, pair[1].cast<py::list>(), semantic_tokens[codes.size()]);
+		objects.push_back(pair[0]);
+		codes.push_back(load_text_input(objects.back()));
 	}
 
-	const std::variant<std::string, clangd::highlighter_error> result = chl.hl.run(
-		code,
-		{chl.semantic_tokens.data(), chl.semantic_tokens.data() + chl.semantic_tokens.size()},
-		clangd::highlighter_options{table_wrap_css_class, color_variants, highlight_printf_formatting});
+	std::vector<batch_result> results(codes.size());
+	run_batch(codes.size(), class_map == nullptr,
+		[]() { return clangd::highlighter_context(); },
+		[&](clangd::highlighter_context& context, std::size_t i) {
+			run_batch_job(compression, results[i], [&](web::output_sink& output) -> std::string {
+				const std::vector<clangd::semantic_token>& tokens = semantic_tokens[i];
+				const std::optional<clangd::highlighter_error> maybe_error = chl.hl.run(
+					context, codes[i].view(), {tokens.data(), tokens.data() + tokens.size()}, output, options);
 
-	return std::visit(utility::visitor{
-		[](const std::string& output) {
-			return py::str(output);
-		},
-		[](clangd::highlighter_error error) -> py::str {
-			throw std::runtime_error(to_string(error));
-		}
-	}, result);
+				if (maybe_error)
+					return to_string(*maybe_error);
+
+				return {};
+			});
+		});
+
+	return to_py_list(results, compression, type);
+}
+
+struct clangd_async_inputs
+{
+	py::object highlighter;
+	py::object code_object;
+	text_input code;
+	std::vector<clangd::semantic_token> semantic_tokens;
+	// options own their strings, views are made by the worker
+	std::string table_wrap_css_class;
+	std::string whitespace_insensitive_css_classes;
+	clangd::highlighter_options options;
+};
+
+py::object run_clangd_highlighter_async(
+	const py::object& self,
+	const py::object& code,
+	const py::list& list_semantic_tokens,
+	std::string_view table_wrap_css_class,
+	int color_variants,
+	bool highlight_printf_formatting,
+	bool coalesce_spans,
+	std::string_view whitespace_insensitive_css_classes,
+	std::string_view compress,
+	int compress_level,
+	std::string_view output_type_name)
+{
+	const clangd_highlighter& chl = self.cast<const clangd_highlighter&>();
+	const batch_compression compression = parse_batch_compression(compress, compress_level);
+	const output_type type = parse_output_type(output_type_name);
+
+	clangd_async_inputs inputs{self, code, load_text_input(code), {},
+		std::string(table_wrap_css_class), std::string(whitespace_insensitive_css_classes), {}};
+	parse_semantic_tokens(chl.decoder, list_semantic_tokens, inputs.semantic_tokens);
+	inputs.options.color_variants = color_variants;
+	inputs.options.highlight_printf_formatting = highlight_printf_formatting;
+	inputs.options.coalesce_spans = coalesce_spans;
+
+	return submit_async(std::move(inputs), compression, type,
+		[hl = &chl.hl](const clangd_async_inputs& inputs, const utility::cancellation_token& token, web::output_sink& output) -> std::string {
+			clangd::highlighter_options options = inputs.options;
+			options.table_wrap_css_class = inputs.table_wrap_css_class;
+			options.whitespace_insensitive_css_classes = inputs.whitespace_insensitive_css_classes;
+			options.cancellation.token = &token;
+
+			const std::vector<clangd::semantic_token>& tokens = inputs.semantic_tokens;
+			const std::optional<clangd::highlighter_error> maybe_error = hl->run(
+				inputs.code.view(), {tokens.data(), tokens.data() + tokens.size()}, output, options);
+
+			if (maybe_error)
+				return to_string(*maybe_error);
+
+			return {};
+		});
 }
 
 }
 }
 
+namespace pybind11::detail {
+
+// code and color arguments: str or bytes-like, see text_input
+template <>
+struct type_caster<ach::bind::text_input>
+{
+#if PYBIND11_VERSION_HEX >= 0x02090000
+	PYBIND11_TYPE_CASTER(ach::bind::text_input, const_name("Union[str, bytes]"));
+#else
+	PYBIND11_TYPE_CASTER(ach::bind::text_input, _("Union[str, bytes]"));
+#endif
+
+	bool load(handle src, bool /* convert */)
+	{
+		return value.load(src);
+	}
+};
+
+}
+
 PYBIND11_MODULE(pyach, m) {
 	m.doc() = ach::utility::program_description;
 
@@ -237,19 +1115,202 @@ PYBIND11_MODULE(pyach, m) {
 		py::arg("empty_token_char") = ach::mirror::color_options::default_empty_token_char,
 		py::arg("table_wrap_css_class") = "",
 		py::arg("valid_css_classes")    = "",
-		py::arg("replace") = false);
+		py::arg("valid_css_class_set")  = nullptr,
+		py::arg("replace") = false,
+		py::arg("coalesce_spans") = false,
+		py::arg("whitespace_insensitive_css_classes") = "",
+		py::arg("class_map") = nullptr,
+		py::arg("program_cache") = nullptr,
+		py::arg("compress") = "",
+		py::arg("compress_level") = -1,
+		py::arg("output_type") = "str");
+
+	// jobs: sequence of (code, color) pairs, returns a list of results or RuntimeError objects
+	m.def("run_mirror_many", &ach::bind::run_mirror_highlighter_many,
+		py::arg("jobs").none(false),
+		py::arg("num_keyword")      = ach::mirror::color_options::default_num_keyword,
+		py::arg("str_keyword")      = ach::mirror::color_options::default_str_keyword,
+		py::arg("chr_keyword")      = ach::mirror::color_options::default_chr_keyword,
+		py::arg("num_class")        = ach::mirror::color_options::default_num_class,
+		py::arg("str_class")        = ach::mirror::color_options::default_str_class,
+		py::arg("str_esc_class")    = ach::mirror::color_options::default_str_esc_class,
+		py::arg("chr_class")        = ach::mirror::color_options::default_chr_class,
+		py::arg("chr_esc_class")    = ach::mirror::color_options::default_chr_esc_class,
+		py::arg("escape_char")      = ach::mirror::color_options::default_escape_char,
+		py::arg("empty_token_char") = ach::mirror::color_options::default_empty_token_char,
+		py::arg("table_wrap_css_class") = "",
+		py::arg("valid_css_classes")    = "",
+		py::arg("valid_css_class_set")  = nullptr,
+		py::arg("replace") = false,
+		py::arg("coalesce_spans") = false,
+		py::arg("whitespace_insensitive_css_classes") = "",
+		py::arg("class_map") = nullptr,
+		py::arg("program_cache") = nullptr,
+		py::arg("compress") = "",
+		py::arg("compress_level") = -1,
+		py::arg("output_type") = "str");
+
+	// same options as run_mirror_highlighter, objects referenced by options are kept alive
+	py::class_<ach::mirror::highlighter>(m, "MirrorHighlighter")
+		.def(py::init(&ach::bind::make_mirror_highlighter),
+			py::keep_alive<1, 14>(),
+			py::keep_alive<1, 18>(),
+			py::keep_alive<1, 19>(),
+			py::arg("num_keyword")      = ach::mirror::color_options::default_num_keyword,
+			py::arg("str_keyword")      = ach::mirror::color_options::default_str_keyword,
+			py::arg("chr_keyword")      = ach::mirror::color_options::default_chr_keyword,
+			py::arg("num_class")        = ach::mirror::color_options::default_num_class,
+			py::arg("str_class")        = ach::mirror::color_options::default_str_class,
+			py::arg("str_esc_class")    = ach::mirror::color_options::default_str_esc_class,
+			py::arg("chr_class")        = ach::mirror::color_options::default_chr_class,
+			py::arg("chr_esc_class")    = ach::mirror::color_options::default_chr_esc_class,
+			py::arg("escape_char")      = ach::mirror::color_options::default_escape_char,
+			py::arg("empty_token_char") = ach::mirror::color_options::default_empty_token_char,
+			py::arg("table_wrap_css_class") = "",
+			py::arg("valid_css_classes")    = "",
+			py::arg("valid_css_class_set")  = nullptr,
+			py::arg("replace") = false,
+			py::arg("coalesce_spans") = false,
+			py::arg("whitespace_insensitive_css_classes") = "",
+			py::arg("class_map") = nullptr,
+			py::arg("program_cache") = nullptr,
+			// retention policy of reused memory, see utility::retention_policy
+			py::arg("max_retained_bytes") = 0,
+			py::arg("decay_after_runs") = 0)
+		.def("run", &ach::bind::run_mirror_highlighter_object,
+			py::arg("code").none(false),
+			py::arg("color").none(false),
+			py::arg("compress") = "",
+			py::arg("compress_level") = -1,
+			py::arg("output_type") = "str")
+		// awaitable, see submit_async (class map is not allowed)
+		.def("run_async", &ach::bind::run_mirror_highlighter_async,
+			py::arg("code").none(false),
+			py::arg("color").none(false),
+			py::arg("compress") = "",
+			py::arg("compress_level") = -1,
+			py::arg("output_type") = "str")
+		.def("num_coalesced_bytes", &ach::mirror::highlighter::num_coalesced_bytes)
+		.def("retained_bytes", &ach::mirror::highlighter::retained_bytes)
+		.def("release_memory", &ach::mirror::highlighter::release_memory);
+
+	// immutable from Python: runs read it without the GIL (see without_gil)
+	py::class_<ach::web::css_class_set>(m, "CssClassSet")
+		.def(py::init<>())
+		.def(py::init<std::string_view>(), py::arg("classes").none(false))
+		.def("__contains__", &ach::web::css_class_set::contains)
+		.def("__len__", &ach::web::css_class_set::size);
+
+	py::class_<ach::mirror::color_program_cache>(m, "ColorProgramCache")
+		.def(py::init<std::size_t>(), py::arg("capacity") = ach::mirror::color_program_cache::default_capacity)
+		.def("clear", &ach::mirror::color_program_cache::clear)
+		.def("capacity", &ach::mirror::color_program_cache::capacity)
+		.def("hits", &ach::mirror::color_program_cache::hits)
+		.def("misses", &ach::mirror::color_program_cache::misses)
+		.def("__len__", &ach::mirror::color_program_cache::size);
+
+	py::class_<ach::web::css_class_map>(m, "CssClassMap")
+		.def(py::init<>())
+		.def("short_name", [](ach::web::css_class_map& map, std::string_view classes) {
+			return std::string(map.short_name(classes));
+		}, py::arg("classes").none(false))
+		.def("entries", [](const ach::web::css_class_map& map) {
+			py::list result;
+			for (const auto& entry : map.entries())
+				result.append(py::make_tuple(entry.short_name, entry.classes));
+			return result;
+		})
+		.def("__len__", &ach::web::css_class_map::size);
+
+	m.def("make_clangd_css_class_map", &ach::clangd::make_css_class_map);
+
+	// output_type="buffer": read-only view of owned output (bytes(), memoryview(), file.write())
+	py::class_<ach::bind::output_buffer>(m, "OutputBuffer", py::buffer_protocol())
+		.def_buffer([](ach::bind::output_buffer& buffer) {
+			return py::buffer_info(
+				buffer.data.data(),
+				sizeof(char),
+				py::format_descriptor<unsigned char>::format(),
+				1,
+				{buffer.data.size()},
+				{sizeof(char)},
+				true);
+		})
+		.def("__len__", [](const ach::bind::output_buffer& buffer) { return buffer.data.size(); });
 
 	py::class_<ach::bind::clangd_highlighter>(m, "ClangdHighlighter")
 		.def(py::init(&ach::bind::make_clangd_highlighter),
 			py::arg("semantic_token_types").none(false),
 			py::arg("semantic_token_modifiers").none(false),
-			py::arg("keywords").none(false))
+			py::arg("keywords").none(false),
+			py::arg("max_retained_bytes") = 0,
+			py::arg("decay_after_runs") = 0)
 		.def("run", &ach::bind::run_clangd_highlighter,
 			py::arg("code").none(false),
 			py::arg("semantic_tokens").none(false),
 			py::arg("table_wrap_css_class") = "",
 			py::arg("color_variants") = ach::clangd::highlighter_options{}.color_variants,
-			py::arg("highlight_printf_formatting") = ach::clangd::highlighter_options{}.highlight_printf_formatting);
+			py::arg("highlight_printf_formatting") = ach::clangd::highlighter_options{}.highlight_printf_formatting,
+			py::arg("coalesce_spans") = ach::clangd::highlighter_options{}.coalesce_spans,
+			py::arg("whitespace_insensitive_css_classes") = "",
+			py::arg("class_map") = nullptr,
+			py::arg("compress") = "",
+			py::arg("compress_level") = -1,
+			py::arg("output_type") = "str")
+		// jobs: sequence of (code, semantic_tokens) pairs, returns a list of results or RuntimeError objects
+		.def("highlight_many", &ach::bind::run_clangd_highlighter_many,
+			py::arg("jobs").none(false),
+			py::arg("table_wrap_css_class") = "",
+			py::arg("color_variants") = ach::clangd::highlighter_options{}.color_variants,
+			py::arg("highlight_printf_formatting") = ach::clangd::highlighter_options{}.highlight_printf_formatting,
+			py::arg("coalesce_spans") = ach::clangd::highlighter_options{}.coalesce_spans,
+			py::arg("whitespace_insensitive_css_classes") = "",
+			py::arg("class_map") = nullptr,
+			py::arg("compress") = "",
+			py::arg("compress_level") = -1,
+			py::arg("output_type") = "str")
+		// awaitable, see submit_async (class map is not allowed)
+		.def("run_async", &ach::bind::run_clangd_highlighter_async,
+			py::arg("code").none(false),
+			py::arg("semantic_tokens").none(false),
+			py::arg("table_wrap_css_class") = "",
+			py::arg("color_variants") = ach::clangd::highlighter_options{}.color_variants,
+			py::arg("highlight_printf_formatting") = ach::clangd::highlighter_options{}.highlight_printf_formatting,
+			py::arg("coalesce_spans") = ach::clangd::highlighter_options{}.coalesce_spans,
+			py::arg("whitespace_insensitive_css_classes") = "",
+			py::arg("compress") = "",
+			py::arg("compress_level") = -1,
+			py::arg("output_type") = "str")
+		.def("num_coalesced_bytes", [](const ach::bind::clangd_highlighter& chl) {
+			return chl.hl.num_coalesced_bytes();
+		})
+		// memory of pooled scratch contexts (semantic token buffers: see semantic_token_buffer_bytes)
+		.def("retained_bytes", [](const ach::bind::clangd_highlighter& chl) {
+			return chl.hl.retained_bytes();
+		});
+
+	// parsed semantic tokens kept by all threads (shared by clangd highlighters)
+	m.def("semantic_token_buffer_bytes", []() {
+		return ach::bind::semantic_token_buffer::total_bytes.load(std::memory_order_relaxed);
+	});
+
+	py::register_exception<ach::bind::async_queue_full>(m, "QueueFullError", PyExc_RuntimeError);
+
+	// jobs submitted by run_async and not yet finished
+	m.def("async_queue_size", []() { return ach::bind::async_queue_size.load(); });
+	m.def("async_queue_limit", []() { return ach::bind::async_queue_limit.load(); });
+	m.def("set_async_queue_limit", [](std::size_t limit) {
+		if (limit == 0)
+			throw py::value_error("argument 'limit' should be positive");
+
+		ach::bind::async_queue_limit = limit;
+	}, py::arg("limit"));
+
+#ifdef ACH_HAVE_ZLIB
+	m.attr("has_compression") = true;
+#else
+	m.attr("has_compression") = false;
+#endif
 
 	m.def("version", []() {
 		namespace av = ach::utility::version;
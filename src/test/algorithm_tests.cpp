@@ -1,10 +1,13 @@
 #include <ach/utility/algorithm.hpp>
+#include <ach/utility/object_pool.hpp>
 #include <ach/text/utils.hpp>
 
 #include <boost/test/tools/interface.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include <cstddef>
+#include <memory>
+#include <string>
 #include <string_view>
 
 using namespace ach;
@@ -82,3 +85,28 @@ BOOST_AUTO_TEST_SUITE(algorithm_search_whole_word)
 	}
 
 BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(utility_object_pool)
+
+	BOOST_AUTO_TEST_CASE(reuse)
+	{
+		utility::object_pool<std::string> pool(2);
+		BOOST_TEST(pool.size() == 0u);
+
+		{
+			utility::object_pool<std::string>::lease a(pool);
+			utility::object_pool<std::string>::lease b(pool);
+			utility::object_pool<std::string>::lease c(pool);
+			a->assign("a");
+		}
+
+		// third one did not fit
+		BOOST_TEST(pool.size() == 2u);
+
+		std::unique_ptr<std::string> object = pool.acquire();
+		BOOST_TEST(pool.size() == 1u);
+		pool.release(std::move(object));
+		BOOST_TEST(pool.size() == 2u);
+	}
+
+BOOST_AUTO_TEST_SUITE_END()
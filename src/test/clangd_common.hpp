@@ -118,7 +118,7 @@ const std::initializer_list<std::string> keywords = {
 };
 
 [[nodiscard]] inline boost::test_tools::assertion_result
-fill_with_tokens(std::string_view code, std::vector<code_token>& code_tokens)
+fill_with_tokens(std::string_view code, std::pmr::vector<code_token>& code_tokens)
 {
 	std::optional<highlighter_error> maybe_error =
 		code_tokenizer(code, {keywords.begin(), keywords.end()})
@@ -133,7 +133,7 @@ fill_with_tokens(std::string_view code, std::vector<code_token>& code_tokens)
 	return true;
 }
 
-inline void print_code_tokens(std::ostream& os, const std::vector<code_token>& code_tokens)
+inline void print_code_tokens(std::ostream& os, const std::pmr::vector<code_token>& code_tokens)
 {
 	os << "CODE TOKENS:\n";
 	int i = 0;
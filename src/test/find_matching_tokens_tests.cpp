@@ -100,7 +100,7 @@ bool is_match_correct(utility::range<code_token*> result, code_token_match expec
 	code_token_match expected_result)
 {
 	// tokenization - should always succeed
-	std::vector<code_token> code_tokens;
+	std::pmr::vector<code_token> code_tokens;
 	if (!fill_with_tokens(code, code_tokens))
 		return false;
 
@@ -168,7 +168,7 @@ void test_find_matching_tokens_negative(
 	text::position start,
 	text::position stop)
 {
-	std::vector<code_token> code_tokens;
+	std::pmr::vector<code_token> code_tokens;
 	if (!fill_with_tokens(code, code_tokens)) {
 		BOOST_ERROR("");
 		return;
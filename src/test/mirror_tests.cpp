@@ -1,10 +1,39 @@
+#include <ach/batch/core.hpp>
+#include <ach/batch/queue.hpp>
 #include <ach/mirror/core.hpp>
+#include <ach/mirror/color_program.hpp>
+#include <ach/mirror/document.hpp>
 #include <ach/mirror/errors.hpp>
+#include <ach/text/line_source.hpp>
 #include <ach/text/types.hpp>
+#include <ach/utility/retention.hpp>
+#include <ach/utility/thread_pool.hpp>
+#include <ach/web/css_class_map.hpp>
+#include <ach/web/css_class_set.hpp>
+#include <ach/web/deflate_sink.hpp>
+#include <ach/web/output_sink.hpp>
+#include <ach/web/segment_list.hpp>
 
 #include <boost/test/unit_test.hpp>
 
+#ifdef ACH_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifndef _WIN32
+#include <cstdio>
+#endif
+
+#include <chrono>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <string>
 #include <string_view>
+#include <vector>
 #include <ostream>
 #include <algorithm>
 
@@ -345,6 +374,700 @@ BOOST_AUTO_TEST_SUITE(highlighter_positive)
 			mirror::generation_options{true}));
 	}
 
+	BOOST_AUTO_TEST_CASE(coalesce_spans_adjacent)
+	{
+		mirror::generation_options gen_options;
+		gen_options.coalesce_spans = true;
+		BOOST_TEST(run_and_compare(
+			"onetwo three+four",
+			"3val3val val+val",
+			"<span class=\"val\">onetwo</span> <span class=\"val\">three</span>+<span class=\"val\">four</span>",
+			gen_options));
+	}
+
+	BOOST_AUTO_TEST_CASE(coalesce_spans_across_whitespace)
+	{
+		mirror::generation_options gen_options;
+		gen_options.coalesce_spans = true;
+		gen_options.whitespace_insensitive_css_classes = "keyword;type";
+		BOOST_TEST(run_and_compare(
+			"unsigned long long x\n\tconst int y",
+			"keyword keyword keyword var\n\tkeyword type var",
+			"<span class=\"keyword\">unsigned long long</span> <span class=\"var\">x</span>\n"
+			"\t<span class=\"keyword\">const</span> <span class=\"type\">int</span> <span class=\"var\">y</span>",
+			gen_options));
+	}
+
+	BOOST_AUTO_TEST_CASE(coalesce_spans_quoted)
+	{
+		mirror::generation_options gen_options;
+		gen_options.coalesce_spans = true;
+		BOOST_TEST(run_and_compare(
+			R"("a\nb"0str_esc)",
+			"str0str_esc",
+			"<span class=\"str\">\"a<span class=\"str_esc\">\\n</span>b\"</span><span class=\"str_esc\">0str_esc</span>",
+			gen_options));
+	}
+
+	BOOST_AUTO_TEST_CASE(coalesce_spans_stats)
+	{
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.coalesce_spans = true;
+		mirror::generation_stats stats;
+		const auto output = run_highlighter("a b c", "val val val", options, stats);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(output));
+		BOOST_TEST(std::get<std::string>(output) == "<span class=\"val\">a</span> <span class=\"val\">b</span> <span class=\"val\">c</span>");
+		BOOST_TEST(stats.coalesced_bytes == 0u);
+
+		options.generation.whitespace_insensitive_css_classes = "val";
+		const auto coalesced_output = run_highlighter("a b c", "val val val", options, stats);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(coalesced_output));
+		BOOST_TEST(std::get<std::string>(coalesced_output) == "<span class=\"val\">a b c</span>");
+		BOOST_TEST(stats.coalesced_bytes == 2u * (std::string_view("</span><span class=\"val\">").size()));
+	}
+
+	BOOST_AUTO_TEST_CASE(compact_classes)
+	{
+		web::css_class_map class_map;
+		mirror::generation_options gen_options;
+		gen_options.replace_underscores_to_hyphens = true;
+		gen_options.class_map = &class_map;
+		BOOST_TEST(run_and_compare(
+			"int x = \"a\\n\" + y;",
+			"key_word var = str + var;",
+			"<span class=\"a\">int</span> <span class=\"b\">x</span> = "
+			"<span class=\"c\">\"a<span class=\"d\">\\n</span>\"</span> + <span class=\"b\">y</span>;",
+			gen_options));
+
+		BOOST_TEST_REQUIRE(class_map.size() == 4u);
+		BOOST_TEST(class_map.entries()[0].classes == "key-word");
+		BOOST_TEST(class_map.entries()[1].classes == "var");
+		BOOST_TEST(class_map.entries()[2].classes == "str");
+		BOOST_TEST(class_map.entries()[3].classes == "str-esc");
+	}
+
+	BOOST_AUTO_TEST_CASE(segment_output)
+	{
+		const std::string_view code = "int x = \"a\\n\" + y; // <comment>\nfoo bar";
+		const std::string_view color = "keyword var = str + var; 0com\nkey_word var";
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.replace_underscores_to_hyphens = true;
+		options.generation.table_wrap_css_class = "cpp";
+
+		const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+		web::segment_list output;
+		const std::optional<mirror::highlighter_error> maybe_error = run_highlighter(code, color, output, options);
+		BOOST_TEST_REQUIRE(!maybe_error.has_value());
+		BOOST_TEST(output.str() == std::get<std::string>(expected));
+		BOOST_TEST(output.size() == std::get<std::string>(expected).size());
+
+		// unescaped code fragments should be referenced, not copied
+		const auto points_to_code = [&](web::segment s) {
+			return std::less_equal<const char*>()(code.data(), s.data)
+				&& std::less_equal<const char*>()(s.data + s.size, code.data() + code.size());
+		};
+		BOOST_TEST(std::any_of(output.segments().begin(), output.segments().end(), points_to_code));
+	}
+
+	BOOST_AUTO_TEST_CASE(streaming_output)
+	{
+		const std::string_view code = "int x = \"a\\n\" + y; // <comment>\nfoo bar";
+		const std::string_view color = "keyword var = str + var; 0com\nkey_word var";
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.table_wrap_css_class = "cpp";
+
+		const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+		constexpr std::size_t chunk_size = 32;
+		std::vector<std::string> chunks;
+		web::callback_sink sink([&](std::string_view chunk) { chunks.emplace_back(chunk); }, chunk_size);
+		const std::optional<mirror::highlighter_error> maybe_error = run_highlighter(code, color, sink, options);
+		BOOST_TEST_REQUIRE(!maybe_error.has_value());
+
+		// text longer than the chunk size may be delivered unsplit
+		std::string output;
+		for (const std::string& chunk : chunks)
+			output += chunk;
+
+		BOOST_TEST(chunks.size() > 1u);
+		BOOST_TEST(output == std::get<std::string>(expected));
+	}
+
+	BOOST_AUTO_TEST_CASE(line_streaming)
+	{
+		std::string code;
+		std::string color;
+		for (int i = 0; i < 50; ++i) {
+			code += "int x = \"a\\n\" + y; // <comment>\n";
+			color += "keyword var = str + var; 0com\n";
+		}
+		// no line feed at the end
+		code += "foo  bar";
+		color += "func  func";
+
+		mirror::color_program_cache cache;
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		for (bool coalesce_spans : {false, true}) {
+			options.generation.coalesce_spans = coalesce_spans;
+			options.generation.whitespace_insensitive_css_classes = "func";
+			options.generation.program_cache = nullptr;
+
+			const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+			BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+			// lines are not put into the cache
+			options.generation.program_cache = &cache;
+
+			// segment list references stable text - line buffers must not be referenced
+			std::istringstream code_stream(code);
+			std::istringstream color_stream(color);
+			text::istream_line_source code_source(code_stream);
+			text::istream_line_source color_source(color_stream);
+			web::segment_list segments;
+			mirror::highlighter hl(options);
+			const std::optional<mirror::highlighter_error> maybe_error = hl.run(code_source, color_source, segments);
+			BOOST_TEST_REQUIRE(!maybe_error.has_value());
+			BOOST_TEST(segments.str() == std::get<std::string>(expected));
+			BOOST_TEST(cache.size() == 0u);
+		}
+	}
+
+#ifndef _WIN32
+	BOOST_AUTO_TEST_CASE(line_streaming_fd)
+	{
+		std::string code;
+		std::string color;
+		for (int i = 0; i < 200; ++i) {
+			code += "int x = \"a\\n\" + y; // <comment>\n";
+			color += "keyword var = str + var; 0com\n";
+		}
+
+		const auto make_file = [](std::string_view contents) {
+			std::FILE* file = std::tmpfile();
+			BOOST_TEST_REQUIRE(file != nullptr);
+			BOOST_TEST_REQUIRE(std::fwrite(contents.data(), 1, contents.size(), file) == contents.size());
+			std::fflush(file);
+			std::rewind(file);
+			return file;
+		};
+
+		std::FILE* const code_file = make_file(code);
+		std::FILE* const color_file = make_file(color);
+
+		// buffers smaller than lines
+		text::fd_line_source code_source(fileno(code_file), 7);
+		text::fd_line_source color_source(fileno(color_file), 13);
+		std::string output;
+		web::string_sink sink(output);
+		mirror::highlighter hl(mirror::highlighter_options{{}, get_test_color_options()});
+		const std::optional<mirror::highlighter_error> maybe_error = hl.run(code_source, color_source, sink);
+		std::fclose(code_file);
+		std::fclose(color_file);
+
+		const std::variant<std::string, mirror::highlighter_error> expected =
+			run_highlighter(code, color, mirror::highlighter_options{{}, get_test_color_options()});
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+		BOOST_TEST_REQUIRE(!maybe_error.has_value());
+		BOOST_TEST(!code_source.error());
+		BOOST_TEST(output == std::get<std::string>(expected));
+	}
+#endif
+
+	BOOST_AUTO_TEST_CASE(valid_css_class_set)
+	{
+		const web::css_class_set valid_classes("keyword, param\nnum str-esc");
+		BOOST_TEST(valid_classes.size() == 4u);
+		BOOST_TEST(valid_classes.contains("str-esc"));
+		BOOST_TEST(!valid_classes.contains("str"));
+
+		mirror::generation_options gen_options;
+		gen_options.valid_css_class_set = &valid_classes;
+		BOOST_TEST(run_and_compare(
+			"one+two",
+			"keyword+param",
+			"<span class=\"keyword\">one</span>+<span class=\"param\">two</span>",
+			gen_options));
+	}
+
+	BOOST_AUTO_TEST_CASE(highlighter_reuse)
+	{
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.replace_underscores_to_hyphens = true;
+		options.generation.valid_css_classes = "key_word var str str_esc";
+
+		std::optional<mirror::highlighter> hl;
+		{
+			// options are copied, temporary strings do not need to outlive the highlighter
+			const std::string table_class = "cpp";
+			options.generation.table_wrap_css_class = table_class;
+			hl.emplace(options);
+		}
+		options.generation.table_wrap_css_class = "cpp";
+
+		const std::pair<std::string_view, std::string_view> inputs[] = {
+			{"int x = \"a\\n\";", "key_word var = str;"},
+			{"y", "var"},
+			{"x", "invalid_class"},
+			{"foo(bar);", "var(var);"}
+		};
+
+		for (int i = 0; i < 2; ++i) {
+			for (auto [code, color] : inputs) {
+				const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+				const std::variant<std::string_view, mirror::highlighter_error> output = hl->run(code, color);
+				BOOST_TEST_REQUIRE(expected.index() == output.index());
+
+				if (const auto ptr = std::get_if<std::string>(&expected); ptr != nullptr)
+					BOOST_TEST(*ptr == std::get<std::string_view>(output));
+				else
+					BOOST_TEST(std::get<mirror::highlighter_error>(expected).extra_reason
+						== std::get<mirror::highlighter_error>(output).extra_reason);
+			}
+		}
+
+		mirror::highlighter moved = std::move(*hl);
+		const std::variant<std::string_view, mirror::highlighter_error> output = moved.run("y", "var");
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(output));
+		BOOST_TEST(moved.options().generation.table_wrap_css_class == "cpp");
+	}
+
+	BOOST_AUTO_TEST_CASE(line_parallel)
+	{
+		std::string code;
+		std::string color;
+		for (int i = 0; i < 100; ++i) {
+			code += "int x = \"a\\n\" + y; // <comment>\n";
+			color += "keyword var = str + var; 0com\n";
+		}
+		// no line feed at the end
+		code += "foo";
+		color += "func";
+
+		utility::thread_pool pool(4);
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.table_wrap_css_class = "cpp";
+
+		const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+		for (std::size_t lines_per_batch : {1u, 7u, 50u, 1000u}) {
+			const std::variant<std::string, mirror::highlighter_error> output =
+				run_highlighter(code, color, options, pool, lines_per_batch);
+			BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(output));
+			BOOST_TEST(std::get<std::string>(output) == std::get<std::string>(expected));
+		}
+
+		// single-use batch programs are not cached
+		mirror::color_program_cache cache;
+		options.generation.program_cache = &cache;
+		const std::variant<std::string, mirror::highlighter_error> cached_output =
+			run_highlighter(code, color, options, pool, 7);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(cached_output));
+		BOOST_TEST(std::get<std::string>(cached_output) == std::get<std::string>(expected));
+		BOOST_TEST(cache.size() == 0u);
+	}
+
+	BOOST_AUTO_TEST_CASE(line_parallel_from_pool_task)
+	{
+		std::string code;
+		std::string color;
+		for (int i = 0; i < 100; ++i) {
+			code += "int x = \"a\\n\" + y; // <comment>\n";
+			color += "keyword var = str + var; 0com\n";
+		}
+
+		const mirror::highlighter_options options{{}, get_test_color_options()};
+		const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+		// every worker runs a task that waits for the line-parallel run: helpers can not start
+		utility::thread_pool pool(2);
+		std::vector<std::future<std::variant<std::string, mirror::highlighter_error>>> results;
+		for (std::size_t i = 0; i < pool.num_threads(); ++i)
+			results.push_back(pool.submit([&]() { return run_highlighter(code, color, options, pool, 7); }));
+
+		for (auto& result : results) {
+			const std::variant<std::string, mirror::highlighter_error> output = result.get();
+			BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(output));
+			BOOST_TEST(std::get<std::string>(output) == std::get<std::string>(expected));
+		}
+	}
+
+	BOOST_AUTO_TEST_CASE(batch_split)
+	{
+		std::string code;
+		std::string color;
+		for (int i = 0; i < 100; ++i) {
+			code += "int x = \"a\\n\" + y; // <comment>\n";
+			color += "keyword var = str + var; 0com\n";
+		}
+		code += "foo";
+		color += "func";
+
+		// same but with an invalid class in the middle
+		std::string bad_color = color;
+		bad_color.replace(bad_color.find("0com", bad_color.size() / 2), 4, "0bad");
+
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.table_wrap_css_class = "cpp";
+		options.generation.valid_css_classes = "keyword var str str_esc com func";
+
+		const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+		const std::variant<std::string, mirror::highlighter_error> expected_error = run_highlighter(code, bad_color, options);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+		BOOST_TEST_REQUIRE(std::holds_alternative<mirror::highlighter_error>(expected_error));
+
+		batch::scheduler scheduler(3);
+		batch::batch_options bopts;
+		bopts.split_threshold = 100;
+		bopts.piece_size = 300;
+
+		const std::vector<batch::job> jobs = {
+			batch::mirror_job{code, color, &options},
+			batch::mirror_job{"int", "keyword", &options}, // too small to split
+			batch::mirror_job{code, bad_color, &options}
+		};
+		const std::vector<batch::job_result> results = scheduler.run(jobs, bopts);
+		BOOST_TEST_REQUIRE(results.size() == 3u);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(results[0]));
+		BOOST_TEST(std::get<std::string>(results[0]) == std::get<std::string>(expected));
+		BOOST_TEST(std::holds_alternative<std::string>(results[1]));
+
+		// error of a piece refers to lines of the whole job
+		BOOST_TEST_REQUIRE(std::holds_alternative<mirror::highlighter_error>(results[2]));
+		const auto& error = std::get<mirror::highlighter_error>(results[2]);
+		const auto& reference = std::get<mirror::highlighter_error>(expected_error);
+		BOOST_TEST(error.reason == reference.reason);
+		BOOST_TEST(error.extra_reason == reference.extra_reason);
+		BOOST_TEST(error.color_location.span().line == reference.color_location.span().line);
+		BOOST_TEST(error.code_location.span().line == reference.code_location.span().line);
+
+		const batch::batch_stats stats = scheduler.stats();
+		BOOST_TEST(stats.num_split_jobs == 2u);
+		BOOST_TEST(stats.num_tasks > 3u);
+		BOOST_TEST_REQUIRE(stats.workers.size() == 3u);
+		std::size_t num_tasks = 0;
+		for (std::size_t i = 0; i < stats.workers.size(); ++i) {
+			num_tasks += stats.workers[i].num_tasks;
+			BOOST_TEST(stats.utilization(i) >= 0.0);
+			BOOST_TEST(stats.utilization(i) <= 1.0);
+		}
+		BOOST_TEST(num_tasks == stats.num_tasks);
+
+		// without splitting
+		bopts.split_threshold = 0;
+		const std::vector<batch::job_result> unsplit = scheduler.run(jobs, bopts);
+		BOOST_TEST(std::get<std::string>(unsplit[0]) == std::get<std::string>(expected));
+		BOOST_TEST(scheduler.stats().num_tasks == 3u);
+
+		// single-use piece programs are not cached (runs reset prepared options)
+		mirror::color_program_cache cache;
+		options.generation.program_cache = &cache;
+		bopts.split_threshold = 100;
+		const std::vector<batch::job_result> cached = scheduler.run({batch::mirror_job{code, color, &options}}, bopts);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(cached[0]));
+		BOOST_TEST(std::get<std::string>(cached[0]) == std::get<std::string>(expected));
+		BOOST_TEST(scheduler.stats().num_split_jobs == 1u);
+		BOOST_TEST(cache.size() == 0u);
+	}
+
+	BOOST_AUTO_TEST_CASE(submission_queue_priorities)
+	{
+		const mirror::highlighter_options options{{}, get_test_color_options()};
+		const std::string expected = std::get<std::string>(run_highlighter("int", "keyword", options));
+		const auto make_job = [&]() { return batch::mirror_job{"int", "keyword", &options}; };
+
+		std::mutex mutex;
+		std::vector<std::string> order;
+		std::vector<std::string> outputs;
+		const auto record = [&](std::string name) {
+			return [&, name](batch::queued_result result) {
+				std::lock_guard<std::mutex> lock(mutex);
+				order.push_back(name);
+				if (auto output = std::get_if<std::string>(&result); output != nullptr)
+					outputs.push_back(*output);
+				else if (std::holds_alternative<batch::deadline_exceeded>(result))
+					outputs.push_back("expired");
+			};
+		};
+
+		const auto now = std::chrono::steady_clock::now();
+		std::promise<void> blocked;
+		std::promise<void> release;
+		std::shared_future<void> released = release.get_future().share();
+		std::future<batch::queued_result> last;
+
+		{
+			batch::submission_queue queue(1);
+			// the only worker is blocked until all other jobs are queued
+			queue.submit(make_job(), {}, [&blocked, released](batch::queued_result) {
+				blocked.set_value();
+				released.wait();
+			});
+			blocked.get_future().wait();
+
+			queue.submit(make_job(), {batch::priority::bulk}, record("bulk 1"));
+			queue.submit(make_job(), {batch::priority::bulk}, record("bulk 2"));
+			queue.submit(make_job(), {batch::priority::bulk, now}, record("bulk expired"));
+			queue.submit(make_job(), {batch::priority::interactive}, record("interactive 1"));
+			queue.submit(make_job(), {batch::priority::interactive, now + std::chrono::hours(1)}, record("interactive deadline"));
+			last = queue.submit(make_job(), {batch::priority::bulk});
+
+			BOOST_TEST(queue.num_queued(batch::priority::interactive) == 2u);
+			release.set_value();
+
+			const batch::queued_result result = last.get();
+			BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(result));
+			BOOST_TEST(std::get<std::string>(result) == expected);
+
+			const batch::queue_stats interactive = queue.stats(batch::priority::interactive);
+			BOOST_TEST(interactive.num_submitted == 2u);
+			BOOST_TEST(interactive.num_completed == 2u);
+			BOOST_TEST(interactive.num_expired == 0u);
+			BOOST_TEST(interactive.recent_delays.size() == 2u);
+			BOOST_TEST(interactive.delay_percentile(1.0).count() == interactive.max_delay.count());
+
+			const batch::queue_stats bulk = queue.stats(batch::priority::bulk);
+			BOOST_TEST(bulk.num_submitted == 5u);
+			BOOST_TEST(bulk.num_expired == 1u);
+			BOOST_TEST(bulk.mean_delay().count() <= bulk.max_delay.count());
+		}
+
+		const std::vector<std::string> expected_order = {
+			"interactive deadline", "interactive 1", "bulk expired", "bulk 1", "bulk 2"
+		};
+		BOOST_TEST(order == expected_order, boost::test_tools::per_element());
+		const std::vector<std::string> expected_outputs = {expected, expected, "expired", expected, expected};
+		BOOST_TEST(outputs == expected_outputs, boost::test_tools::per_element());
+	}
+
+	BOOST_AUTO_TEST_CASE(retention)
+	{
+		const mirror::highlighter_options options{{}, get_test_color_options()};
+		std::string large_code;
+		std::string large_color;
+		for (int i = 0; i < 2000; ++i) {
+			large_code += "int x = 1;\n";
+			large_color += "keyword var = num;\n";
+		}
+		constexpr std::size_t max_retained_bytes = 16 * 1024;
+
+		mirror::highlighter hl(options);
+		hl.set_retention_policy(utility::retention_policy{max_retained_bytes, 0});
+		const std::variant<std::string_view, mirror::highlighter_error> large_output = hl.run(large_code, large_color);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(large_output));
+		// output of the last run is still there
+		BOOST_TEST(std::get<std::string_view>(large_output) == std::get<std::string>(run_highlighter(large_code, large_color, options)));
+		BOOST_TEST(hl.retained_bytes() > max_retained_bytes);
+
+		// trimmed at the start of the next run
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(hl.run("int", "keyword")));
+		BOOST_TEST(hl.retained_bytes() <= max_retained_bytes);
+
+		hl.release_memory();
+		BOOST_TEST(hl.retained_bytes() == 0u);
+
+		// job contexts of the queue apply the policy after each job
+		batch::submission_queue queue(1, 0, utility::retention_policy{max_retained_bytes, 0});
+		const batch::queued_result result = queue.submit(batch::mirror_job{large_code, large_color, &options}).get();
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(result));
+		BOOST_TEST(queue.retained_bytes() <= max_retained_bytes);
+	}
+
+	BOOST_AUTO_TEST_CASE(document_edits)
+	{
+		std::vector<std::string> code_lines;
+		std::vector<std::string> color_lines;
+		for (int i = 0; i < 20; ++i) {
+			code_lines.push_back("int x = \"a\\n\" + y; // <comment>\n");
+			color_lines.push_back("keyword var = str + var; 0com\n");
+		}
+
+		const auto join = [](const std::vector<std::string>& lines) {
+			std::string result;
+			for (const std::string& line : lines)
+				result += line;
+			return result;
+		};
+
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.table_wrap_css_class = "cpp";
+		mirror::document doc(options);
+
+		// every update must give the same output as highlighting whole texts
+		const auto update_and_compare = [&](std::size_t expected_highlighted_lines) {
+			const std::string code = join(code_lines);
+			const std::string color = join(color_lines);
+			const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+			BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+			const std::variant<std::string_view, mirror::highlighter_error> output = doc.update(code, color);
+			BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(output));
+			BOOST_TEST(std::get<std::string_view>(output) == std::get<std::string>(expected));
+			BOOST_TEST(doc.num_highlighted_lines() == expected_highlighted_lines);
+		};
+
+		// all lines and the empty one after the last line feed
+		update_and_compare(21u);
+		update_and_compare(0u);
+
+		code_lines[5] = "x = 1;\n";
+		color_lines[5] = "var = num;\n";
+		update_and_compare(1u);
+
+		// code and color edited in different places, same number of lines
+		code_lines[2] = "a = b;\n";
+		color_lines[2] = "var = var;\n";
+		code_lines[15] = "int x = \"b\" + z; // <comment>\n";
+		update_and_compare(2u);
+
+		// inserted and removed lines change the table
+		code_lines.insert(code_lines.begin() + 10, "foo();\n");
+		color_lines.insert(color_lines.begin() + 10, "func();\n");
+		update_and_compare(1u);
+		code_lines.erase(code_lines.begin());
+		color_lines.erase(color_lines.begin());
+		update_and_compare(0u);
+
+		// no line feed at the end: replaces the empty last line
+		code_lines.push_back("end");
+		color_lines.push_back("var");
+		update_and_compare(1u);
+
+		// options which depend on previous spans: whole texts
+		options.generation.coalesce_spans = true;
+		doc.set_options(options);
+		update_and_compare(21u);
+		BOOST_TEST(doc.num_cached_lines() == 0u);
+	}
+
+	BOOST_AUTO_TEST_CASE(program_cache)
+	{
+		const std::string_view code = "int x = \"a\\n\";";
+		const std::string_view color = "key_word var = str;";
+		mirror::color_program_cache cache(2);
+
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.replace_underscores_to_hyphens = true;
+		const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+		options.generation.program_cache = &cache;
+		for (int i = 0; i < 3; ++i) {
+			const std::variant<std::string, mirror::highlighter_error> output = run_highlighter(code, color, options);
+			BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(output));
+			BOOST_TEST(std::get<std::string>(output) == std::get<std::string>(expected));
+		}
+
+		BOOST_TEST(cache.misses() == 1u);
+		BOOST_TEST(cache.hits() == 2u);
+		BOOST_TEST(cache.size() == 1u);
+
+		// options that affect compilation are a part of the key
+		options.generation.replace_underscores_to_hyphens = false;
+		BOOST_TEST(run_highlighter(code, color, options).index() == 0u);
+		BOOST_TEST(cache.misses() == 2u);
+		BOOST_TEST(cache.size() == 2u);
+
+		// least recently used entry is evicted
+		BOOST_TEST(run_highlighter("x", "var", options).index() == 0u);
+		BOOST_TEST(cache.size() == 2u);
+		options.generation.replace_underscores_to_hyphens = true;
+		BOOST_TEST(run_highlighter(code, color, options).index() == 0u);
+		BOOST_TEST(cache.misses() == 4u);
+	}
+
+	BOOST_AUTO_TEST_CASE(program_hyphenated_whitespace_insensitive_classes)
+	{
+		mirror::color_program_cache cache;
+		mirror::generation_options gen_options;
+		gen_options.replace_underscores_to_hyphens = true;
+		gen_options.coalesce_spans = true;
+		gen_options.whitespace_insensitive_css_classes = "key_word";
+		gen_options.program_cache = &cache;
+		BOOST_TEST(run_and_compare(
+			"const int x",
+			"key_word key_word var",
+			"<span class=\"key-word\">const int</span> <span class=\"var\">x</span>",
+			gen_options));
+	}
+
+#ifdef ACH_HAVE_ZLIB
+	BOOST_AUTO_TEST_CASE(compressed_output)
+	{
+		const std::string_view code = "int x = \"a\\n\" + y; // <comment>\nfoo bar";
+		const std::string_view color = "keyword var = str + var; 0com\nkey_word var";
+		const mirror::highlighter_options options{{}, get_test_color_options()};
+
+		const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+		std::string compressed;
+		web::string_sink destination(compressed);
+		web::deflate_sink sink(destination, web::deflate_format::gzip, web::deflate_sink::default_level, 64);
+		const std::optional<mirror::highlighter_error> maybe_error = run_highlighter(code, color, sink, options);
+		BOOST_TEST_REQUIRE(!maybe_error.has_value());
+		BOOST_TEST(sink.error().empty());
+		BOOST_TEST(sink.num_output_bytes() == compressed.size());
+
+		std::string decompressed(std::get<std::string>(expected).size() + 1, '\0');
+		z_stream stream{};
+		BOOST_TEST_REQUIRE(inflateInit2(&stream, 15 + 16) == Z_OK);
+		stream.next_in = reinterpret_cast<Bytef*>(compressed.data());
+		stream.avail_in = static_cast<uInt>(compressed.size());
+		stream.next_out = reinterpret_cast<Bytef*>(decompressed.data());
+		stream.avail_out = static_cast<uInt>(decompressed.size());
+		BOOST_TEST(inflate(&stream, Z_FINISH) == Z_STREAM_END);
+		decompressed.resize(stream.total_out);
+		inflateEnd(&stream);
+
+		BOOST_TEST(decompressed == std::get<std::string>(expected));
+	}
+#endif
+
+	BOOST_AUTO_TEST_CASE(compact_class_names_are_unique)
+	{
+		std::set<std::string> names;
+		for (std::size_t i = 0; i < 52u * 62u * 2u; ++i) {
+			const std::string name = web::css_class_map::make_short_name(i);
+			BOOST_TEST_REQUIRE(!text::is_digit(name.front()));
+			BOOST_TEST_REQUIRE(names.insert(name).second);
+		}
+
+		BOOST_TEST(web::css_class_map::make_short_name(51).size() == 1u);
+		BOOST_TEST(web::css_class_map::make_short_name(52).size() == 2u);
+		BOOST_TEST(web::css_class_map::make_short_name(52u + 52u * 62u - 1u).size() == 2u);
+		BOOST_TEST(web::css_class_map::make_short_name(52u + 52u * 62u).size() == 3u);
+	}
+
+	BOOST_AUTO_TEST_CASE(class_map_copy_outlives_original)
+	{
+		std::optional<web::css_class_map> original(std::in_place);
+		const std::string a(original->short_name("keyword"));
+		const std::string b(original->short_name("var var_local"));
+
+		web::css_class_map copy(*original);
+		web::css_class_map assigned;
+		assigned = *original;
+		original.reset();
+
+		for (web::css_class_map* map : {&copy, &assigned}) {
+			BOOST_TEST(map->size() == 2u);
+			BOOST_TEST(map->short_name("keyword") == a);
+			BOOST_TEST(map->short_name("var var_local") == b);
+			BOOST_TEST(map->size() == 2u);
+		}
+
+		// moved-from map is empty and usable
+		web::css_class_map moved(std::move(copy));
+		BOOST_TEST(moved.short_name("keyword") == a);
+		BOOST_TEST(copy.empty());
+		BOOST_TEST(copy.short_name("num") == "a");
+	}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_AUTO_TEST_SUITE(highlighter_negative)
@@ -364,6 +1087,218 @@ BOOST_AUTO_TEST_SUITE(highlighter_negative)
 			gen_options));
 	}
 
+	BOOST_AUTO_TEST_CASE(cancellation)
+	{
+		std::string code;
+		std::string color;
+		for (int i = 0; i < 100; ++i) {
+			code += "x = y;\n";
+			color += "var = var;\n";
+		}
+
+		utility::cancellation_token token;
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.cancellation.token = &token;
+		options.generation.cancellation.check_interval = 16;
+
+		const std::variant<std::string, mirror::highlighter_error> not_cancelled = run_highlighter(code, color, options);
+		BOOST_TEST(std::holds_alternative<std::string>(not_cancelled));
+
+		const auto is_cancelled = [](const auto& result) {
+			const mirror::highlighter_error* const error = std::get_if<mirror::highlighter_error>(&result);
+			return error != nullptr && error->reason == mirror::errors::cancelled;
+		};
+
+		token.cancel();
+		BOOST_TEST(is_cancelled(run_highlighter(code, color, options)));
+		mirror::highlighter hl(options);
+		BOOST_TEST(is_cancelled(hl.run(code, color)));
+
+		token.reset();
+		options.generation.cancellation.deadline = std::chrono::steady_clock::now();
+		BOOST_TEST(is_cancelled(run_highlighter(code, color, options)));
+		utility::thread_pool pool(2);
+		BOOST_TEST(is_cancelled(run_highlighter(code, color, options, pool, 8)));
+	}
+
+	BOOST_AUTO_TEST_CASE(line_parallel_first_error)
+	{
+		std::string code;
+		std::string color;
+		for (int i = 0; i < 100; ++i) {
+			code += "x = y;\n";
+			// errors on lines 40 and 80
+			color += i == 40 || i == 80 ? "var = 1;\n" : "var = var;\n";
+		}
+
+		utility::thread_pool pool(4);
+		const mirror::highlighter_options options{{}, get_test_color_options()};
+
+		const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+		BOOST_TEST_REQUIRE(std::holds_alternative<mirror::highlighter_error>(expected));
+		const auto& expected_error = std::get<mirror::highlighter_error>(expected);
+		BOOST_TEST(expected_error.code_location.span().line == 40u);
+
+		const std::variant<std::string, mirror::highlighter_error> output =
+			run_highlighter(code, color, options, pool, 8);
+		BOOST_TEST_REQUIRE(std::holds_alternative<mirror::highlighter_error>(output));
+		const auto& error = std::get<mirror::highlighter_error>(output);
+
+		BOOST_TEST(error.reason == expected_error.reason);
+		BOOST_TEST(error.code_location.span().line == expected_error.code_location.span().line);
+		BOOST_TEST(error.code_location.span().column == expected_error.code_location.span().column);
+		BOOST_TEST(error.code_location.whole_line() == expected_error.code_location.whole_line());
+		BOOST_TEST(error.color_location.span().line == expected_error.color_location.span().line);
+		BOOST_TEST(error.color_location.str() == expected_error.color_location.str());
+	}
+
+	BOOST_AUTO_TEST_CASE(document_error)
+	{
+		std::string code;
+		std::string color;
+		for (int i = 0; i < 10; ++i) {
+			code += "x = y;\n";
+			color += "var = var;\n";
+		}
+
+		const mirror::highlighter_options options{{}, get_test_color_options()};
+		mirror::document doc(options);
+		const std::variant<std::string_view, mirror::highlighter_error> first = doc.update(code, color);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(first));
+		const std::string first_output(std::get<std::string_view>(first));
+
+		std::string bad_color = color;
+		bad_color.replace(bad_color.find("var = var;\n", 11 * 6), 11, "var = 1;\n");
+
+		const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, bad_color, options);
+		BOOST_TEST_REQUIRE(std::holds_alternative<mirror::highlighter_error>(expected));
+		const auto& expected_error = std::get<mirror::highlighter_error>(expected);
+
+		const std::variant<std::string_view, mirror::highlighter_error> output = doc.update(code, bad_color);
+		BOOST_TEST_REQUIRE(std::holds_alternative<mirror::highlighter_error>(output));
+		const auto& error = std::get<mirror::highlighter_error>(output);
+		BOOST_TEST(error.reason == expected_error.reason);
+		BOOST_TEST(error.code_location.span().line == expected_error.code_location.span().line);
+		BOOST_TEST(error.code_location.span().column == expected_error.code_location.span().column);
+		BOOST_TEST(error.color_location.span().line == expected_error.color_location.span().line);
+		BOOST_TEST(error.color_location.str() == expected_error.color_location.str());
+
+		// last successful state is kept
+		BOOST_TEST(doc.output() == first_output);
+		const std::variant<std::string_view, mirror::highlighter_error> fixed = doc.update(code, color);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(fixed));
+		BOOST_TEST(std::get<std::string_view>(fixed) == first_output);
+		BOOST_TEST(doc.num_highlighted_lines() == 0u);
+	}
+
+	BOOST_AUTO_TEST_CASE(line_streaming_error)
+	{
+		std::string code;
+		std::string color;
+		for (int i = 0; i < 10; ++i) {
+			code += "x = y;\n";
+			color += i == 6 ? "var = 1;\n" : "var = var;\n";
+		}
+
+		const mirror::highlighter_options options{{}, get_test_color_options()};
+		const std::variant<std::string, mirror::highlighter_error> expected = run_highlighter(code, color, options);
+		BOOST_TEST_REQUIRE(std::holds_alternative<mirror::highlighter_error>(expected));
+		const auto& expected_error = std::get<mirror::highlighter_error>(expected);
+
+		std::istringstream code_stream(code);
+		std::istringstream color_stream(color);
+		text::istream_line_source code_source(code_stream);
+		text::istream_line_source color_source(color_stream);
+		std::string output;
+		web::string_sink sink(output);
+		mirror::highlighter hl(options);
+		const std::optional<mirror::highlighter_error> maybe_error = hl.run(code_source, color_source, sink);
+		BOOST_TEST_REQUIRE(maybe_error.has_value());
+		BOOST_TEST(maybe_error->reason == expected_error.reason);
+		BOOST_TEST(maybe_error->code_location.span().line == expected_error.code_location.span().line);
+		BOOST_TEST(maybe_error->code_location.span().column == expected_error.code_location.span().column);
+		BOOST_TEST(maybe_error->code_location.whole_line() == expected_error.code_location.whole_line());
+		BOOST_TEST(maybe_error->color_location.str() == expected_error.color_location.str());
+	}
+
+	BOOST_AUTO_TEST_CASE(line_streaming_table_wrap)
+	{
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.table_wrap_css_class = "cpp";
+		std::istringstream code_stream("x");
+		std::istringstream color_stream("var");
+		text::istream_line_source code_source(code_stream);
+		text::istream_line_source color_source(color_stream);
+		std::string output;
+		web::string_sink sink(output);
+		mirror::highlighter hl(options);
+		const std::optional<mirror::highlighter_error> maybe_error = hl.run(code_source, color_source, sink);
+		BOOST_TEST_REQUIRE(maybe_error.has_value());
+		BOOST_TEST(maybe_error->reason == mirror::errors::streaming_table_wrap);
+	}
+
+	BOOST_AUTO_TEST_CASE(invalid_css_class_whole_word)
+	{
+		// a class which is only a suffix (or prefix) of a valid class is not valid
+		mirror::generation_options gen_options;
+		gen_options.valid_css_classes = "mykeyword keywords";
+		BOOST_TEST(run_and_expect_error(
+			"one",
+			"keyword",
+			mirror::highlighter_error{
+				text::located_span("keyword", 0, 0, 7),
+				text::located_span("one", 0, 0, 0),
+				mirror::errors::invalid_css_class
+			},
+			gen_options));
+	}
+
+	BOOST_AUTO_TEST_CASE(invalid_css_class_set_modified)
+	{
+		// modifying the set invalidates cached programs
+		web::css_class_set valid_classes("var");
+		mirror::color_program_cache cache;
+		mirror::generation_options gen_options;
+		gen_options.valid_css_class_set = &valid_classes;
+		gen_options.program_cache = &cache;
+		BOOST_TEST(run_and_compare("x", "var", "<span class=\"var\">x</span>", gen_options));
+
+		valid_classes.clear();
+		valid_classes.add("param");
+		BOOST_TEST(run_and_expect_error(
+			"x",
+			"var",
+			mirror::highlighter_error{
+				text::located_span("var", 0, 0, 3),
+				text::located_span("x", 0, 0, 0),
+				mirror::errors::invalid_css_class
+			},
+			gen_options));
+	}
+
+	BOOST_AUTO_TEST_CASE(invalid_css_class_program_cache)
+	{
+		// reported name is the one from options, not the hyphenated one
+		mirror::color_program_cache cache;
+		mirror::highlighter_options options{{}, get_test_color_options()};
+		options.generation.valid_css_classes = "var str";
+		options.generation.replace_underscores_to_hyphens = true;
+		options.generation.program_cache = &cache;
+
+		for (int i = 0; i < 2; ++i) {
+			const std::variant<std::string, mirror::highlighter_error> output =
+				run_highlighter("x = \"a\\n\"", "var = str", options);
+			BOOST_TEST_REQUIRE(std::holds_alternative<mirror::highlighter_error>(output));
+
+			const auto& error = std::get<mirror::highlighter_error>(output);
+			BOOST_TEST(error.reason == mirror::errors::invalid_css_class);
+			BOOST_TEST(error.extra_reason == "str_esc");
+			BOOST_TEST(error.color_location.str() == "str");
+		}
+
+		BOOST_TEST(cache.hits() == 1u);
+	}
+
 	BOOST_AUTO_TEST_CASE(exhausted_color)
 	{
 		BOOST_TEST(run_and_expect_error(
@@ -412,6 +1347,18 @@ BOOST_AUTO_TEST_SUITE(highlighter_negative)
 			}));
 	}
 
+	BOOST_AUTO_TEST_CASE(mismatched_symbol_in_run)
+	{
+		BOOST_TEST(run_and_expect_error(
+			"a->b;\nc",
+			"var-.var;\nvar",
+			mirror::highlighter_error{
+				text::located_span("var-.var;\n", 0, 4, 1),
+				text::located_span("a->b;\n", 0, 2, 1),
+				mirror::errors::mismatched_symbol
+			}));
+	}
+
 	BOOST_AUTO_TEST_CASE(expected_identifier_empty)
 	{
 		BOOST_TEST(run_and_expect_error(
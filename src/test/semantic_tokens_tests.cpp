@@ -1,11 +1,18 @@
+#include <ach/batch/core.hpp>
 #include <ach/clangd/core.hpp>
 #include <ach/clangd/code_token.hpp>
 #include <ach/clangd/code_tokenizer.hpp>
 #include <ach/clangd/highlighter_error.hpp>
 #include <ach/clangd/semantic_token.hpp>
 #include <ach/clangd/spliced_text_iterator.hpp>
+#include <ach/mirror/color_program.hpp>
+#include <ach/mirror/core.hpp>
+#include <ach/mirror/errors.hpp>
 #include <ach/text/types.hpp>
 #include <ach/text/utils.hpp>
+#include <ach/utility/arena.hpp>
+#include <ach/utility/retention.hpp>
+#include <ach/web/output_sink.hpp>
 
 #include "clangd_common.hpp"
 
@@ -13,7 +20,14 @@
 #include <boost/test/unit_test.hpp>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory_resource>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <string_view>
+#include <variant>
 
 namespace ach::clangd {
 
@@ -60,7 +74,7 @@ struct expected_token
 	const std::vector<expected_token>& expected_tokens)
 {
 	// tokenization - should always succeed
-	std::vector<code_token> code_tokens;
+	std::pmr::vector<code_token> code_tokens;
 	if (!fill_with_tokens(code, code_tokens))
 		return false;
 
@@ -357,6 +371,382 @@ BOOST_AUTO_TEST_CASE(semantic_tokens_preprocessor_disabled_code_and_macro_token)
 	);
 }
 
+BOOST_AUTO_TEST_CASE(export_program)
+{
+	// nested spans (tag in comment, escapes in literals), 2 classes (disabled code), multiline tokens
+	const std::string_view input =
+		"#ifdef MACRO\n"
+		"#include <header.h>\n"
+		"#endif\n"
+		"/* TODO: multi\n"
+		"   line */\n"
+		"const char* s = \"a\\tb\"; // FIXME & <x>\n"
+		"int x = 'c' + 0x1F;\n";
+
+	semantic_token_info sti_dc{semantic_token_type::disabled_code, semantic_token_modifiers{}};
+	semantic_token_info sti_var{semantic_token_type::variable, semantic_token_modifiers{}.declaration().scope_global()};
+
+	const std::vector<semantic_token> sem_tokens = {
+		semantic_token{{1, 0}, 19, sti_dc, {}},
+		semantic_token{{5, 12}, 1, sti_var, {}},
+		semantic_token{{6, 4}, 1, sti_var, {}},
+	};
+	const utility::range<const semantic_token*> sem_range = {sem_tokens.data(), sem_tokens.data() + sem_tokens.size()};
+
+	const highlighter hl(keywords);
+	mirror::color_program program;
+	const std::optional<highlighter_error> export_error = hl.export_program(input, sem_range, program);
+	BOOST_TEST_REQUIRE(!export_error.has_value(), *export_error);
+	BOOST_TEST(program.is_built());
+
+	web::css_class_map class_map = make_css_class_map();
+	highlighter_options options[4];
+	options[1].coalesce_spans = true;
+	options[1].whitespace_insensitive_css_classes = "com-single";
+	options[2].table_wrap_css_class = "cpp";
+	options[3].class_map = &class_map;
+
+	std::string stored;
+	BOOST_TEST_REQUIRE(program.serialize(stored));
+	mirror::color_program loaded;
+	BOOST_TEST_REQUIRE(loaded.deserialize(stored));
+
+	for (const highlighter_options& opts : options) {
+		const std::variant<std::string, highlighter_error> expected = hl.run(input, sem_range, opts);
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+		for (const mirror::color_program* p : {&program, &loaded}) {
+			const std::variant<std::string, mirror::highlighter_error> replayed =
+				mirror::run_highlighter(input, *p, to_replay_options(opts));
+			BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(replayed));
+			BOOST_TEST(std::get<std::string>(replayed) == std::get<std::string>(expected));
+		}
+	}
+
+	// truncated or corrupted
+	BOOST_TEST(!loaded.deserialize(std::string_view(stored).substr(0, stored.size() - 1)));
+	BOOST_TEST(loaded.instructions().empty());
+	BOOST_TEST(!loaded.deserialize("ACHP"));
+	BOOST_TEST(!loaded.deserialize(stored + "x"));
+
+	// class names would be output unescaped: markup can not be injected
+	for (char c : {'"', '<', ' '}) {
+		std::string tampered = stored;
+		const std::size_t name_pos = tampered.find("keyword");
+		BOOST_TEST_REQUIRE(name_pos != std::string::npos);
+		tampered[name_pos + 3] = c;
+		BOOST_TEST(!loaded.deserialize(tampered));
+		BOOST_TEST(loaded.instructions().empty());
+	}
+
+	// compiled from color: stored as color text
+	BOOST_TEST(!mirror::color_program("keyword", mirror::highlighter_options{}).serialize(stored));
+}
+
+BOOST_AUTO_TEST_CASE(export_program_different_code)
+{
+	const std::string_view input = "int x;\n";
+	const highlighter hl(keywords);
+	mirror::color_program program;
+	BOOST_TEST_REQUIRE(!hl.export_program(input, {}, program).has_value());
+
+	const auto longer = mirror::run_highlighter("int x;\nint y;\n", program);
+	BOOST_TEST_REQUIRE(std::holds_alternative<mirror::highlighter_error>(longer));
+	BOOST_TEST(std::get<mirror::highlighter_error>(longer).reason == mirror::errors::exhausted_color);
+
+	const auto shorter = mirror::run_highlighter("int;\n", program);
+	BOOST_TEST_REQUIRE(std::holds_alternative<mirror::highlighter_error>(shorter));
+	BOOST_TEST(std::get<mirror::highlighter_error>(shorter).color_location.whole_line().empty());
+}
+
+// meant to be run with ThreadSanitizer (ACH_ENABLE_THREAD_SANITIZER) but checks results anyway
+BOOST_AUTO_TEST_CASE(shared_highlighter_threads)
+{
+	const std::string_view input =
+		"#include <cstdio>\n"
+		"/* TODO */ int main() { std::printf(\"%d\\n\", 42); }\n";
+
+	semantic_token_info sti_fn{semantic_token_type::function, semantic_token_modifiers{}.from_std_lib()};
+	const std::vector<semantic_token> sem_tokens = {
+		semantic_token{{1, 28}, 6u, sti_fn, {}},
+	};
+	const utility::range<const semantic_token*> sem_range = {sem_tokens.data(), sem_tokens.data() + sem_tokens.size()};
+
+	const highlighter hl(keywords);
+	highlighter_options coalesced;
+	coalesced.coalesce_spans = true;
+
+	const auto expected = hl.run(input, sem_range);
+	const auto expected_coalesced = hl.run(input, sem_range, coalesced);
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected_coalesced));
+
+	constexpr int num_threads = 8;
+	constexpr int num_runs = 200;
+	std::atomic<int> num_mismatches = 0;
+	std::vector<std::thread> threads;
+	for (int t = 0; t < num_threads; ++t) {
+		threads.emplace_back([&, t]() {
+			highlighter_context own_context;
+			for (int i = 0; i < num_runs; ++i) {
+				// all entry points: pooled, pooled streaming, own context, export
+				const bool coalesce = (i + t) % 2 == 0;
+				const std::string& reference = std::get<std::string>(coalesce ? expected_coalesced : expected);
+				const highlighter_options& options = coalesce ? coalesced : highlighter_options{};
+
+				switch (i % 4) {
+					case 0: {
+						const auto result = hl.run(input, sem_range, options);
+						num_mismatches += !std::holds_alternative<std::string>(result) || std::get<std::string>(result) != reference;
+						break;
+					}
+					case 1: {
+						std::ostringstream os;
+						web::ostream_sink sink(os);
+						num_mismatches += hl.run(input, sem_range, sink, options).has_value() || os.str() != reference;
+						break;
+					}
+					case 2: {
+						const auto result = hl.run(own_context, input, sem_range, options);
+						num_mismatches += !std::holds_alternative<std::string_view>(result) || std::get<std::string_view>(result) != reference;
+						break;
+					}
+					default: {
+						mirror::color_program program;
+						num_mismatches += hl.export_program(input, sem_range, program).has_value() || program.instructions().empty();
+						break;
+					}
+				}
+
+				(void) hl.num_code_tokens();
+			}
+		});
+	}
+
+	for (std::thread& thread : threads)
+		thread.join();
+
+	BOOST_TEST(num_mismatches == 0);
+}
+
+BOOST_AUTO_TEST_CASE(cancellation)
+{
+	const std::string_view input =
+		"#include <cstdio>\n"
+		"/* TODO */ int main() { std::printf(\"%d\\n\", 42); }\n";
+
+	semantic_token_info sti_fn{semantic_token_type::function, semantic_token_modifiers{}.from_std_lib()};
+	const std::vector<semantic_token> sem_tokens = {
+		semantic_token{{1, 28}, 6u, sti_fn, {}},
+	};
+	const utility::range<const semantic_token*> sem_range = {sem_tokens.data(), sem_tokens.data() + sem_tokens.size()};
+
+	const highlighter hl(keywords);
+	const auto expected = hl.run(input, sem_range);
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+	// set but not triggered: same output
+	utility::cancellation_token token;
+	highlighter_options options;
+	options.cancellation.token = &token;
+	options.cancellation.deadline = std::chrono::steady_clock::now() + std::chrono::hours(1);
+	options.cancellation.check_interval = 1;
+	const auto not_cancelled = hl.run(input, sem_range, options);
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(not_cancelled));
+	BOOST_TEST(std::get<std::string>(not_cancelled) == std::get<std::string>(expected));
+
+	const auto is_cancelled = [](const auto& result) {
+		const highlighter_error* const error = std::get_if<highlighter_error>(&result);
+		return error != nullptr && error->reason == error_reason::cancelled;
+	};
+
+	token.cancel();
+	BOOST_TEST(is_cancelled(hl.run(input, sem_range, options)));
+	std::ostringstream os;
+	web::ostream_sink sink(os);
+	const std::optional<highlighter_error> streaming_error = hl.run(input, sem_range, sink, options);
+	BOOST_TEST_REQUIRE(streaming_error.has_value());
+	BOOST_TEST((streaming_error->reason == error_reason::cancelled));
+	mirror::color_program program;
+	const std::optional<highlighter_error> export_error = hl.export_program(input, sem_range, program, options);
+	BOOST_TEST_REQUIRE(export_error.has_value());
+	BOOST_TEST((export_error->reason == error_reason::cancelled));
+
+	token.reset();
+	options.cancellation.deadline = std::chrono::steady_clock::now() - std::chrono::seconds(1);
+	BOOST_TEST(is_cancelled(hl.run(input, sem_range, options)));
+
+	// every stage checks on its own
+	std::pmr::vector<code_token> code_tokens;
+	const auto tokenizer_error = code_tokenizer(input, {keywords.begin(), keywords.end()})
+		.fill_with_tokens(false, code_tokens, options.cancellation);
+	BOOST_TEST_REQUIRE(tokenizer_error.has_value());
+	BOOST_TEST((tokenizer_error->reason == error_reason::cancelled));
+
+	BOOST_TEST_REQUIRE(!code_tokenizer(input, {keywords.begin(), keywords.end()}).fill_with_tokens(false, code_tokens).has_value());
+	const auto merge_error = improve_code_tokens(input, code_tokens, sem_range, options.cancellation);
+	BOOST_TEST_REQUIRE(merge_error.has_value());
+	BOOST_TEST((merge_error->reason == error_reason::cancelled));
+}
+
+BOOST_AUTO_TEST_CASE(arena_allocation)
+{
+	const std::string_view input =
+		"#define MAX(a, b) ((a) > (b) ? (a) : (b))\n"
+		"/* TODO */ int main() { std::printf(\"%d\\n\", MAX(1, 2)); }\n";
+
+	semantic_token_info sti_fn{semantic_token_type::function, semantic_token_modifiers{}.from_std_lib()};
+	const std::vector<semantic_token> sem_tokens = {
+		semantic_token{{1, 28}, 6u, sti_fn, {}},
+	};
+	const utility::range<const semantic_token*> sem_range = {sem_tokens.data(), sem_tokens.data() + sem_tokens.size()};
+
+	const highlighter hl(keywords);
+	highlighter_options options;
+	options.table_wrap_css_class = "cpp";
+	const auto expected = hl.run(input, sem_range, options);
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(expected));
+
+	// no upstream: running out of the inline block would throw
+	utility::arena<32 * 1024> arena(std::pmr::null_memory_resource());
+	for (int i = 0; i < 3; ++i) {
+		// objects using the arena are gone before it is released
+		{
+			highlighter_context context(arena.resource());
+			std::pmr::string output(arena.resource());
+			web::pmr_string_sink sink(output);
+			BOOST_TEST_REQUIRE(!hl.run(context, input, sem_range, sink, options).has_value());
+			BOOST_TEST(std::string_view(output) == std::get<std::string>(expected));
+			BOOST_TEST(context.resource() == arena.resource());
+			BOOST_TEST(!context.code_tokens.empty());
+		}
+
+		arena.release();
+	}
+
+	// a context with its own resource also works with the non-streaming overload
+	highlighter_context context(arena.resource());
+	const auto result = hl.run(context, input, sem_range, options);
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(result));
+	BOOST_TEST(std::get<std::string_view>(result) == std::get<std::string>(expected));
+}
+
+BOOST_AUTO_TEST_CASE(retention)
+{
+	std::string large_input;
+	for (int i = 0; i < 2000; ++i)
+		large_input += "int x = 1; // comment\n";
+	const std::string_view small_input = "int x;\n";
+	constexpr std::size_t max_retained_bytes = 64 * 1024;
+
+	// no policy: memory of the largest run is kept
+	const highlighter unlimited(keywords);
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(unlimited.run(large_input, {})));
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(unlimited.run(small_input, {})));
+	BOOST_TEST(unlimited.retained_bytes() > max_retained_bytes);
+
+	// pooled contexts are trimmed right after their run
+	const highlighter capped(keywords, utility::retention_policy{max_retained_bytes, 0});
+	const auto large_output = capped.run(large_input, {});
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(large_output));
+	BOOST_TEST(std::get<std::string>(large_output) == std::get<std::string>(unlimited.run(large_input, {})));
+	BOOST_TEST(capped.retained_bytes() <= max_retained_bytes);
+
+	// explicit context: trimmed at the start of the next run, output stays valid until then
+	highlighter_context context;
+	context.retention.max_retained_bytes = max_retained_bytes;
+	const auto context_output = capped.run(context, large_input, {});
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(context_output));
+	BOOST_TEST(std::get<std::string_view>(context_output) == std::get<std::string>(large_output));
+	BOOST_TEST(context.retained_bytes() > max_retained_bytes);
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(capped.run(context, small_input, {})));
+	BOOST_TEST(context.retained_bytes() <= max_retained_bytes);
+
+	// decay: released after a number of small runs
+	highlighter_context decaying;
+	decaying.retention.decay_after_runs = 3;
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(unlimited.run(decaying, large_input, {})));
+	decaying.trim();
+	const std::size_t large_bytes = decaying.retained_bytes();
+	for (int i = 0; i < 2; ++i) {
+		BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(unlimited.run(decaying, small_input, {})));
+		decaying.trim();
+		BOOST_TEST(decaying.retained_bytes() == large_bytes);
+	}
+
+	BOOST_TEST_REQUIRE(std::holds_alternative<std::string_view>(unlimited.run(decaying, small_input, {})));
+	decaying.trim();
+	BOOST_TEST(decaying.retained_bytes() < large_bytes / 100);
+}
+
+BOOST_AUTO_TEST_CASE(batch_mixed_engines)
+{
+	const std::string_view input =
+		"#include <cstdio>\n"
+		"/* TODO */ int main() { std::printf(\"%d\\n\", 42); }\n";
+
+	semantic_token_info sti_fn{semantic_token_type::function, semantic_token_modifiers{}.from_std_lib()};
+	const std::vector<semantic_token> sem_tokens = {
+		semantic_token{{1, 28}, 6u, sti_fn, {}},
+	};
+	const utility::range<const semantic_token*> sem_range = {sem_tokens.data(), sem_tokens.data() + sem_tokens.size()};
+	// a token past the end of the code
+	const std::vector<semantic_token> bad_tokens = {
+		semantic_token{{5, 0}, 6u, sti_fn, {}},
+	};
+
+	const highlighter hl(keywords);
+	highlighter_options coalesced;
+	coalesced.coalesce_spans = true;
+	const mirror::highlighter_options mirror_options;
+
+	std::vector<batch::job> jobs;
+	for (int i = 0; i < 50; ++i) {
+		if (i % 3 == 0)
+			jobs.push_back(batch::mirror_job{"int x", "keyword var", &mirror_options});
+		else if (i % 7 == 0)
+			jobs.push_back(batch::clangd_job{&hl, input, {bad_tokens.data(), bad_tokens.data() + bad_tokens.size()}, {}});
+		else
+			jobs.push_back(batch::clangd_job{&hl, input, sem_range, i % 2 == 0 ? coalesced : highlighter_options{}});
+	}
+
+	batch::scheduler scheduler(4);
+	// twice: worker memory is reused between runs
+	for (int run = 0; run < 2; ++run) {
+		const std::vector<batch::job_result> results = scheduler.run(jobs);
+		BOOST_TEST_REQUIRE(results.size() == jobs.size());
+
+		for (std::size_t i = 0; i < jobs.size(); ++i) {
+			if (const auto job = std::get_if<batch::mirror_job>(&jobs[i]); job != nullptr) {
+				const auto expected = mirror::run_highlighter(job->code, job->color, *job->options);
+				BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(results[i]));
+				BOOST_TEST(std::get<std::string>(results[i]) == std::get<std::string>(expected));
+				continue;
+			}
+
+			const auto& job = std::get<batch::clangd_job>(jobs[i]);
+			const auto expected = hl.run(job.code, job.semantic_tokens, job.options);
+			if (std::holds_alternative<highlighter_error>(expected)) {
+				BOOST_TEST(std::holds_alternative<highlighter_error>(results[i]));
+			}
+			else {
+				BOOST_TEST_REQUIRE(std::holds_alternative<std::string>(results[i]));
+				BOOST_TEST(std::get<std::string>(results[i]) == std::get<std::string>(expected));
+			}
+		}
+
+		const batch::batch_stats stats = scheduler.stats();
+		BOOST_TEST(stats.num_tasks == jobs.size());
+		BOOST_TEST(stats.num_split_jobs == 0u);
+		std::size_t num_tasks = 0;
+		for (const batch::worker_stats& worker : stats.workers)
+			num_tasks += worker.num_tasks;
+		BOOST_TEST(num_tasks == jobs.size());
+	}
+
+	BOOST_TEST(scheduler.run({}).empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 }
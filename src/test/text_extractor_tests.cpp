@@ -1,8 +1,11 @@
 #include <ach/text/extractor.hpp>
+#include <ach/text/scan.hpp>
 
 #include <boost/test/unit_test.hpp>
 
 #include <initializer_list>
+#include <random>
+#include <string>
 
 namespace ut = boost::unit_test;
 namespace tt = boost::test_tools;
@@ -297,5 +300,99 @@ BOOST_AUTO_TEST_SUITE(text_extractor_suite)
 			BOOST_TEST(test_text_extractor("ccc7 x\nX`Z __123 a % 5\n*$'a\\bc' ''", steps));
 		}
 
+		// longer than SIMD blocks
+		BOOST_AUTO_TEST_CASE(long_tokens)
+		{
+			auto steps = {
+				extraction_step(extraction_operation::identifier, "abcdefghijklmnopqrstuvwxyz_0123456789ABCDEF", 0, 0),
+				extraction_step("                                   ", 0, 43),
+				extraction_step(extraction_operation::digits, "12345678901234567890123456789", 0, 78),
+				extraction_step(extraction_operation::quoted, R"('abcdefghijklmno\'pqrstuvwxyz0123456789')", 0, 107),
+				extraction_step(extraction_operation::until_end_of_line, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", 0, 147)
+			};
+			BOOST_TEST(test_text_extractor(
+				"abcdefghijklmnopqrstuvwxyz_0123456789ABCDEF                                   "
+				"12345678901234567890123456789'abcdefghijklmno\\'pqrstuvwxyz0123456789'"
+				"xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", steps));
+		}
+
+		BOOST_AUTO_TEST_CASE(long_quoted_unterminated)
+		{
+			ach::text::extractor te(R"('abcdefghijklmnopqrstuvwxyz0123456789 \')");
+			BOOST_TEST(te.extract_quoted('\'', '\\').is_empty());
+			ach::text::extractor te2(R"('abcdefghijklmnopqrstuvwxyz0123456789 \)");
+			BOOST_TEST(te2.extract_quoted('\'', '\\').is_empty());
+		}
+
 	BOOST_AUTO_TEST_SUITE_END()
 BOOST_AUTO_TEST_SUITE_END()
+
+
+BOOST_AUTO_TEST_SUITE(text_scan_suite)
+
+	BOOST_AUTO_TEST_CASE(char_class_table)
+	{
+		using namespace ach::text;
+
+		for (int i = 0; i < 256; ++i) {
+			const char c = static_cast<char>(i);
+			BOOST_TEST_CONTEXT("character " << i) {
+				BOOST_TEST(is_digit(c) == has_char_class(c, char_class::digit));
+				BOOST_TEST(is_alpha(c) == (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z')));
+				BOOST_TEST(is_digit_hex(c) == (is_digit(c) || ('a' <= c && c <= 'f') || ('A' <= c && c <= 'F')));
+				BOOST_TEST(is_alnum_or_underscore(c) == (is_alnum(c) || c == '_'));
+				BOOST_TEST(is_non_newline_whitespace(c) == (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v'));
+				BOOST_TEST(is_whitespace(c) == (is_non_newline_whitespace(c) || c == '\n'));
+			}
+		}
+	}
+
+	// SIMD and scalar implementations must agree, including bytes >= 0x80 and block tails
+	BOOST_AUTO_TEST_CASE(simd_matches_scalar)
+	{
+		using namespace ach::text;
+
+		std::mt19937 gen(12345);
+		// mostly identifier characters so that class runs are long
+		const std::string common = "abcxyzABCXYZ_0189";
+		std::uniform_int_distribution<int> dist(0, 3 * static_cast<int>(common.size()));
+		std::uniform_int_distribution<int> any_byte(0, 255);
+
+		const unsigned char masks[] = {
+			char_class::alnum | char_class::underscore,
+			char_class::alpha | char_class::underscore,
+			char_class::digit,
+			char_class::non_newline_whitespace,
+			char_class::whitespace,
+			char_class::digit | char_class::hex_letter
+		};
+
+		for (int n = 0; n < 200; ++n) {
+			std::string text;
+			const int length = n % 100;
+			for (int i = 0; i < length; ++i) {
+				const int r = dist(gen);
+				if (r < static_cast<int>(common.size()) * 3 - 4)
+					text += common[r % common.size()];
+				else
+					text += static_cast<char>(any_byte(gen));
+			}
+
+			const char* const first = text.data();
+			const char* const last = text.data() + text.size();
+
+			for (std::size_t offset = 0; offset <= text.size(); ++offset) {
+				BOOST_TEST_CONTEXT("text " << n << ", offset " << offset) {
+					const char* const f = first + offset;
+					BOOST_TEST((find_char(f, last, '\n') == scalar::find_char(f, last, '\n')));
+					BOOST_TEST((find_either(f, last, '"', '\\') == scalar::find_either(f, last, '"', '\\')));
+					BOOST_TEST((find_either(f, last, 'Z', static_cast<char>(0xF0)) == scalar::find_either(f, last, 'Z', static_cast<char>(0xF0))));
+
+					for (unsigned char mask : masks)
+						BOOST_TEST((find_first_not_of_class(f, last, mask) == scalar::find_first_not_of_class(f, last, mask)));
+				}
+			}
+		}
+	}
+
+BOOST_AUTO_TEST_SUITE_END()